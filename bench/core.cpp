@@ -0,0 +1,347 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+// Throughput of the runtime core on host, without node or the addon:
+// Forward chains (also run-to-completion), Split fan-out, queue wraparound near MAX_MESSAGES,
+// ToString bursts, ticks with many timers running and GraphStreamer on large v1 and v2 command streams.
+// Results are written as JSON to stdout, for comparing between releases.
+// Usage: bench-core [scale]
+
+#define MICROFLO_NO_MAIN
+#include "microflo.hpp"
+#include "host.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef MICROFLO_VERSION
+#define MICROFLO_VERSION "unknown"
+#endif
+
+// Counts serial output instead of writing it
+class StubIO : public HostIO {
+public:
+    StubIO() : written(0) {}
+    virtual void SerialWrite(int serialDevice, unsigned char b) {
+        written++;
+    }
+    long written;
+};
+
+// Emits up to @perTick integers on every tick, until @total have been sent
+class Generator : public Component {
+public:
+    Generator(long total, int perTick) : remaining(total), perTick(perTick) { subscribeTicks(); }
+    virtual void process(const Packet &in, int port) {
+        if (in.isTick()) {
+            for (int i=0; i<perTick && remaining > 0; i++) {
+                send(Packet(remaining--));
+            }
+        }
+    }
+    long remaining;
+    int perTick;
+};
+
+class Counter : public Component {
+public:
+    Counter() : received(0) {}
+    virtual void process(const Packet &in, int port) {
+        if (in.isData()) {
+            received++;
+        }
+    }
+    long received;
+};
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec/1e9;
+}
+
+struct Result {
+    const char *name;
+    const char *unit; // what is being counted: packet, number or byte
+    long parameter;
+    const char *parameterName;
+    long count;
+    double seconds;
+    unsigned int dropped;
+};
+
+static unsigned int droppedIn(const Network &net) {
+    unsigned int dropped = net.externalMessagesDropped();
+    for (int i=0; i<net.connectionCount(); i++) {
+        dropped += net.connectionAt(i).dropped;
+    }
+    return dropped;
+}
+
+// Ticks until @done() returns true
+template <class Done>
+static double runUntil(Network &net, Done done) {
+    const double start = now();
+    while (!done()) {
+        net.runTick();
+    }
+    return now() - start;
+}
+
+struct ReceivedAll {
+    ReceivedAll(Counter **sinks, int count, long expected) : sinks(sinks), count(count), expected(expected) {}
+    bool operator()() const {
+        long received = 0;
+        for (int i=0; i<count; i++) {
+            received += sinks[i]->received;
+        }
+        return received >= expected;
+    }
+    Counter **sinks;
+    int count;
+    long expected;
+};
+
+// Packets delivered per hop through @length Forward nodes.
+// With a @tickBudget, in run-to-completion mode
+static Result benchChain(long packets, int length, long tickBudget=0) {
+    const int fits = MAX_MESSAGES/(length+1);
+    const int capacity = (fits < 32) ? fits : 32;
+    StubIO io;
+    Network *net = new Network(&io);
+    net->setRunToCompletion(tickBudget);
+    int previous = net->addNode(new Generator(packets, capacity));
+    for (int i=0; i<length; i++) {
+        const int node = net->addNode(Component::create(IdForward));
+        net->connect(previous, 0, node, 0, capacity);
+        previous = node;
+    }
+    Counter *sink = new Counter;
+    net->connect(previous, 0, net->addNode(sink), 0, capacity);
+    net->runSetup();
+
+    Result r = { tickBudget ? "chain-complete" : "chain", "packet", length, "length", packets*(length+1), 0, 0 };
+    r.seconds = runUntil(*net, ReceivedAll(&sink, 1, packets));
+    r.dropped = droppedIn(*net);
+    delete net;
+    return r;
+}
+
+// Each packet into Split is delivered to all of its outputs
+static Result benchSplit(long packets) {
+    using namespace SplitPorts;
+    const int width = OutPorts::out9+1;
+    const int capacity = 16;
+    StubIO io;
+    Network *net = new Network(&io);
+    const int generator = net->addNode(new Generator(packets, capacity));
+    const int split = net->addNode(Component::create(IdSplit));
+    net->connect(generator, 0, split, 0, capacity);
+    Counter *sinks[width];
+    for (int i=0; i<width; i++) {
+        sinks[i] = new Counter;
+        net->connect(split, i, net->addNode(sinks[i]), 0, capacity);
+    }
+    net->runSetup();
+
+    Result r = { "split", "packet", width, "width", packets*(1+width), 0, 0 };
+    r.seconds = runUntil(*net, ReceivedAll(sinks, width, packets*width));
+    r.dropped = droppedIn(*net);
+    delete net;
+    return r;
+}
+
+// One queue using all of the message storage, filled almost completely on every
+// tick, so head and tail keep wrapping around at the end of the storage
+static Result benchWraparound(long packets) {
+    const int capacity = MAX_MESSAGES;
+    StubIO io;
+    Network *net = new Network(&io);
+    const int generator = net->addNode(new Generator(packets, capacity-1));
+    Counter *sink = new Counter;
+    net->connect(generator, 0, net->addNode(sink), 0, capacity, OverflowDropNewest);
+    net->runSetup();
+
+    Result r = { "wraparound", "packet", capacity, "capacity", packets, 0, 0 };
+    r.seconds = runUntil(*net, ReceivedAll(&sink, 1, packets));
+    r.dropped = droppedIn(*net);
+    delete net;
+    return r;
+}
+
+// Integers formatted by ToString and written by SerialOut. Counts input numbers
+static Result benchToString(long numbers) {
+    const int capacity = 32;
+    StubIO io;
+    Network *net = new Network(&io);
+    Generator *generator = new Generator(numbers, 4);
+    const int toString = net->addNode(Component::create(IdToString));
+    const int serialOut = net->addNode(Component::create(IdSerialOut));
+    net->connect(net->addNode(generator), 0, toString, 0, capacity);
+    net->connect(toString, 0, serialOut, 0, capacity);
+    net->runSetup();
+
+    Result r = { "tostring", "number", 0, "bytes", numbers, 0, 0 };
+    const double start = now();
+    long written = -1;
+    while (generator->remaining > 0 || io.written != written) {
+        written = io.written;
+        net->runTick();
+    }
+    r.seconds = now() - start;
+    r.parameter = io.written;
+    r.dropped = droppedIn(*net);
+    delete net;
+    return r;
+}
+
+// Appends an unsigned LEB128 varint, as in v2 command streams
+// Idle ticks with @timers Timer nodes running, which are not due during the run
+static Result benchTimers(long ticks, int timers) {
+    using namespace TimerPorts;
+    StubIO io;
+    Network *net = new Network(&io);
+    for (int i=0; i<timers; i++) {
+        const int timer = net->addNode(Component::create(IdTimer));
+        net->sendMessage(timer, InPorts::interval, Packet(1000000L+i));
+        net->sendMessage(timer, InPorts::enable, Packet(true));
+        if (i % (MAX_EXTERNAL_MESSAGES/2) == 0) {
+            net->runTick(); // keep the external queue from filling up
+        }
+    }
+    net->runSetup();
+    net->runTick();
+
+    Result r = { "timers", "tick", timers, "timers", ticks, 0, 0 };
+    const double start = now();
+    for (long i=0; i<ticks; i++) {
+        net->runTick();
+    }
+    r.seconds = now() - start;
+    r.dropped = droppedIn(*net);
+    delete net;
+    return r;
+}
+
+static unsigned char *writeVarint(unsigned char *out, unsigned long value) {
+    do {
+        const unsigned char b = value & 0x7f;
+        value >>= 7;
+        *out++ = value ? (b | 0x80) : b;
+    } while (value);
+    return out;
+}
+
+static unsigned char *writeCommand(unsigned char *out, int version, GraphCmd cmd,
+                                   int a=0, int b=0, int type=0, int value=0) {
+    if (version == 1) {
+        memset(out, 0, GRAPH_CMD_SIZE);
+        out[0] = cmd;
+        out[1] = a;
+        out[2] = b;
+        out[3] = type;
+        out[4] = value;
+        return out + GRAPH_CMD_SIZE;
+    }
+    *out++ = cmd;
+    if (cmd == GraphCmdCreateComponent) {
+        out = writeVarint(out, a);
+    } else if (cmd == GraphCmdConnectNodes) {
+        out = writeVarint(out, a);
+        out = writeVarint(out, b);
+        memset(out, 0, 4); // ports and capacity, then the overflow policy
+        out += 4;
+    } else if (cmd == GraphCmdSendPacket) {
+        out = writeVarint(out, a);
+        out = writeVarint(out, b);
+        *out++ = type;
+        out = writeVarint(out, 2*value); // zigzag, for the non-negative integers used here
+    }
+    return out;
+}
+
+// A stream of @graphs graphs of @nodes Forward in a chain, each preceded by Reset,
+// parsed one byte at a time or in bulk with GraphStreamer::parse().
+// In v1 as many nodes as the one byte node ids allow
+static Result benchParse(const char *name, int version, bool bulk, int graphs, int nodes) {
+    const unsigned char magic[GRAPH_MAGIC_SIZE] = { GRAPH_MAGIC };
+    const unsigned char magicV2[GRAPH_MAGIC_SIZE] = { GRAPH_MAGIC_V2 };
+    const size_t perGraph = 2*GRAPH_CMD_SIZE * (1 + nodes + (nodes-1) + 1); // v2 commands may be longer
+    unsigned char *stream = (unsigned char *)calloc(GRAPH_MAGIC_SIZE + perGraph*graphs, 1);
+    unsigned char *cmd = stream;
+    memcpy(cmd, (version == 1) ? magic : magicV2, GRAPH_MAGIC_SIZE);
+    cmd += GRAPH_MAGIC_SIZE;
+    for (int g=0; g<graphs; g++) {
+        cmd = writeCommand(cmd, version, GraphCmdReset);
+        for (int n=0; n<nodes; n++) {
+            cmd = writeCommand(cmd, version, GraphCmdCreateComponent, IdForward);
+        }
+        for (int n=0; n<nodes-1; n++) {
+            cmd = writeCommand(cmd, version, GraphCmdConnectNodes, n, n+1);
+        }
+        cmd = writeCommand(cmd, version, GraphCmdSendPacket, 0, 0, MsgInteger, g & 0x7f);
+    }
+    const size_t size = cmd - stream;
+
+    StubIO io;
+    Network *net = new Network(&io);
+    GraphStreamer parser;
+    parser.setNetwork(net);
+    const double start = now();
+    if (bulk) {
+        parser.parse(stream, size);
+    } else {
+        for (size_t i=0; i<size; i++) {
+            parser.parseByte(stream[i]);
+        }
+    }
+    Result r = { name, "byte", graphs, "graphs", (long)size, now() - start, 0 };
+    r.dropped = droppedIn(*net);
+    net->reset();
+    delete net;
+    free(stream);
+    return r;
+}
+
+static void report(const Result &r, bool last) {
+    printf("    {\"name\": \"%s\", \"%s\": %ld, \"unit\": \"%s\", \"count\": %ld, \"seconds\": %.6f, "
+           "\"per_second\": %.0f, \"ns_per_unit\": %.2f, \"dropped\": %u}%s\n",
+           r.name, r.parameterName, r.parameter, r.unit, r.count, r.seconds,
+           r.count/r.seconds, r.seconds*1e9/r.count, r.dropped, last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    const long scale = (argc > 1) ? atol(argv[1]) : 1;
+    const int parseNodes = (MAX_NODES < 256) ? MAX_NODES : 256;
+    const Result results[] = {
+        benchChain(scale*200000, 10),
+        benchChain(scale*20000, MAX_NODES-2),
+        benchChain(scale*200000, 10, MAX_MESSAGES),
+        benchSplit(scale*200000),
+        benchWraparound(scale*5000000),
+        benchToString(scale*200000),
+        benchTimers(scale*2000000, 100),
+        benchTimers(scale*2000000, MAX_NODES),
+        benchParse("parse", 1, false, scale*500, parseNodes),
+        benchParse("parse-bulk", 1, true, scale*500, parseNodes),
+        benchParse("parse-v2", 2, true, scale*500, parseNodes),
+        benchParse("parse-v2-large", 2, true, scale*100, MAX_NODES),
+    };
+    const int count = sizeof(results)/sizeof(results[0]);
+
+    printf("{\n");
+    printf("  \"version\": \"%s\",\n", MICROFLO_VERSION);
+    printf("  \"max_nodes\": %d, \"max_messages\": %d, \"packet_size\": %zu,\n",
+           MAX_NODES, MAX_MESSAGES, sizeof(Packet));
+    printf("  \"results\": [\n");
+    for (int i=0; i<count; i++) {
+        report(results[i], i == count-1);
+    }
+    printf("  ]\n");
+    printf("}\n");
+    return 0;
+}
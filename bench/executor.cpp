@@ -0,0 +1,150 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+// Throughput of the single-threaded Network vs WorkStealingExecutor,
+// on a long chain of Forward and on a two-level fan-out, through Split or native.
+// Usage: bench-executor [packets] [chainLength]
+
+#define MICROFLO_NO_MAIN
+#include "microflo.hpp"
+#include "host.hpp"
+#include "executor.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const int burst = 32; // packets per tick from the generator, also the queue capacity
+
+// Emits @burst integers per tick until @total have been sent
+class Generator : public Component {
+public:
+    Generator(long total) : remaining(total) { subscribeTicks(); }
+    virtual void process(const Packet &in, int port) {
+        if (in.isTick()) {
+            for (int i=0; i<burst && remaining > 0; i++) {
+                send(Packet(remaining--));
+            }
+        }
+    }
+    long remaining;
+};
+
+class Counter : public Component {
+public:
+    Counter() : received(0) {}
+    virtual void process(const Packet &in, int port) {
+        if (in.isData()) {
+            __atomic_fetch_add(&received, 1, __ATOMIC_RELAXED);
+        }
+    }
+    long received;
+};
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec/1e9;
+}
+
+struct Result {
+    double seconds;
+    long deliveries;
+    unsigned int dropped;
+};
+
+static Result runUntilReceived(Network &net, Counter **sinks, int sinkCount, long expected, long deliveries) {
+    Result r;
+    const double start = now();
+    net.runSetup();
+    long received = 0;
+    while (received < expected) {
+        net.runTick();
+        received = 0;
+        for (int i=0; i<sinkCount; i++) {
+            received += __atomic_load_n(&sinks[i]->received, __ATOMIC_RELAXED);
+        }
+    }
+    r.seconds = now() - start;
+    r.deliveries = deliveries;
+    r.dropped = 0;
+    for (int i=0; i<net.connectionCount(); i++) {
+        r.dropped += net.connectionAt(i).dropped;
+    }
+    return r;
+}
+
+static Result benchChain(Executor *executor, long packets, int length) {
+    HostIO io;
+    Network *net = new Network(&io, executor);
+    int previous = net->addNode(new Generator(packets));
+    for (int i=0; i<length; i++) {
+        const int node = net->addNode(Component::create(IdForward));
+        net->connect(previous, 0, node, 0, burst);
+        previous = node;
+    }
+    Counter *sink = new Counter;
+    net->connect(previous, 0, net->addNode(sink), 0, burst);
+    Result r = runUntilReceived(*net, &sink, 1, packets, packets*(length+1));
+    delete net;
+    return r;
+}
+
+// With @native, a Forward connected to all the next level instead of a Split
+static Result benchFanout(Executor *executor, long packets, bool native) {
+    using namespace SplitPorts;
+    const int width = OutPorts::out9+1;
+    const ComponentId splitter = native ? IdForward : IdSplit;
+    HostIO io;
+    Network *net = new Network(&io, executor);
+    const int generator = net->addNode(new Generator(packets));
+    const int root = net->addNode(Component::create(splitter));
+    net->connect(generator, 0, root, 0, burst);
+    Counter *sinks[width*width];
+    for (int i=0; i<width; i++) {
+        const int split = net->addNode(Component::create(splitter));
+        net->connect(root, native ? 0 : i, split, 0, burst);
+        for (int j=0; j<width; j++) {
+            const int forward = net->addNode(Component::create(IdForward));
+            net->connect(split, native ? 0 : j, forward, 0, burst);
+            sinks[i*width+j] = new Counter;
+            net->connect(forward, 0, net->addNode(sinks[i*width+j]), 0, burst);
+        }
+    }
+    const long perPacket = 1 + width + 2*width*width;
+    Result r = runUntilReceived(*net, sinks, width*width, packets*width*width, packets*perPacket);
+    delete net;
+    return r;
+}
+
+static void report(const char *graph, const char *executor, int threads, const Result &r) {
+    printf("%-8s %-16s %7d %10.3f %12.0f %8.1f %8u\n", graph, executor, threads, r.seconds,
+           r.deliveries/r.seconds, r.seconds*1e9/r.deliveries, r.dropped);
+}
+
+int main(int argc, char *argv[]) {
+    const long packets = (argc > 1) ? atol(argv[1]) : 20000;
+    const int length = (argc > 2) ? atoi(argv[2]) : 200;
+    const int threadCounts[] = { 1, 2, 4, 8 };
+
+    printf("%-8s %-16s %7s %10s %12s %8s %8s\n", "graph", "executor", "threads", "seconds",
+           "packets/s", "ns/pkt", "dropped");
+
+    report("chain", "single", 1, benchChain(0, packets, length));
+    for (size_t i=0; i<sizeof(threadCounts)/sizeof(threadCounts[0]); i++) {
+        WorkStealingExecutor executor(threadCounts[i]);
+        report("chain", "work-stealing", threadCounts[i], benchChain(&executor, packets, length));
+    }
+
+    for (int native=0; native<2; native++) {
+        const char *graph = native ? "fanout" : "split";
+        report(graph, "single", 1, benchFanout(0, packets/10, native));
+        for (size_t i=0; i<sizeof(threadCounts)/sizeof(threadCounts[0]); i++) {
+            WorkStealingExecutor executor(threadCounts[i]);
+            report(graph, "work-stealing", threadCounts[i], benchFanout(&executor, packets/10, native));
+        }
+    }
+    return 0;
+}
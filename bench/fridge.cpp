@@ -0,0 +1,140 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+// The thermostat of examples/fridge.fbp against a thermal model of the fridge,
+// on SimulatorIO. A day of device time runs in a few seconds, and the result is
+// the same on every run, so the summary can be compared between versions.
+// The graph is as in fridge.fbp, with the DS18B20 thermometer simulated by SimulatorIO,
+// including its 750 ms conversion time.
+// Exits with failure if the temperature is not kept within the thresholds (with some slack).
+// Usage: simulate-fridge [hours]
+
+#define MICROFLO_NO_MAIN
+#include "microflo.hpp"
+#include "simulator.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const int sensorPin = 9;
+static const unsigned char sensorAddress[8] = { 0x28, 0xAF, 0x1C, 0xB2, 0x04, 0x00, 0x00, 0x33 };
+static const int turnOnPin = 11;
+static const int turnOffPin = 12;
+static const long lowThreshold = 2; // Celcius
+static const long highThreshold = 5;
+
+// Newtonian heating towards the room temperature, and constant cooling while the compressor runs
+struct Fridge {
+    Fridge() : temperature(20.0), compressorOn(false), starts(0), onSeconds(0), seconds(0),
+               minTemperature(100), maxTemperature(-100), checksum(0) {}
+
+    static void step(SimulatorIO *io, void *user) {
+        Fridge *f = static_cast<Fridge *>(user);
+        const float room = 20.0;
+        const float leakage = 0.0005; // per second
+        const float cooling = 0.02; // Celcius per second
+
+        // Relay pair from BreakBeforeMake, the compressor runs while only turnOn is high
+        const bool on = io->digitalOutput(turnOnPin) && !io->digitalOutput(turnOffPin);
+        if (on && !f->compressorOn) {
+            f->starts++;
+        }
+        f->compressorOn = on;
+        f->temperature += leakage*(room - f->temperature) - (on ? cooling : 0);
+        f->seconds++;
+        f->onSeconds += on;
+        if (f->seconds > 3600) {
+            // Settled after the initial pull-down from room temperature
+            f->minTemperature = (f->temperature < f->minTemperature) ? f->temperature : f->minTemperature;
+            f->maxTemperature = (f->temperature > f->maxTemperature) ? f->temperature : f->maxTemperature;
+        }
+        f->checksum = f->checksum*31 + (long)(f->temperature*100) + on;
+
+        io->oneWire.setTemperature(sensorPin, sensorAddress, f->temperature);
+        io->scheduleCall(io->TimerCurrentMs()+1000, &Fridge::step, f);
+    }
+
+    float temperature;
+    bool compressorOn;
+    long starts;
+    long onSeconds;
+    long seconds;
+    float minTemperature;
+    float maxTemperature;
+    unsigned long checksum;
+};
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static int add(Network &net, ComponentId id) {
+    return net.addNode(Component::create(id));
+}
+
+int main(int argc, char *argv[]) {
+    const long hours = (argc > 1) ? atol(argv[1]) : 24;
+    SimulatorIO io;
+    Network net(&io);
+
+    // Thermostat
+    const int timer = add(net, IdTimer);
+    const int thermometer = add(net, IdReadDallasTemperature);
+    const int hysteresis = add(net, IdHysteresisLatch);
+    net.connect(timer, 0, thermometer, ReadDallasTemperaturePorts::InPorts::trigger);
+    net.connect(thermometer, 0, hysteresis, HysteresisLatchPorts::InPorts::in);
+
+    // On/Off switch, with feedback for synchronizing the break-before-make logic
+    const int breakBeforeMake = add(net, IdBreakBeforeMake);
+    const int ia = add(net, IdInvertBoolean);
+    const int ib = add(net, IdInvertBoolean);
+    const int ic = add(net, IdInvertBoolean);
+    const int id = add(net, IdInvertBoolean);
+    const int turnOn = add(net, IdDigitalWrite);
+    const int turnOff = add(net, IdDigitalWrite);
+    net.connect(hysteresis, 0, breakBeforeMake, BreakBeforeMakePorts::InPorts::in);
+    net.connect(breakBeforeMake, BreakBeforeMakePorts::OutPorts::out1, ia, 0);
+    net.connect(ia, 0, turnOn, DigitalWritePorts::InPorts::in);
+    net.connect(breakBeforeMake, BreakBeforeMakePorts::OutPorts::out2, ic, 0);
+    net.connect(ic, 0, turnOff, DigitalWritePorts::InPorts::in);
+    net.connect(turnOn, 0, ib, 0);
+    net.connect(ib, 0, breakBeforeMake, BreakBeforeMakePorts::InPorts::monitor1);
+    net.connect(turnOff, 0, id, 0);
+    net.connect(id, 0, breakBeforeMake, BreakBeforeMakePorts::InPorts::monitor2);
+
+    // Config
+    net.sendMessage(timer, TimerPorts::InPorts::interval, Packet(5000L));
+    net.sendMessage(timer, TimerPorts::InPorts::enable, Packet(true));
+    net.sendMessage(thermometer, ReadDallasTemperaturePorts::InPorts::pin, Packet((long)sensorPin));
+    net.sendMessage(thermometer, ReadDallasTemperaturePorts::InPorts::address, Packet(MsgBracketStart));
+    for (int i=0; i<8; i++) {
+        net.sendMessage(thermometer, ReadDallasTemperaturePorts::InPorts::address, Packet(sensorAddress[i]));
+    }
+    net.sendMessage(thermometer, ReadDallasTemperaturePorts::InPorts::address, Packet(MsgBracketEnd));
+    net.sendMessage(hysteresis, HysteresisLatchPorts::InPorts::lowthreshold, Packet(lowThreshold));
+    net.sendMessage(hysteresis, HysteresisLatchPorts::InPorts::highthreshold, Packet(highThreshold));
+    net.sendMessage(turnOff, DigitalWritePorts::InPorts::pin, Packet((long)turnOffPin));
+    net.sendMessage(turnOn, DigitalWritePorts::InPorts::pin, Packet((long)turnOnPin));
+
+    Fridge fridge;
+    io.scheduleCall(0, &Fridge::step, &fridge);
+    net.runSetup();
+
+    const double start = now();
+    io.run(&net, hours*3600*1000);
+    const double seconds = now() - start;
+
+    printf("simulated %ld h in %.2f s (%.0fx real time)\n", hours, seconds, hours*3600/seconds);
+    printf("compressor starts %ld, duty cycle %.1f%%\n", fridge.starts, 100.0*fridge.onSeconds/fridge.seconds);
+    printf("temperature %.2f .. %.2f C after the first hour, checksum %08lx\n",
+           fridge.minTemperature, fridge.maxTemperature, fridge.checksum & 0xffffffffUL);
+
+    const bool ok = fridge.starts > 0 && fridge.minTemperature > lowThreshold-2
+            && fridge.maxTemperature < highThreshold+2;
+    return ok ? 0 : 1;
+}
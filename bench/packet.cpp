@@ -0,0 +1,146 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+// Size and delivery cost of Packet, compared to the previous layout:
+// a union with long next to an int-sized enum, passed by value and converted with if-chains.
+// Usage: bench-packet [packets]
+
+#define MICROFLO_NO_MAIN
+#include "microflo.hpp"
+#include "host.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// The layout before the packed Packet, kept for comparison
+class LegacyPacket {
+public:
+    LegacyPacket(): msg(MsgVoid) {}
+    LegacyPacket(long l): msg(MsgInteger) { data.lng = l; }
+
+    long asInteger() const {
+        if (msg == MsgBoolean){
+            return data.boolean;
+        } else if (msg == MsgByte) {
+            return data.byte;
+        } else if (msg == MsgInteger) {
+            return data.lng;
+        } else if (msg == MsgFloat) {
+            return data.flt;
+        } else if (msg == MsgAscii) {
+            return data.ch;
+        } else {
+            return -33;
+        }
+    }
+private:
+    union PacketData {
+        bool boolean;
+        char ch;
+        unsigned char byte;
+        long lng;
+        float flt;
+    } data;
+    enum Msg msg;
+};
+
+struct LegacyMessage {
+    Component *target;
+    char targetPort;
+    LegacyPacket pkg;
+};
+
+class LegacySink {
+public:
+    LegacySink() : sum(0) {}
+    virtual void process(LegacyPacket in, int port) { sum += in.asInteger(); }
+    long sum;
+};
+
+class Sink {
+public:
+    Sink() : sum(0) {}
+    virtual void process(const Packet &in, int port) { sum += in.asInteger(); }
+    long sum;
+};
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec/1e9;
+}
+
+// Through a ring of MAX_MESSAGES slots, like a connection queue, into a virtual process()
+template <class P, class S>
+static double deliveryCost(S *sink, long packets) {
+    static P ring[MAX_MESSAGES];
+    const double start = now();
+    for (long i=0; i<packets; i++) {
+        ring[i % MAX_MESSAGES] = P(i);
+        const P pkg = ring[i % MAX_MESSAGES];
+        sink->process(pkg, 0);
+    }
+    return (now()-start)*1e9/packets;
+}
+
+class Counter : public Component {
+public:
+    Counter() : received(0) {}
+    virtual void process(const Packet &in, int port) {
+        if (in.isData()) {
+            received++;
+        }
+    }
+    long received;
+};
+
+// Full Network delivery, through a chain of Forward
+static double networkCost(long packets) {
+    const int length = 10;
+    HostIO io;
+    Network *net = new Network(&io);
+    int previous = net->addNode(Component::create(IdForward));
+    const int first = previous;
+    for (int i=1; i<length; i++) {
+        const int node = net->addNode(Component::create(IdForward));
+        net->connect(previous, 0, node, 0, 32);
+        previous = node;
+    }
+    Counter *sink = new Counter;
+    net->connect(previous, 0, net->addNode(sink), 0, 32);
+    net->runSetup();
+
+    const double start = now();
+    for (long sent=0; sent<packets; ) {
+        for (int i=0; i<16 && sent<packets; i++, sent++) {
+            net->sendMessage(first, 0, Packet(sent));
+        }
+        net->runTick();
+    }
+    while (sink->received + (long)net->externalMessagesDropped() < packets) {
+        net->runTick();
+    }
+    const double ns = (now()-start)*1e9/(packets*length);
+    delete net;
+    return ns;
+}
+
+int main(int argc, char *argv[]) {
+    const long packets = (argc > 1) ? atol(argv[1]) : 10000000;
+
+    LegacySink *legacySink = new LegacySink;
+    Sink *sink = new Sink;
+    const double legacyNs = deliveryCost<LegacyPacket>(legacySink, packets);
+    const double ns = deliveryCost<Packet>(sink, packets);
+
+    printf("%-8s %8s %8s %10s %10s\n", "layout", "packet", "message", "queue RAM", "ns/pkt");
+    printf("%-8s %8zu %8zu %10zu %10.2f\n", "legacy", sizeof(LegacyPacket), sizeof(LegacyMessage),
+           sizeof(LegacyPacket)*MAX_MESSAGES, legacyNs);
+    printf("%-8s %8zu %8zu %10zu %10.2f\n", "packed", sizeof(Packet), sizeof(Message),
+           sizeof(Packet)*MAX_MESSAGES, ns);
+    printf("network delivery: %.2f ns/pkt per hop\n", networkCost(packets/10));
+    return (legacySink->sum == sink->sum) ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+// Cost per hop of the 100 node Forward chain in bench/chain.fbp, compiled to direct calls
+// by 'microflo.js compile', against the same chain wired through Network queues.
+// Built twice by 'make bench-static': with STATIC_GRAPH naming the generated source, and
+// without, where the chain is connected here. Both run to completion, one tick per burst.
+// Usage: bench-static [messages]
+
+#define MICROFLO_NO_MAIN
+#ifdef STATIC_GRAPH
+#include STATIC_GRAPH
+#else
+#include "microflo.hpp"
+#endif
+#include "host.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const int chainLength = 100; // as in bench/chain.fbp
+
+// Counts serial output instead of writing it
+class StubIO : public HostIO {
+public:
+    StubIO() : written(0) {}
+    virtual void SerialWrite(int serialDevice, unsigned char b) {
+        written++;
+    }
+    long written;
+};
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec/1e9;
+}
+
+int main(int argc, char *argv[]) {
+    const long messages = (argc > 1) ? atol(argv[1]) : 200000;
+    StubIO io;
+    Network net(&io);
+#ifdef STATIC_GRAPH
+    const char *wiring = "static";
+    microfloStaticSetup(&net);
+#else
+    const char *wiring = "dynamic";
+    for (int i=0; i<chainLength; i++) {
+        net.addNode(Component::create(IdForward));
+    }
+    net.addNode(Component::create(IdSerialOut));
+    for (int i=0; i<chainLength-1; i++) {
+        net.connect(i, 0, i+1, 0);
+    }
+    net.connect(chainLength-1, 0, chainLength, SerialOutPorts::InPorts::in);
+#endif
+    net.setRunToCompletion(MAX_EXTERNAL_MESSAGES*(chainLength+1));
+    net.runSetup();
+
+    const double start = now();
+    long sent = 0;
+    while (sent < messages) {
+        while (sent < messages && net.sendMessage(0, 0, Packet((unsigned char)sent))) {
+            sent++;
+        }
+        net.runTick();
+    }
+    for (int i=0; i<10 && io.written < messages; i++) {
+        net.runTick();
+    }
+    const double seconds = now() - start;
+
+    if (io.written != messages) {
+        fprintf(stderr, "%s: %ld of %ld bytes arrived at SerialOut\n", wiring, io.written, messages);
+        return 1;
+    }
+    printf("%-8s %8d nodes %10ld messages %8.2f ns/hop\n", wiring, chainLength, messages,
+           seconds*1e9/(messages*(double)chainLength));
+    return 0;
+}
@@ -4,7 +4,10 @@
  */
 
 #include <node.h>
+#include <node_buffer.h>
 #include <v8.h>
+#include <uv.h>
+#include <sched.h>
 
 #define HOST_BUILD
 #define MICROFLO_NO_MAIN
@@ -14,7 +17,7 @@
 // Packet
 v8::Handle<v8::Value> PacketToJsObject(const Packet &p) {
     v8::HandleScope scope;
-    v8::Persistent<v8::Object> obj = v8::Persistent<v8::Object>::New(v8::Object::New());
+    v8::Local<v8::Object> obj = v8::Object::New();
     obj->Set(v8::String::NewSymbol("type"), v8::Number::New(p.type()));
     v8::Handle<v8::Value> val = v8::Undefined();
 
@@ -26,6 +29,34 @@ v8::Handle<v8::Value> PacketToJsObject(const Packet &p) {
     return scope.Close(obj);
 }
 
+// Value of @p in a batch entry. Floats as their bits, to be read through the float view
+int32_t PacketToBatchValue(const Packet &p) {
+    if (p.isFloat()) {
+        const float f = p.asFloat();
+        int32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        return bits;
+    } else if (p.isInteger()) {
+        return p.asInteger();
+    } else if (p.isBool()) {
+        return p.asBool();
+    } else if (p.isByte()) {
+        return p.asByte();
+    } else if (p.isAscii()) {
+        return p.asAscii();
+    }
+    return 0;
+}
+
+// A JS object whose indexed properties are @length elements of @data, like a typed array.
+// Created once, so passing it to JS does not allocate
+v8::Persistent<v8::Object> ExternalArray(void *data, v8::ExternalArrayType type, int length) {
+    v8::Persistent<v8::Object> array = v8::Persistent<v8::Object>::New(v8::Object::New());
+    array->SetIndexedPropertiesToExternalArrayData(data, type, length);
+    array->Set(v8::String::NewSymbol("length"), v8::Number::New(length));
+    return array;
+}
+
 Packet JsValueToPacket(v8::Handle<v8::Value> val) {
     if (val->IsNumber()) {
         return Packet((long)val->Int32Value());
@@ -33,14 +64,67 @@ Packet JsValueToPacket(v8::Handle<v8::Value> val) {
     return Packet();
 }
 
+// Packets from the network thread to JavaScript components, see JavaScriptNetwork::Start.
+// Lock-free, for one producer (the network thread) and one consumer (the main thread)
+class JavaScriptComponent;
+struct RingEntry {
+    JavaScriptComponent *target;
+    int port;
+    Packet pkg;
+};
+
+class PacketRing {
+public:
+    static const unsigned int SIZE = 4096; // must be a power of two
+
+    PacketRing() : head(0), tail(0) {}
+
+    bool push(const RingEntry &e) {
+        const unsigned int t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        if (t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) == SIZE) {
+            return false;
+        }
+        entries[t & (SIZE-1)] = e;
+        __atomic_store_n(&tail, t+1, __ATOMIC_RELEASE);
+        return true;
+    }
+    bool pop(RingEntry &e) {
+        const unsigned int h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        if (h == __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        e = entries[h & (SIZE-1)];
+        __atomic_store_n(&head, h+1, __ATOMIC_RELEASE);
+        return true;
+    }
+private:
+    RingEntry entries[SIZE];
+    unsigned int head;
+    unsigned int tail;
+};
+
 // Component
+const int BATCH_PACKETS = 1024;
+const int BATCH_ENTRY_SIZE = 3; // port, type, value
+
 class JavaScriptComponent : public node::ObjectWrap, public Component  {
 public:
     static void Init(v8::Handle<v8::Object> exports);
 
     // Implements Component
-    virtual void process(Packet in, int port);
+    virtual void process(const Packet &in, int port);
+
+    // Pass the packets batched since last time to the "batch" callback
+    void flush();
+    // Give @in to the "batch" or "process" callback. On the main thread
+    void receive(const Packet &in, int port);
+    // While the network runs on its own thread, process() hands packets to the main thread
+    // through @ring, waking it up with @async. NULL when running on the main thread
+    void setRing(PacketRing *r, uv_async_t *a) { ring = r; async = a; }
+    // Ticks as before the network thread was started
+    void restoreTicks() { subscribeTicks(onBatch.IsEmpty()); }
 private:
+    JavaScriptComponent();
     ~JavaScriptComponent();
 
     static v8::Handle<v8::Value> New(const v8::Arguments& args);
@@ -48,10 +132,33 @@ private:
     static v8::Handle<v8::Value> Send(const v8::Arguments& args);
 private:
     v8::Persistent<v8::Function> onProcess;
+    // With a "batch" callback, packets are collected here instead of calling into JS for each.
+    // ints and floats are views of the same entries, to read the value of float packets
+    v8::Persistent<v8::Function> onBatch;
+    v8::Persistent<v8::Object> batchInts;
+    v8::Persistent<v8::Object> batchFloats;
+    int32_t batch[BATCH_PACKETS*BATCH_ENTRY_SIZE];
+    int batched;
+    PacketRing *ring;
+    uv_async_t *async;
 };
 
+JavaScriptComponent::JavaScriptComponent()
+    : batched(0)
+    , ring(0)
+    , async(0)
+{
+    // JavaScript callbacks have always been getting ticks
+    subscribeTicks();
+}
+
 JavaScriptComponent::~JavaScriptComponent()
-{}
+{
+    onProcess.Dispose();
+    onBatch.Dispose();
+    batchInts.Dispose();
+    batchFloats.Dispose();
+}
 
 void JavaScriptComponent::Init(v8::Handle<v8::Object> exports) {
   // Prepare constructor template
@@ -75,8 +182,47 @@ v8::Handle<v8::Value> JavaScriptComponent::New(const v8::Arguments& args) {
   return args.This();
 }
 
-void JavaScriptComponent::process(Packet in, int port) {
+void JavaScriptComponent::process(const Packet &in, int port) {
+    if (ring) {
+        if (in.isSpecial()) {
+            return;
+        }
+        RingEntry e;
+        e.target = this;
+        e.port = port;
+        e.pkg = in;
+        // A full ring waits for JavaScript to catch up, instead of losing packets
+        while (!ring->push(e)) {
+            uv_async_send(async);
+            sched_yield();
+        }
+        uv_async_send(async);
+        return;
+    }
+    receive(in, port);
+}
+
+void JavaScriptComponent::receive(const Packet &in, int port) {
+    if (!onBatch.IsEmpty()) {
+        if (in.isSpecial()) {
+            return; // the batch is flushed after each tick instead
+        }
+        if (batched == BATCH_PACKETS) {
+            flush();
+        }
+        int32_t *entry = batch + batched*BATCH_ENTRY_SIZE;
+        entry[0] = port;
+        entry[1] = in.type();
+        entry[2] = PacketToBatchValue(in);
+        batched++;
+        return;
+    }
+    if (onProcess.IsEmpty()) {
+        return;
+    }
+
     // call the JavaScript callback
+    v8::HandleScope scope;
     const int argc = 2;
     v8::Local<v8::Value> argv[argc] = {
         v8::Local<v8::Value>::New(PacketToJsObject(in)),
@@ -85,14 +231,43 @@ void JavaScriptComponent::process(Packet in, int port) {
     onProcess->Call(v8::Context::GetCurrent()->Global(), argc, argv);
 }
 
+void JavaScriptComponent::flush() {
+    if (batched == 0 || onBatch.IsEmpty()) {
+        return;
+    }
+    v8::HandleScope scope;
+    const int argc = 3;
+    v8::Local<v8::Value> argv[argc] = {
+        v8::Local<v8::Value>::New(batchInts),
+        v8::Local<v8::Value>::New(batchFloats),
+        v8::Local<v8::Value>::New(v8::Integer::New(batched)),
+    };
+    // Reset first, the callback may send packets which come back to us
+    batched = 0;
+    onBatch->Call(v8::Context::GetCurrent()->Global(), argc, argv);
+}
+
 v8::Handle<v8::Value> JavaScriptComponent::On(const v8::Arguments& args) {
   v8::HandleScope scope;
 
   JavaScriptComponent* obj = node::ObjectWrap::Unwrap<JavaScriptComponent>(args.This());
   v8::String::Utf8Value event(args[0]);
+  v8::Persistent<v8::Function> cb = v8::Persistent<v8::Function>::New(v8::Local<v8::Function>::Cast(args[1]));
   if (*event == std::string("process")) {
-      v8::Persistent<v8::Function> cb = v8::Persistent<v8::Function>::New(v8::Local<v8::Function>::Cast(args[1]));
+      obj->onProcess.Dispose();
       obj->onProcess = cb;
+  } else if (*event == std::string("batch")) {
+      // on("batch", function(ints, floats, count)): once per tick with all packets delivered in it,
+      // entry i at [3*i] (port, type, value). Tick packets are not included
+      if (obj->onBatch.IsEmpty()) {
+          obj->batchInts = ExternalArray(obj->batch, v8::kExternalIntArray, BATCH_PACKETS*BATCH_ENTRY_SIZE);
+          obj->batchFloats = ExternalArray(obj->batch, v8::kExternalFloatArray, BATCH_PACKETS*BATCH_ENTRY_SIZE);
+      }
+      obj->onBatch.Dispose();
+      obj->onBatch = cb;
+      obj->subscribeTicks(false); // batches are flushed after every tick anyway
+  } else {
+      cb.Dispose();
   }
   return scope.Close(v8::Undefined());
 }
@@ -103,7 +278,11 @@ v8::Handle<v8::Value> JavaScriptComponent::Send(const v8::Arguments& args) {
   JavaScriptComponent* obj = node::ObjectWrap::Unwrap<JavaScriptComponent>(args.This());
   Packet p = JsValueToPacket(args[1]);
   const int portId = args[1]->Int32Value();
-  obj->send(p, portId);
+  if (obj->ring) {
+      obj->post(p, portId); // the network runs on its own thread
+  } else {
+      obj->send(p, portId);
+  }
 
   return scope.Close(v8::Undefined());
 }
@@ -123,12 +302,55 @@ private:
     static v8::Handle<v8::Value> SendMessage(const v8::Arguments& args);
     static v8::Handle<v8::Value> RunSetup(const v8::Arguments& args);
     static v8::Handle<v8::Value> RunTick(const v8::Arguments& args);
+    static v8::Handle<v8::Value> RunTicks(const v8::Arguments& args);
+    static v8::Handle<v8::Value> SendMessages(const v8::Arguments& args);
+    static v8::Handle<v8::Value> LoadGraph(const v8::Arguments& args);
+    static v8::Handle<v8::Value> SetRunToCompletion(const v8::Arguments& args);
+    static v8::Handle<v8::Value> Reset(const v8::Arguments& args);
+    static v8::Handle<v8::Value> QueueStats(const v8::Arguments& args);
+    static v8::Handle<v8::Value> NodeOverruns(const v8::Arguments& args);
+#ifdef MICROFLO_PROFILE
+    static v8::Handle<v8::Value> Profile(const v8::Arguments& args);
+#endif
+    static v8::Handle<v8::Value> Start(const v8::Arguments& args);
+    static v8::Handle<v8::Value> Stop(const v8::Arguments& args);
+    static v8::Handle<v8::Value> Advance(const v8::Arguments& args);
+
+    // runTick(), then flush the batches of the JavaScript components
+    void runTickAndFlush(unsigned long budgetMicros=0);
+    // Pass what the network thread sent to JavaScript components on to their callbacks
+    void drainRing();
+    static void *runThread(void *arg);
+    static void onAsync(uv_async_t *handle, int status);
+    static void onAsyncClosed(uv_handle_t *handle);
+    static bool throwIfRunning(JavaScriptNetwork *net);
 private:
-    ;
+    JavaScriptNetwork(HostIO *io);
+
+    JavaScriptComponent *jsComponents[MAX_NODES];
+    int jsComponentCount;
+    HostIO *hostIO;
+    // Network thread, see Start()
+    bool running;
+    bool virtualTime;
+    int stopping;
+    int threadDone;
+    long ticksGranted;
+    pthread_t thread;
+    uv_async_t *async; // closed asynchronously, so owned by the event loop after stop()
+    PacketRing ring;
 };
 
-JavaScriptNetwork::JavaScriptNetwork()
-    : Network(new HostIO)
+JavaScriptNetwork::JavaScriptNetwork(HostIO *io)
+    : Network(io)
+    , jsComponentCount(0)
+    , hostIO(io)
+    , running(false)
+    , virtualTime(false)
+    , stopping(0)
+    , threadDone(0)
+    , ticksGranted(0)
+    , async(0)
 {
 }
 
@@ -151,6 +373,30 @@ void JavaScriptNetwork::Init(v8::Handle<v8::Object> exports) {
                                 v8::FunctionTemplate::New(RunSetup)->GetFunction());
   tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("runTick"),
                                 v8::FunctionTemplate::New(RunTick)->GetFunction());
+  tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("runTicks"),
+                                v8::FunctionTemplate::New(RunTicks)->GetFunction());
+  tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("sendMessages"),
+                                v8::FunctionTemplate::New(SendMessages)->GetFunction());
+  tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("loadGraph"),
+                                v8::FunctionTemplate::New(LoadGraph)->GetFunction());
+  tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("setRunToCompletion"),
+                                v8::FunctionTemplate::New(SetRunToCompletion)->GetFunction());
+  tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("reset"),
+                                v8::FunctionTemplate::New(Reset)->GetFunction());
+  tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("queueStats"),
+                                v8::FunctionTemplate::New(QueueStats)->GetFunction());
+  tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("nodeOverruns"),
+                                v8::FunctionTemplate::New(NodeOverruns)->GetFunction());
+#ifdef MICROFLO_PROFILE
+  tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("profile"),
+                                v8::FunctionTemplate::New(Profile)->GetFunction());
+#endif
+  tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("start"),
+                                v8::FunctionTemplate::New(Start)->GetFunction());
+  tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("stop"),
+                                v8::FunctionTemplate::New(Stop)->GetFunction());
+  tpl->PrototypeTemplate()->Set(v8::String::NewSymbol("advance"),
+                                v8::FunctionTemplate::New(Advance)->GetFunction());
 
   v8::Persistent<v8::Function> constructor = v8::Persistent<v8::Function>::New(tpl->GetFunction());
   exports->Set(v8::String::NewSymbol("Network"), constructor);
@@ -158,20 +404,174 @@ void JavaScriptNetwork::Init(v8::Handle<v8::Object> exports) {
 
 v8::Handle<v8::Value> JavaScriptNetwork::New(const v8::Arguments& args) {
   v8::HandleScope scope;
-  JavaScriptNetwork* obj = new JavaScriptNetwork();
+  JavaScriptNetwork* obj = new JavaScriptNetwork(new HostIO);
   obj->Wrap(args.This());
   return args.This();
 }
 
+bool JavaScriptNetwork::throwIfRunning(JavaScriptNetwork *net) {
+    if (net->running) {
+        v8::ThrowException(v8::Exception::Error(
+            v8::String::New("The network is running on its own thread, stop() it first")));
+    }
+    return net->running;
+}
+
+void *JavaScriptNetwork::runThread(void *arg) {
+    JavaScriptNetwork *net = static_cast<JavaScriptNetwork *>(arg);
+    while (!__atomic_load_n(&net->stopping, __ATOMIC_ACQUIRE)) {
+        if (!net->virtualTime) {
+            net->runTick(); // sleeps when idle, until a packet is sent in or stop()
+        } else if (__atomic_load_n(&net->ticksGranted, __ATOMIC_ACQUIRE) > 0) {
+            net->runTick();
+            __atomic_fetch_sub(&net->ticksGranted, 1, __ATOMIC_RELEASE);
+        } else {
+            net->hostIO->WaitForEvent(-1); // until advance(), a packet or stop()
+        }
+    }
+    __atomic_store_n(&net->threadDone, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void JavaScriptNetwork::onAsync(uv_async_t *handle, int status) {
+    JavaScriptNetwork *net = static_cast<JavaScriptNetwork *>(handle->data);
+    net->drainRing();
+}
+
+void JavaScriptNetwork::onAsyncClosed(uv_handle_t *handle) {
+    delete reinterpret_cast<uv_async_t *>(handle);
+}
+
+void JavaScriptNetwork::drainRing() {
+    RingEntry e;
+    while (ring.pop(e)) {
+        e.target->receive(e.pkg, e.port);
+    }
+    for (int i=0; i<jsComponentCount; i++) {
+        jsComponents[i]->flush();
+    }
+}
+
+// start(options) runs the network on its own thread, until stop(). Meanwhile JavaScript
+// components get their packets asynchronously on the main thread, and no ticks.
+// sendMessage(s) and Component.send() can be used, but not calls changing the graph, running ticks
+// or reading the counters (nodeOverruns(), queueStats(), profile()), which the thread updates.
+// By default ticks run freely, sleeping when idle. With options.virtualTime the network only
+// runs as many ticks as have been given with advance(n)
+v8::Handle<v8::Value> JavaScriptNetwork::Start(const v8::Arguments& args) {
+  v8::HandleScope scope;
+  JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (throwIfRunning(obj)) {
+      return scope.Close(v8::Undefined());
+  }
+  obj->virtualTime = false;
+  if (args.Length() > 0 && args[0]->IsObject()) {
+      obj->virtualTime = args[0]->ToObject()->Get(v8::String::NewSymbol("virtualTime"))->BooleanValue();
+  }
+  obj->stopping = 0;
+  obj->threadDone = 0;
+  obj->ticksGranted = 0;
+  obj->async = new uv_async_t;
+  uv_async_init(uv_default_loop(), obj->async, onAsync);
+  obj->async->data = obj;
+  for (int i=0; i<obj->jsComponentCount; i++) {
+      obj->jsComponents[i]->setRing(&obj->ring, obj->async);
+      obj->jsComponents[i]->subscribeTicks(false);
+  }
+  obj->setSleepWhenIdle(!obj->virtualTime);
+  obj->running = true;
+  obj->Ref(); // kept alive while the thread runs
+  pthread_create(&obj->thread, NULL, runThread, obj);
+  return scope.Close(v8::Undefined());
+}
+
+// Stops the network thread after its current tick. Packets it already sent to JavaScript
+// components are delivered before returning
+v8::Handle<v8::Value> JavaScriptNetwork::Stop(const v8::Arguments& args) {
+  v8::HandleScope scope;
+  JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (!obj->running) {
+      return scope.Close(v8::Undefined());
+  }
+  __atomic_store_n(&obj->stopping, 1, __ATOMIC_RELEASE);
+  obj->hostIO->NotifyEvent();
+  // The thread may be waiting for room in the ring
+  while (!__atomic_load_n(&obj->threadDone, __ATOMIC_ACQUIRE)) {
+      obj->drainRing();
+      sched_yield();
+  }
+  pthread_join(obj->thread, NULL);
+  obj->drainRing();
+  obj->running = false;
+  obj->setSleepWhenIdle(false);
+  for (int i=0; i<obj->jsComponentCount; i++) {
+      obj->jsComponents[i]->setRing(0, 0);
+      obj->jsComponents[i]->restoreTicks();
+  }
+  uv_close(reinterpret_cast<uv_handle_t *>(obj->async), onAsyncClosed);
+  obj->async = 0;
+  obj->Unref();
+  return scope.Close(v8::Undefined());
+}
+
+// advance(n) lets a network started with virtualTime run @n more ticks
+v8::Handle<v8::Value> JavaScriptNetwork::Advance(const v8::Arguments& args) {
+  v8::HandleScope scope;
+  JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  __atomic_fetch_add(&obj->ticksGranted, (long)args[0]->Int32Value(), __ATOMIC_RELEASE);
+  obj->hostIO->NotifyEvent();
+  return scope.Close(v8::Undefined());
+}
+
+void JavaScriptNetwork::runTickAndFlush(unsigned long budgetMicros) {
+    runTick(budgetMicros);
+    for (int i=0; i<jsComponentCount; i++) {
+        jsComponents[i]->flush();
+    }
+}
+
+// runTick([budgetMicros]), see Network::runTick()
 v8::Handle<v8::Value> JavaScriptNetwork::RunTick(const v8::Arguments& args) {
   v8::HandleScope scope;
   JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
-  obj->runTick();
+  if (throwIfRunning(obj)) {
+      return scope.Close(v8::Undefined());
+  }
+  const unsigned long budgetMicros = (args.Length() > 0) ? args[0]->Uint32Value() : 0;
+  obj->runTickAndFlush(budgetMicros);
+  return scope.Close(v8::Undefined());
+}
+
+// runTicks(n), same as calling runTick() n times
+v8::Handle<v8::Value> JavaScriptNetwork::RunTicks(const v8::Arguments& args) {
+  v8::HandleScope scope;
+  JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (throwIfRunning(obj)) {
+      return scope.Close(v8::Undefined());
+  }
+  const int ticks = args[0]->Int32Value();
+  for (int i=0; i<ticks; i++) {
+      obj->runTickAndFlush();
+  }
+  return scope.Close(v8::Undefined());
+}
+
+v8::Handle<v8::Value> JavaScriptNetwork::Reset(const v8::Arguments& args) {
+  v8::HandleScope scope;
+  JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (throwIfRunning(obj)) {
+      return scope.Close(v8::Undefined());
+  }
+  obj->reset();
+  obj->jsComponentCount = 0;
   return scope.Close(v8::Undefined());
 }
 v8::Handle<v8::Value> JavaScriptNetwork::RunSetup(const v8::Arguments& args) {
   v8::HandleScope scope;
   JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (throwIfRunning(obj)) {
+      return scope.Close(v8::Undefined());
+  }
   obj->runSetup();
   return scope.Close(v8::Undefined());
 }
@@ -180,13 +580,21 @@ v8::Handle<v8::Value> JavaScriptNetwork::AddNode(const v8::Arguments& args) {
   v8::HandleScope scope;
 
   JavaScriptNetwork* network = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (throwIfRunning(network)) {
+      return scope.Close(v8::Undefined());
+  }
   Component *component = 0;
+  JavaScriptComponent *js = 0;
   if (args[0]->IsObject()) {
-      component = node::ObjectWrap::Unwrap<JavaScriptComponent>(args[0]->ToObject());
+      js = node::ObjectWrap::Unwrap<JavaScriptComponent>(args[0]->ToObject());
+      component = js;
   } else {
       component = Component::create((ComponentId)args[0]->Int32Value());
   }
   const int nodeId = network->addNode(component);
+  if (js && nodeId >= 0) {
+      network->jsComponents[network->jsComponentCount++] = js;
+  }
 
   return scope.Close(v8::Number::New(nodeId));
 }
@@ -195,11 +603,16 @@ v8::Handle<v8::Value> JavaScriptNetwork::Connect(const v8::Arguments& args) {
   v8::HandleScope scope;
 
   JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (throwIfRunning(obj)) {
+      return scope.Close(v8::Undefined());
+  }
   const int srcNode = args[0]->Int32Value();
   const int srcPort = args[1]->Int32Value();
   const int targetNode = args[2]->Int32Value();
   const int targetPort = args[3]->Int32Value();
-  obj->connect(srcNode, srcPort, targetNode, targetPort);
+  const int capacity = (args.Length() > 4) ? args[4]->Int32Value() : 0;
+  const OverflowPolicy policy = (args.Length() > 5) ? (OverflowPolicy)args[5]->Int32Value() : OverflowDefault;
+  obj->connect(srcNode, srcPort, targetNode, targetPort, capacity, policy);
 
   return scope.Close(v8::Undefined());
 }
@@ -213,6 +626,147 @@ v8::Handle<v8::Value> JavaScriptNetwork::SendMessage(const v8::Arguments& args)
   return scope.Close(v8::Undefined());
 }
 
+// sendMessages(array) sends an integer packet for each (node, port, value) triple in @array,
+// an Int32Array. Returns how many were sent, fewer if the external queue filled up.
+// Run a tick to make room, and send the rest
+v8::Handle<v8::Value> JavaScriptNetwork::SendMessages(const v8::Arguments& args) {
+  v8::HandleScope scope;
+
+  JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  v8::Local<v8::Object> array = args[0]->ToObject();
+  if (!array->HasIndexedPropertiesInExternalArrayData() ||
+      array->GetIndexedPropertiesExternalArrayDataType() != v8::kExternalIntArray) {
+      return v8::ThrowException(v8::Exception::TypeError(v8::String::New("Expected an Int32Array")));
+  }
+  const int32_t *data = static_cast<const int32_t *>(array->GetIndexedPropertiesExternalArrayData());
+  const int count = array->GetIndexedPropertiesExternalArrayDataLength() / 3;
+  int sent = 0;
+  while (sent < count) {
+      const int32_t *m = data + sent*3;
+      if (!obj->sendMessage(m[0], m[1], Packet((long)m[2]))) {
+          break;
+      }
+      sent++;
+  }
+  return scope.Close(v8::Integer::New(sent));
+}
+
+// loadGraph(buffer) parses a whole command stream, in either format.
+// Returns false if it was malformed
+v8::Handle<v8::Value> JavaScriptNetwork::LoadGraph(const v8::Arguments& args) {
+  v8::HandleScope scope;
+
+  JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (throwIfRunning(obj)) {
+      return scope.Close(v8::Undefined());
+  }
+  if (!node::Buffer::HasInstance(args[0])) {
+      return v8::ThrowException(v8::Exception::TypeError(v8::String::New("Expected a Buffer")));
+  }
+  v8::Local<v8::Object> buffer = args[0]->ToObject();
+  const unsigned char *data = reinterpret_cast<const unsigned char *>(node::Buffer::Data(buffer));
+  const size_t length = node::Buffer::Length(buffer);
+  if (length > GRAPH_MAGIC_SIZE && data[GRAPH_MAGIC_SIZE] == GraphCmdReset) {
+      obj->jsComponentCount = 0; // removed from the network by the Reset
+  }
+  GraphStreamer parser;
+  parser.setNetwork(obj);
+  parser.parse(data, length);
+  return scope.Close(v8::Boolean::New(parser.isValid()));
+}
+
+// setRunToCompletion(budget), see Network::setRunToCompletion(). 0 to turn off
+v8::Handle<v8::Value> JavaScriptNetwork::SetRunToCompletion(const v8::Arguments& args) {
+  v8::HandleScope scope;
+  JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (throwIfRunning(obj)) {
+      return scope.Close(v8::Undefined());
+  }
+  obj->setRunToCompletion(args[0]->IntegerValue());
+  return scope.Close(v8::Undefined());
+}
+
+// nodeOverruns(node), see Network::nodeOverruns()
+v8::Handle<v8::Value> JavaScriptNetwork::NodeOverruns(const v8::Arguments& args) {
+  v8::HandleScope scope;
+  JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (throwIfRunning(obj)) {
+      return scope.Close(v8::Undefined());
+  }
+  const int nodeId = args[0]->Int32Value();
+  if (nodeId < 0 || nodeId >= obj->nodeCount()) {
+      v8::ThrowException(v8::Exception::RangeError(v8::String::New("No such node")));
+      return scope.Close(v8::Undefined());
+  }
+  return scope.Close(v8::Integer::NewFromUnsigned(obj->nodeOverruns(nodeId)));
+}
+
+// Returns one object per connection, with queue size/capacity and number of dropped packets
+v8::Handle<v8::Value> JavaScriptNetwork::QueueStats(const v8::Arguments& args) {
+  v8::HandleScope scope;
+
+  JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (throwIfRunning(obj)) {
+      return scope.Close(v8::Undefined());
+  }
+  v8::Local<v8::Array> stats = v8::Array::New(obj->connectionCount());
+  for (int i=0; i<obj->connectionCount(); i++) {
+      const Connection &c = obj->connectionAt(i);
+      v8::Local<v8::Object> s = v8::Object::New();
+      s->Set(v8::String::NewSymbol("sourcePort"), v8::Number::New(c.sourcePort));
+      s->Set(v8::String::NewSymbol("targetPort"), v8::Number::New(c.targetPort));
+      s->Set(v8::String::NewSymbol("capacity"), v8::Number::New(c.capacity));
+      s->Set(v8::String::NewSymbol("size"), v8::Number::New(c.size));
+      s->Set(v8::String::NewSymbol("policy"), v8::Number::New(c.policy));
+      s->Set(v8::String::NewSymbol("dropped"), v8::Number::New(c.dropped));
+      stats->Set(i, s);
+  }
+  v8::Local<v8::Object> result = v8::Object::New();
+  result->Set(v8::String::NewSymbol("connections"), stats);
+  result->Set(v8::String::NewSymbol("externalDropped"), v8::Number::New(obj->externalMessagesDropped()));
+  return scope.Close(result);
+}
+
+#ifdef MICROFLO_PROFILE
+// Returns the profiling counters, with the same fields as the profileSnapshot in commandformat.json.
+// Pass true to clear them afterwards
+v8::Handle<v8::Value> JavaScriptNetwork::Profile(const v8::Arguments& args) {
+  v8::HandleScope scope;
+
+  JavaScriptNetwork* obj = node::ObjectWrap::Unwrap<JavaScriptNetwork>(args.This());
+  if (throwIfRunning(obj)) {
+      return scope.Close(v8::Undefined());
+  }
+  v8::Local<v8::Array> nodes = v8::Array::New(obj->nodeCount());
+  for (int i=0; i<obj->nodeCount(); i++) {
+      const NodeProfile &p = obj->nodeProfile(i);
+      v8::Local<v8::Object> n = v8::Object::New();
+      n->Set(v8::String::NewSymbol("calls"), v8::Number::New(p.calls));
+      n->Set(v8::String::NewSymbol("totalMicros"), v8::Number::New(p.totalMicros));
+      n->Set(v8::String::NewSymbol("maxMicros"), v8::Number::New(p.maxMicros));
+      n->Set(v8::String::NewSymbol("received"), v8::Number::New(p.received));
+      n->Set(v8::String::NewSymbol("sent"), v8::Number::New(p.sent));
+      nodes->Set(i, n);
+  }
+  v8::Local<v8::Array> connections = v8::Array::New(obj->connectionCount());
+  for (int i=0; i<obj->connectionCount(); i++) {
+      const Connection &c = obj->connectionAt(i);
+      v8::Local<v8::Object> s = v8::Object::New();
+      s->Set(v8::String::NewSymbol("capacity"), v8::Number::New(c.capacity));
+      s->Set(v8::String::NewSymbol("highWater"), v8::Number::New(c.highWater));
+      s->Set(v8::String::NewSymbol("dropped"), v8::Number::New(c.dropped));
+      connections->Set(i, s);
+  }
+  v8::Local<v8::Object> result = v8::Object::New();
+  result->Set(v8::String::NewSymbol("nodes"), nodes);
+  result->Set(v8::String::NewSymbol("connections"), connections);
+  if (args.Length() > 0 && args[0]->BooleanValue()) {
+      obj->resetProfile();
+  }
+  return scope.Close(result);
+}
+#endif
+
 
 // GraphStreamer
 class JavaScriptGraphStreamer : public node::ObjectWrap, public GraphStreamer {
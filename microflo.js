@@ -174,15 +174,183 @@ var dataLiteralToCommand = function(literal, tgt, tgtPort) {
     // TODO: handle floats, strings
 }
 
+// Queue size and overflow policy for a connection. 0 means runtime default
+// Explicit metadata on the connection wins, otherwise sized for the bursts the source port may emit.
+// Connections from or to a port marked "conflating" only keep the newest packet
+var queueConfigForConnection = function(connection, srcPortDef, tgtPortDef) {
+    var metadata = connection.metadata || {};
+    var capacity = metadata.capacity || srcPortDef.burst || 0;
+    var overflow = 0;
+    if (metadata.overflow === undefined && (srcPortDef.conflating || tgtPortDef.conflating)) {
+        overflow = cmdFormat.overflowPolicies.Conflate.id;
+        capacity = 1;
+    } else if (metadata.overflow !== undefined) {
+        var policyName = metadata.overflow.replace(/(^|-)(\w)/g, function(m, dash, c) { return c.toUpperCase(); });
+        var policy = cmdFormat.overflowPolicies[policyName];
+        if (policy === undefined || policy.id === undefined) {
+            throw "Unknown overflow policy '" + metadata.overflow + "'";
+        }
+        overflow = policy.id;
+    }
+    return { capacity: capacity, overflow: overflow };
+}
+
+// Priority from "priority" in node or connection metadata, like "high". 0 (Default) when unset
+var priorityFromMetadata = function(metadata) {
+    if (!metadata || metadata.priority === undefined) {
+        return cmdFormat.priorities.Default.id;
+    }
+    var name = metadata.priority.charAt(0).toUpperCase() + metadata.priority.slice(1).toLowerCase();
+    var priority = cmdFormat.priorities[name];
+    if (priority === undefined || priority.id === undefined) {
+        throw "Unknown priority '" + metadata.priority + "'";
+    }
+    return priority.id;
+}
+
+// Command stream format v2, see GraphStreamer in microflo/microflo.h
+// Unsigned LEB128, for values up to 32 bits
+var varint = function(value) {
+    var bytes = [];
+    do {
+        var b = value % 128;
+        value = Math.floor(value / 128);
+        bytes.push(value ? b | 0x80 : b);
+    } while (value);
+    return bytes;
+}
+
+var zigzag = function(value) {
+    return (value < 0) ? -2*value - 1 : 2*value;
+}
+
+// CRC-16/CCITT-FALSE
+var crc16 = function(buf) {
+    var crc = 0xFFFF;
+    for (var i = 0; i < buf.length; i++) {
+        crc ^= buf[i] << 8;
+        for (var j = 0; j < 8; j++) {
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) & 0xFFFF : (crc << 1) & 0xFFFF;
+        }
+    }
+    return crc;
+}
+
+var dataLiteralToCommandV2 = function(literal, tgt, tgtPort) {
+    var types = cmdFormat.packetTypes;
+    var cmd = [cmdFormat.commands.SendPacket.id].concat(varint(tgt), varint(tgtPort));
+
+    if (literal === "true" || literal === "false") {
+        return new Buffer(cmd.concat([types.Boolean.id, literal === "true" ? 1 : 0]));
+    }
+    if (/^[-+]?\d+$/.test(literal)) {
+        var value = parseInt(literal);
+        if (value < -2147483648 || value > 2147483647) {
+            throw "Integer IIP " + literal + " does not fit in 32 bits";
+        }
+        return new Buffer(cmd.concat([types.Integer.id], varint(zigzag(value))));
+    }
+    if (literal.trim() !== "" && isFinite(Number(literal))) {
+        var f = new Buffer(4);
+        f.writeFloatLE(Number(literal), 0);
+        return Buffer.concat([new Buffer(cmd.concat([types.Float.id])), f]);
+    }
+
+    // Byte arrays as JSON, anything else is text
+    var data = undefined;
+    var text = 1;
+    try {
+        var value = JSON.parse(literal);
+        if (Array.isArray(value)) {
+            data = new Buffer(value.map(function(v) { return parseInt(v); }));
+            text = 0;
+        } else if (typeof value === 'string') {
+            data = new Buffer(value);
+        }
+    } catch (err) {
+        ;
+    }
+    if (data === undefined) {
+        data = new Buffer(literal);
+    }
+    var header = cmd.concat([types.Buffer.id], varint(data.length*2 + text));
+    return Buffer.concat([new Buffer(header), data]);
+}
+
+// Encoders for each command of a stream format, returning a Buffer
+var cmdEncoders = {
+    1: {
+        magic: cmdFormat.magicString,
+        reset: function() {
+            return this.cmd(cmdFormat.commands.Reset.id);
+        },
+        createComponent: function(componentId) {
+            return this.cmd(cmdFormat.commands.CreateComponent.id, componentId);
+        },
+        connectNodes: function(src, tgt, srcPort, tgtPort, capacity, overflow) {
+            if (capacity > 255) {
+                throw "Queue capacity " + capacity + " too large, maximum is 255";
+            }
+            return this.cmd(cmdFormat.commands.ConnectNodes.id, src, tgt, srcPort, tgtPort, capacity, overflow);
+        },
+        setNodePriority: function(node, priority) {
+            return this.cmd(cmdFormat.commands.SetNodePriority.id, node, priority);
+        },
+        setEdgePriority: function(src, tgt, srcPort, tgtPort, priority) {
+            return this.cmd(cmdFormat.commands.SetEdgePriority.id, src, tgt, srcPort, tgtPort, priority);
+        },
+        sendPacket: dataLiteralToCommand,
+        end: function(stream) {
+            return new Buffer(0);
+        },
+        cmd: function() {
+            var b = new Buffer(cmdFormat.commandSize);
+            writeCmd.apply(null, [b, 0].concat(Array.prototype.slice.call(arguments)));
+            return b;
+        }
+    },
+    2: {
+        magic: cmdFormat.magicStringV2,
+        reset: function() {
+            return new Buffer([cmdFormat.commands.Reset.id]);
+        },
+        createComponent: function(componentId) {
+            return new Buffer([cmdFormat.commands.CreateComponent.id].concat(varint(componentId)));
+        },
+        connectNodes: function(src, tgt, srcPort, tgtPort, capacity, overflow) {
+            return new Buffer([cmdFormat.commands.ConnectNodes.id].concat(varint(src), varint(tgt),
+                              varint(srcPort), varint(tgtPort), varint(capacity), [overflow]));
+        },
+        setNodePriority: function(node, priority) {
+            return new Buffer([cmdFormat.commands.SetNodePriority.id].concat(varint(node), [priority]));
+        },
+        setEdgePriority: function(src, tgt, srcPort, tgtPort, priority) {
+            return new Buffer([cmdFormat.commands.SetEdgePriority.id].concat(varint(src), varint(tgt),
+                              varint(srcPort), varint(tgtPort), [priority]));
+        },
+        sendPacket: dataLiteralToCommandV2,
+        // @stream is everything after the magic
+        end: function(stream) {
+            var opcode = new Buffer([cmdFormat.commands.End.id]);
+            var crc = crc16(Buffer.concat([stream, opcode]));
+            return Buffer.concat([opcode, new Buffer([crc & 0xFF, crc >> 8])]);
+        }
+    }
+}
+
 // TODO: actually add observers to graph, and emit a command stream for the changes
-var cmdStreamFromGraph = function(componentLib, graph) {
-    var buffer = new Buffer(1024); // FIXME: unhardcode
-    var index = 0;
+// @options.version selects the stream format, 1 (default) or 2
+var cmdStreamFromGraph = function(componentLib, graph, options) {
+    var version = (options && options.version) || 1;
+    var encoder = cmdEncoders[version];
+    if (encoder === undefined) {
+        throw "Unknown command stream format version " + version;
+    }
+    var cmds = [];
     var nodeMap = {}; // nodeName->numericNodeId
 
     // Header
-    index += writeString(buffer, index, cmdFormat.magicString);
-    index += writeCmd(buffer, index, cmdFormat.commands.Reset.id);
+    cmds.push(encoder.reset());
 
     // Create components
     var currentNodeId = 0;
@@ -192,18 +360,35 @@ var cmdStreamFromGraph = function(componentLib, graph) {
         }
         var process = graph.processes[nodeName];
         var componentId = componentLib.getComponent(process.component).id;
-        index += writeCmd(buffer, index, cmdFormat.commands.CreateComponent.id, componentId);
+        cmds.push(encoder.createComponent(componentId));
         nodeMap[nodeName] = currentNodeId++;
     }
 
+    // Node priorities
+    for (var nodeName in nodeMap) {
+        var priority = priorityFromMetadata(graph.processes[nodeName].metadata);
+        if (priority != cmdFormat.priorities.Default.id) {
+            cmds.push(encoder.setNodePriority(nodeMap[nodeName], priority));
+        }
+    }
+
     // Connect nodes
     graph.connections.forEach(function(connection) {
         if (connection.src !== undefined) {
             var srcNode = connection.src.process;
             var tgtNode = connection.tgt.process;
-            var srcPort = componentLib.outputPort(graph.processes[srcNode].component, connection.src.port).id;
-            var tgtPort = componentLib.inputPort(graph.processes[tgtNode].component, connection.tgt.port).id;
-            index += writeCmd(buffer, index, cmdFormat.commands.ConnectNodes.id, nodeMap[srcNode], nodeMap[tgtNode], srcPort, tgtPort);
+            var srcPortDef = componentLib.outputPort(graph.processes[srcNode].component, connection.src.port);
+            var srcPort = srcPortDef.id;
+            var tgtPortDef = componentLib.inputPort(graph.processes[tgtNode].component, connection.tgt.port);
+            var tgtPort = tgtPortDef.id;
+            var queue = queueConfigForConnection(connection, srcPortDef, tgtPortDef);
+            cmds.push(encoder.connectNodes(nodeMap[srcNode], nodeMap[tgtNode],
+                                           srcPort, tgtPort, queue.capacity, queue.overflow));
+            var priority = priorityFromMetadata(connection.metadata);
+            if (priority != cmdFormat.priorities.Default.id) {
+                cmds.push(encoder.setEdgePriority(nodeMap[srcNode], nodeMap[tgtNode],
+                                                  srcPort, tgtPort, priority));
+            }
         }
     });
 
@@ -212,15 +397,384 @@ var cmdStreamFromGraph = function(componentLib, graph) {
         if (connection.data !== undefined) {
             var tgtNode = connection.tgt.process;
             var tgtPort = componentLib.inputPort(graph.processes[tgtNode].component, connection.tgt.port).id;
-            index += writeCmd(buffer, index, dataLiteralToCommand(connection.data, nodeMap[tgtNode], tgtPort));
+            cmds.push(encoder.sendPacket(connection.data, nodeMap[tgtNode], tgtPort));
         }
     });
 
     // Attach the mapping so others can use it later
     graph.nodeMap = nodeMap;
 
-    buffer = buffer.slice(0, index);
-    return buffer;
+    var body = Buffer.concat(cmds);
+    var magic = new Buffer(encoder.magic.length);
+    writeString(magic, 0, encoder.magic);
+    return Buffer.concat([magic, body, encoder.end(body)]);
+}
+
+// Live graph upload, see GraphUploader in microflo/microflo.h
+var uploadFrame = function(kind, seq, payload) {
+    payload = payload || new Buffer(0);
+    var body = Buffer.concat([new Buffer([kind, seq & 0xFF, payload.length]), payload]);
+    var crc = crc16(body);
+    return Buffer.concat([new Buffer([cmdFormat.uploadMarker]), body, new Buffer([crc & 0xFF, crc >> 8])]);
+}
+
+// Splits received data into frames, calling @onFrame(kind, seq, payload).
+// Other bytes, like serial output of the running graph, are skipped
+var UploadFrameParser = function(onFrame) {
+    var pending = new Buffer(0);
+    this.push = function(data) {
+        pending = Buffer.concat([pending, data]);
+        while (pending.length > 0) {
+            var start = 0;
+            while (start < pending.length && pending[start] != cmdFormat.uploadMarker) {
+                start++;
+            }
+            pending = pending.slice(start);
+            if (pending.length < 4 || pending.length < 6 + pending[3]) {
+                return;
+            }
+            var length = pending[3];
+            var body = pending.slice(1, 4 + length);
+            if (crc16(body) == (pending[4 + length] | (pending[5 + length] << 8))) {
+                onFrame(body[0], body[1], body.slice(3));
+                pending = pending.slice(6 + length);
+            } else {
+                pending = pending.slice(1);
+            }
+        }
+    }
+}
+
+var uploadErrorName = function(code) {
+    for (var name in cmdFormat.uploadErrors) {
+        if (cmdFormat.uploadErrors[name].id == code) {
+            return name;
+        }
+    }
+    return "Unknown error " + code;
+}
+
+// Send the command stream @stream to a device running GraphUploader, through @port
+// (a serialport, or anything with write() and 'data' events).
+// Calls @callback(err, stats) once the device has loaded the graph, or gave up
+var uploadGraph = function(port, stream, callback, options) {
+    options = options || {};
+    var timeoutMs = options.timeout || 500;
+    var maxRetries = options.retries || 10;
+    var types = cmdFormat.uploadFrames;
+
+    var frames = []; // Data, then Commit. Frame i has sequence number i+1
+    var window = 1;
+    var base = 0; // first frame not acknowledged
+    var next = 0; // next frame to send
+    var rewoundTo = -1;
+    var staleNaks = 0; // replies expected to frames sent before going back
+    var retries = 0;
+    var resent = 0;
+    var begun = false;
+    var done = false;
+    var timer = undefined;
+    var started = Date.now();
+
+    var finish = function(err) {
+        if (done) {
+            return;
+        }
+        done = true;
+        clearTimeout(timer);
+        port.removeListener("data", onData);
+        callback(err, { bytes: stream.length, frames: frames.length, resent: resent, ms: Date.now() - started });
+    }
+    var armTimer = function() {
+        clearTimeout(timer);
+        timer = setTimeout(function() {
+            if (++retries > maxRetries) {
+                finish(new Error("No reply from device"));
+            } else if (!begun) {
+                sendBegin();
+            } else {
+                goBack(base);
+            }
+        }, timeoutMs);
+    }
+    var sendBegin = function() {
+        var length = new Buffer(4);
+        length.writeUInt32LE(stream.length, 0);
+        port.write(uploadFrame(types.Begin.id, 0, length));
+        armTimer();
+    }
+    var sendWindow = function() {
+        while (next < frames.length && next < base + window) {
+            port.write(frames[next++]);
+        }
+        armTimer();
+    }
+    var goBack = function(index) {
+        rewoundTo = index;
+        staleNaks = next - index - 1;
+        base = index;
+        resent += next - index;
+        next = index;
+        sendWindow();
+    }
+    // Index of the frame with sequence number @seq, at or after @base
+    var frameIndex = function(seq) {
+        return base + ((seq - 1 - base) & 0xFF);
+    }
+
+    var parser = new UploadFrameParser(function(kind, seq, payload) {
+        if (!begun) {
+            if (seq != 0) {
+                return;
+            }
+            if (kind == types.Nak.id) {
+                return finish(new Error(uploadErrorName(payload[0])));
+            }
+            begun = true;
+            retries = 0;
+            window = payload[0];
+            var maxPayload = payload[1];
+            for (var offset = 0; offset < stream.length; offset += maxPayload) {
+                frames.push(uploadFrame(types.Data.id, frames.length + 1, stream.slice(offset, offset + maxPayload)));
+            }
+            frames.push(uploadFrame(types.Commit.id, frames.length + 1));
+            return sendWindow();
+        }
+
+        var index = frameIndex(seq);
+        if (kind == types.Ack.id) {
+            if (index >= next) {
+                return; // stale
+            }
+            base = index + 1;
+            retries = 0;
+            if (base == frames.length) {
+                return finish();
+            }
+            sendWindow();
+        } else if (kind == types.Nak.id) {
+            var error = payload[0];
+            if (error != cmdFormat.uploadErrors.Checksum.id && error != cmdFormat.uploadErrors.Sequence.id) {
+                return finish(new Error(uploadErrorName(error)));
+            }
+            if (index > next) {
+                return; // stale
+            }
+            if (index == rewoundTo && staleNaks > 0) {
+                staleNaks--; // for one of the frames in flight after a lost one
+                return;
+            }
+            goBack(index); // to the frame the device expects
+        }
+    });
+    var onData = function(data) {
+        parser.push(data);
+    }
+    port.on("data", onData);
+    sendBegin();
+}
+
+// Binary trace from a device with a Tracer, see microflo/microflo.h.
+// Node and port names are looked up in tables built once from @graph (which needs
+// the nodeMap made by cmdStreamFromGraph), so decoding keeps up with the serial port.
+// Calls @onRecord(record) for each complete record.
+// Bytes before a marker are skipped, so reading can start in the middle of the stream
+var TraceDecoder = function(componentLib, graph, onRecord) {
+    var byId = function(defs) {
+        var names = [];
+        for (var name in defs) {
+            if (defs[name].id !== undefined) {
+                names[defs[name].id] = name;
+            }
+        }
+        return names;
+    }
+    var events = byId(cmdFormat.traceEvents);
+    var packetTypes = byId(cmdFormat.packetTypes);
+    var nodeNames = [];
+    var inPorts = [];
+    var outPorts = [];
+    for (var nodeName in graph.nodeMap) {
+        var nodeId = graph.nodeMap[nodeName];
+        var componentName = graph.processes[nodeName].component;
+        nodeNames[nodeId] = nodeName;
+        inPorts[nodeId] = byId(componentLib.inputPortsFor(componentName));
+        outPorts[nodeId] = byId(componentLib.outputPortsFor(componentName));
+    }
+    var endpoint = function(node, port, ports) {
+        if (node == 0xFFFF) {
+            return undefined;
+        }
+        return { node: nodeNames[node] || node, port: (ports[node] && ports[node][port]) || port };
+    }
+    var packet = function(b, offset) {
+        var type = packetTypes[b[offset+4]] || b[offset+4];
+        var p = { type: type };
+        if (type == "Integer") {
+            p.value = b.readInt32LE(offset);
+        } else if (type == "Float") {
+            p.value = b.readFloatLE(offset);
+        } else if (type == "Boolean") {
+            p.value = b[offset] != 0;
+        } else if (type == "Byte") {
+            p.value = b[offset];
+        } else if (type == "Ascii") {
+            p.value = String.fromCharCode(b[offset]);
+        } else if (type == "Buffer") {
+            p.length = b.readUInt16LE(offset+2);
+            p.text = b[offset+1] != 0;
+        }
+        return p;
+    }
+
+    var size = cmdFormat.traceRecordSize;
+    var pending = new Buffer(0);
+    this.push = function(data) {
+        pending = Buffer.concat([pending, data]);
+        var start = 0;
+        while (true) {
+            while (start < pending.length && pending[start] != cmdFormat.traceMarker) {
+                start++;
+            }
+            if (pending.length - start < size) {
+                break;
+            }
+            var b = pending.slice(start+1, start+size);
+            var event = events[b[0]];
+            if (!event) {
+                start++; // a marker byte inside something else, resync
+                continue;
+            }
+            var connection = b.readUInt16LE(1);
+            var record = {
+                event: event,
+                time: b.readUInt16LE(3),
+                connection: (connection == 0xFFFF) ? -1 : connection,
+                src: endpoint(b.readUInt16LE(5), b[7], outPorts),
+                tgt: endpoint(b.readUInt16LE(8), b[10], inPorts),
+                packet: packet(b, 11)
+            };
+            if (event == "AddNode") {
+                var component = componentLib.getComponentById(record.packet.value);
+                record.component = component ? component.name : record.packet.value;
+            } else if (event == "Dropped") {
+                record.count = record.packet.value;
+            }
+            onRecord(record);
+            start += size;
+        }
+        pending = pending.slice(start);
+    }
+}
+
+// One line per record, for 'microflo.js debug'
+var formatTraceRecord = function(r) {
+    var describe = function(e) {
+        return e ? e.node + " " + e.port : "(outside)";
+    }
+    var value = (r.packet.value !== undefined) ? r.packet.type + ":" + r.packet.value
+            : (r.packet.type == "Buffer") ? "Buffer[" + r.packet.length + "]" : r.packet.type;
+    var prefix = r.time + " ";
+    if (r.event == "Send") {
+        return prefix + "SEND " + describe(r.src) + " -> " + value + " -> " + describe(r.tgt) + " #" + r.connection;
+    } else if (r.event == "Deliver") {
+        return prefix + "DELIVER " + value + " -> " + describe(r.tgt) + " #" + r.connection;
+    } else if (r.event == "Connect") {
+        return prefix + "CONNECT " + describe(r.src) + " -> " + describe(r.tgt) + " #" + r.connection
+            + " capacity " + r.packet.value;
+    } else if (r.event == "AddNode") {
+        return prefix + "ADD " + r.src.node + "(" + r.component + ")";
+    } else if (r.event == "Dropped") {
+        return prefix + "DROPPED " + r.count + " records";
+    }
+}
+
+// Profiling counters from a device built with MICROFLO_PROFILE, as written by
+// Network::writeProfile() after a DumpProfile command.
+// Calls @onSnapshot({nodes: [..], connections: [..]}) for each snapshot with a valid CRC.
+// Node names are from @graph, like for TraceDecoder, and are left out if it is not given
+var ProfileDecoder = function(graph, onSnapshot) {
+    var nodeNames = [];
+    if (graph) {
+        for (var nodeName in graph.nodeMap) {
+            nodeNames[graph.nodeMap[nodeName]] = nodeName;
+        }
+    }
+    var format = cmdFormat.profileSnapshot;
+    var pending = new Buffer(0);
+    var decode = function(b) {
+        var nodeCount = b.readUInt16LE(0);
+        var offset = 4;
+        var snapshot = { nodes: [], connections: [] };
+        for (var i=0; i<nodeCount; i++) {
+            var n = {};
+            if (nodeNames[i] !== undefined) {
+                n.node = nodeNames[i];
+            }
+            for (var f=0; f<format.node.length; f++) {
+                n[format.node[f]] = b.readUInt32LE(offset+4*f);
+            }
+            snapshot.nodes.push(n);
+            offset += format.nodeRecordSize;
+        }
+        var connectionCount = b.readUInt16LE(2);
+        for (var i=0; i<connectionCount; i++) {
+            snapshot.connections.push({
+                capacity: b.readUInt16LE(offset),
+                highWater: b.readUInt16LE(offset+2),
+                dropped: b.readUInt32LE(offset+4)
+            });
+            offset += format.connectionRecordSize;
+        }
+        return snapshot;
+    }
+
+    // A marker byte inside something else can announce a snapshot larger than any that
+    // follows, so later markers are tried while waiting for the rest of an earlier one
+    this.push = function(data) {
+        pending = Buffer.concat([pending, data]);
+        var keep = -1; // first incomplete snapshot
+        var start = 0;
+        while (true) {
+            while (start < pending.length && pending[start] != cmdFormat.profileMarker) {
+                start++;
+            }
+            if (pending.length - start < 5) {
+                break;
+            }
+            var size = 4 + pending.readUInt16LE(start+1)*format.nodeRecordSize
+                    + pending.readUInt16LE(start+3)*format.connectionRecordSize;
+            if (pending.length - start < 1+size+2) {
+                if (keep < 0) {
+                    keep = start;
+                }
+                start++;
+                continue;
+            }
+            var body = pending.slice(start+1, start+1+size);
+            if (crc16(body) != pending.readUInt16LE(start+1+size)) {
+                start++; // resync
+                continue;
+            }
+            onSnapshot(decode(body));
+            start += 1+size+2;
+            keep = -1;
+        }
+        pending = pending.slice((keep >= 0) ? keep : start);
+    }
+}
+
+// A table with one line per node and connection, for 'microflo.js profile'
+var formatProfile = function(snapshot) {
+    var lines = ["node calls totalMicros maxMicros received sent"];
+    snapshot.nodes.forEach(function(n, i) {
+        lines.push([n.node || i, n.calls, n.totalMicros, n.maxMicros, n.received, n.sent].join(" "));
+    });
+    lines.push("connection capacity highWater dropped");
+    snapshot.connections.forEach(function(c, i) {
+        lines.push(["#" + i, c.capacity, c.highWater, c.dropped].join(" "));
+    });
+    return lines.join("\n");
 }
 
 var cmdStreamToCDefinition = function(cmdStream, annotation) {
@@ -261,6 +815,55 @@ var cmdStreamToC = function(cmdStream, annotation) {
     return cCode;
 }
 
+// The .fbp syntax has no node or connection metadata, so it is given in comments:
+// # @edge src() OUT -> IN tgt() capacity=24 overflow=drop-oldest priority=high
+// # @node name() priority=high
+var applyFbpAnnotations = function(def, data) {
+    var edgeRe = /^\s*#\s*@edge\s+(\w+)(?:\(\))?\s+(\w+)\s*->\s*(\w+)\s+(\w+)(?:\(\))?\s*(.*)$/;
+    var nodeRe = /^\s*#\s*@node\s+(\w+)(?:\(\))?\s*(.*)$/;
+    var parseOptions = function(options) {
+        var metadata = {};
+        options.split(/\s+/).forEach(function(option) {
+            var kv = option.split("=");
+            if (kv.length != 2) {
+                return;
+            }
+            metadata[kv[0]] = (kv[0] === "capacity") ? parseInt(kv[1]) : kv[1];
+        });
+        return metadata;
+    }
+    data.split("\n").forEach(function(line) {
+        var match = nodeRe.exec(line);
+        if (match) {
+            var process = def.processes[match[1]];
+            if (!process) {
+                throw "Annotation does not match any node: " + line;
+            }
+            process.metadata = parseOptions(match[2]);
+            return;
+        }
+        match = edgeRe.exec(line);
+        if (!match) {
+            return;
+        }
+        var metadata = parseOptions(match[5]);
+        var found = false;
+        def.connections.forEach(function(connection) {
+            if (connection.src && connection.src.process === match[1]
+                && connection.src.port.toLowerCase() === match[2].toLowerCase()
+                && connection.tgt.port.toLowerCase() === match[3].toLowerCase()
+                && connection.tgt.process === match[4]) {
+                connection.metadata = metadata;
+                found = true;
+            }
+        });
+        if (!found) {
+            throw "Annotation does not match any connection: " + line;
+        }
+    });
+    return def;
+}
+
 // TODO: Use noflo.graph.loadFile() instead?
 var loadFile = function(filename, callback) {
     fs.readFile(filename, {encoding: "utf8"}, function(err, data) {
@@ -268,7 +871,7 @@ var loadFile = function(filename, callback) {
 
         var def;
         if (path.extname(filename) == ".fbp") {
-            def = fbp.parse(data);
+            def = applyFbpAnnotations(fbp.parse(data), data);
         } else {
             def = JSON.parse(data);
         }
@@ -276,7 +879,7 @@ var loadFile = function(filename, callback) {
     });
 }
 
-var generateOutput = function(componentLib, inputFile, outputFile) {
+var generateOutput = function(componentLib, inputFile, outputFile, options) {
     var outputBase = outputFile.replace(path.extname(outputFile), "")
     var outputDir = path.dirname(outputBase);
     if (!fs.existsSync(outputDir)) {
@@ -290,14 +893,21 @@ var generateOutput = function(componentLib, inputFile, outputFile) {
         fs.writeFile(outputBase + ".json", JSON.stringify(def), function(err) {
             if (err) throw err;
         });
-        data = cmdStreamFromGraph(componentLib, def);
+        data = cmdStreamFromGraph(componentLib, def, options);
         fs.writeFile(outputBase + ".fbcs", data, function(err) {
             if (err) throw err;
         });
         fs.writeFile(outputBase + ".h", cmdStreamToCDefinition(data), function(err) {
             if (err) throw err;
         });
-        fs.writeFile(outputBase + ".cpp", cmdStreamToCDefinition(data) + "\n"
+        // Firmware for live upload must have room for any graph. Next to the firmware,
+        // used in place of the default from update-defs when built with MICROFLO_GRAPH_ARENA
+        var arenaGraph = (options && options.live) ? undefined : def;
+        fs.writeFile(path.join(outputDir, "microflo-arena.h"),
+                     generateComponentArena(componentLib, arenaGraph, inputFile),
+                     function(err) { if (err) throw err });
+        var defines = (options && options.live) ? "#define MICROFLO_UPLOAD\n" : "";
+        fs.writeFile(outputBase + ".cpp", cmdStreamToCDefinition(data) + "\n" + defines
                      + '#include "microflo.h"' + '\n#include "main.hpp"',
                      function(err) {
             if (err) throw err;
@@ -306,6 +916,247 @@ var generateOutput = function(componentLib, inputFile, outputFile) {
 
 }
 
+// Connections which close a cycle, as a map connectionIndex->true.
+// These are the back edges of a depth-first search, so the remaining edges form a DAG
+var findBackEdges = function(graph) {
+    var edges = {};
+    for (var nodeName in graph.processes) {
+        edges[nodeName] = [];
+    }
+    graph.connections.forEach(function(connection, index) {
+        if (connection.src !== undefined) {
+            edges[connection.src.process].push({ target: connection.tgt.process, index: index });
+        }
+    });
+
+    var state = {}; // undefined: not visited, 1: on the DFS path, 2: done
+    var backEdges = {};
+    var visit = function(node) {
+        state[node] = 1;
+        edges[node].forEach(function(edge) {
+            if (state[edge.target] === 1) {
+                backEdges[edge.index] = true;
+            } else if (state[edge.target] === undefined) {
+                visit(edge.target);
+            }
+        });
+        state[node] = 2;
+    }
+    for (var nodeName in graph.processes) {
+        if (state[nodeName] === undefined) {
+            visit(nodeName);
+        }
+    }
+    return backEdges;
+}
+
+// Longest chain of direct calls, following the edges other than @backEdges, as
+// { hops: n, from: nodeName, to: nodeName }. Each hop nests a process() call on the stack
+var longestDirectChain = function(graph, backEdges) {
+    var incoming = {};
+    var outgoing = {};
+    for (var nodeName in graph.processes) {
+        incoming[nodeName] = 0;
+        outgoing[nodeName] = [];
+    }
+    graph.connections.forEach(function(connection, index) {
+        if (connection.src !== undefined && !backEdges[index]) {
+            outgoing[connection.src.process].push(connection.tgt.process);
+            incoming[connection.tgt.process]++;
+        }
+    });
+
+    // Without back edges the graph is a DAG, visit it in topological order
+    var chains = {}; // longest chain ending at the node
+    var ready = [];
+    for (var nodeName in graph.processes) {
+        chains[nodeName] = { hops: 0, from: nodeName, to: nodeName };
+        if (incoming[nodeName] === 0) {
+            ready.push(nodeName);
+        }
+    }
+    var longest = { hops: 0 };
+    while (ready.length) {
+        var node = ready.pop();
+        var chain = chains[node];
+        if (chain.hops > longest.hops) {
+            longest = chain;
+        }
+        outgoing[node].forEach(function(target) {
+            if (chain.hops + 1 > chains[target].hops) {
+                chains[target] = { hops: chain.hops + 1, from: chain.from, to: target };
+            }
+            if (--incoming[target] === 0) {
+                ready.push(target);
+            }
+        });
+    }
+    return longest;
+}
+
+// C++ expressions for the packets of an IIP, decoded from the command stream encoding
+var dataLiteralToPackets = function(literal) {
+    var cmds = dataLiteralToCommand(literal, 0, 0);
+    var packets = [];
+    for (var offset=0; offset<cmds.length; offset+=cmdFormat.commandSize) {
+        var type = cmds.readInt8(offset+3);
+        if (type == cmdFormat.packetTypes.Integer.id) {
+            packets.push("Packet((long)" + cmds.readInt32LE(offset+4) + ")");
+        } else if (type == cmdFormat.packetTypes.Boolean.id) {
+            packets.push("Packet(" + (cmds.readInt8(offset+4) ? "true" : "false") + ")");
+        } else if (type == cmdFormat.packetTypes.Byte.id) {
+            packets.push("Packet((unsigned char)" + cmds.readUInt8(offset+4) + ")");
+        } else if (type == cmdFormat.packetTypes.BracketStart.id) {
+            packets.push("Packet(MsgBracketStart)");
+        } else if (type == cmdFormat.packetTypes.BracketEnd.id) {
+            packets.push("Packet(MsgBracketEnd)");
+        }
+    }
+    return packets;
+}
+
+// Statically wired C++ for @graph. Every node is a global of its concrete type, and edges
+// are direct, non-virtual calls. Edges closing a cycle go through a Network queue instead,
+// since a direct call would re-enter a node which is still processing.
+// Throws if a chain of direct calls is longer than @maxDepth hops, since it would take that
+// many nested calls on the stack. A queue in the chain would not help: when it fills up,
+// nothing stops the nodes calling into it directly, so packets would be dropped
+var generateStaticGraph = function(componentLib, graph, graphFile, maxDepth) {
+    var backEdges = findBackEdges(graph);
+    var longest = longestDirectChain(graph, backEdges);
+    if (longest.hops > maxDepth) {
+        throw new Error(graphFile + ": " + longest.hops + " direct calls from " + longest.from + " to "
+                        + longest.to + ", more than the limit of " + maxDepth + " (see --depth)");
+    }
+    var nodeIds = {};
+    var variables = {};
+    var currentNodeId = 0;
+    for (var nodeName in graph.processes) {
+        nodeIds[nodeName] = currentNodeId++;
+        variables[nodeName] = "node_" + nodeName.replace(/[^A-Za-z0-9_]/g, "_");
+    }
+    var componentOf = function(nodeName) {
+        return graph.processes[nodeName].component;
+    }
+
+    var out = "// Statically wired graph for " + graphFile + ", generated by 'microflo.js compile'\n";
+    out += "// Edges are direct calls, nested up to " + longest.hops + " deep (limit " + maxDepth + "),\n";
+    out += "// except those closing a cycle which go through a Network queue\n";
+    out += "#define MICROFLO_STATIC_GRAPH\n";
+    out += '#include "microflo.hpp"\n\n';
+
+    for (var nodeName in graph.processes) {
+        out += "static " + componentOf(nodeName) + " " + variables[nodeName] + "; // " + nodeIds[nodeName] + "\n";
+    }
+
+    // Routes per output port
+    var routes = {};
+    var queued = [];
+    graph.connections.forEach(function(connection, index) {
+        if (connection.src === undefined) {
+            return;
+        }
+        var src = connection.src.process;
+        var tgt = connection.tgt.process;
+        var srcPortDef = componentLib.outputPort(componentOf(src), connection.src.port);
+        var tgtPortDef = componentLib.inputPort(componentOf(tgt), connection.tgt.port);
+        var route = { src: src, srcPort: srcPortDef.id, srcPortName: connection.src.port,
+                      tgt: tgt, tgtPort: tgtPortDef.id, tgtPortName: connection.tgt.port,
+                      buffers: tgtPortDef.buffers,
+                      queue: queueConfigForConnection(connection, srcPortDef, tgtPortDef),
+                      priority: priorityFromMetadata(connection.metadata) };
+        if (backEdges[index]) {
+            queued.push(route);
+            route.queued = true;
+        }
+        routes[src] = routes[src] || {};
+        routes[src][route.srcPort] = routes[src][route.srcPort] || [];
+        routes[src][route.srcPort].push(route);
+    });
+
+    var indent = "\n    ";
+    out += "\nvoid microfloStaticSetup(Network *network) {";
+    for (var nodeName in graph.processes) {
+        var v = variables[nodeName];
+        out += indent + v + ".componentId = Id" + componentOf(nodeName) + ";";
+        if (componentLib.getComponent(componentOf(nodeName)).ticks) {
+            out += indent + v + ".subscribeTicks();";
+        }
+        out += indent + "network->addNode(&" + v + ");";
+    }
+    // Only the tick order and queued edges are affected, other edges are direct calls
+    for (var nodeName in graph.processes) {
+        var priority = priorityFromMetadata(graph.processes[nodeName].metadata);
+        if (priority != cmdFormat.priorities.Default.id) {
+            out += indent + "network->setPriority(" + nodeIds[nodeName] + ", (Priority)" + priority + ");";
+        }
+    }
+    if (queued.length) {
+        out += "\n" + indent + "// Edges closing a cycle";
+        queued.forEach(function(r) {
+            out += indent + "network->connect(&" + variables[r.src] + ", " + r.srcPort + ", &"
+                + variables[r.tgt] + ", " + r.tgtPort + ", " + r.queue.capacity + ", (OverflowPolicy)"
+                + r.queue.overflow + ");";
+            if (r.priority != cmdFormat.priorities.Default.id) {
+                out += indent + "network->setPriority(" + nodeIds[r.src] + ", " + r.srcPort + ", "
+                    + nodeIds[r.tgt] + ", " + r.tgtPort + ", (Priority)" + r.priority + ");";
+            }
+        });
+    }
+    var iips = graph.connections.filter(function(c) { return c.data !== undefined; });
+    if (iips.length) {
+        out += "\n" + indent + "// IIPs";
+        iips.forEach(function(connection) {
+            var tgt = connection.tgt.process;
+            var tgtPort = componentLib.inputPort(componentOf(tgt), connection.tgt.port).id;
+            dataLiteralToPackets(connection.data).forEach(function(packet) {
+                out += indent + "network->sendInitialPacket(" + nodeIds[tgt] + ", " + tgtPort + ", " + packet + "); // " + tgt;
+            });
+        });
+    }
+    out += "\n}\n";
+
+    out += "\nbool microfloStaticSend(int nodeId, int port, const Packet &pkg) {";
+    out += indent + "switch (nodeId) {";
+    for (var nodeName in routes) {
+        out += indent + "case " + nodeIds[nodeName] + ": // " + nodeName;
+        out += indent + "    switch (port) {";
+        for (var srcPort in routes[nodeName]) {
+            var portRoutes = routes[nodeName][srcPort];
+            var isQueued = false;
+            out += indent + "    case " + srcPort + ": // " + portRoutes[0].srcPortName;
+            portRoutes.forEach(function(r) {
+                if (r.queued) {
+                    isQueued = true;
+                    return;
+                }
+                var call = variables[r.tgt] + "." + componentOf(r.tgt) + "::process(pkg, " + r.tgtPort + ");";
+                if (!r.buffers) {
+                    // Bracketed stream adapter, like Network::deliver()
+                    call = "if (pkg.isBuffer()) " + variables[r.tgt] + ".expandBuffer(pkg, " + r.tgtPort + "); else " + call;
+                }
+                out += indent + "        " + call + " // " + r.tgt + " " + r.tgtPortName;
+            });
+            out += indent + "        return " + (isQueued ? "false" : "true") + ";";
+        }
+        out += indent + "    }";
+        out += indent + "    break;";
+    }
+    out += indent + "}";
+    out += indent + "return true; // not connected";
+    out += "\n}\n";
+    return out;
+}
+
+var compileGraph = function(componentLib, inputFile, outputFile, maxDepth) {
+    loadFile(inputFile, function(err, def) {
+        if (err) throw err;
+        fs.writeFile(outputFile, generateStaticGraph(componentLib, def, inputFile, maxDepth), function(err) {
+            if (err) throw err;
+        });
+    });
+}
+
 var generateEnum = function(name, prefix, enums) {
     if (Object.keys(enums).length === 0) {
         return ""
@@ -346,13 +1197,81 @@ var generateComponentFactory = function(componentLib) {
     var out = "Component *Component::create(ComponentId id) {"
     var indent = "\n    ";
     out += indent + "Component *c;";
+    out += indent + "bool ticks = false;";
     out += indent + "switch (id) {";
     for (var name in componentLib.listComponents()) {
-        out += indent + "case Id" + name + ": c = new " + name + "; c->componentId=id; return c;"
+        var comp = componentLib.getComponent(name);
+        var subscribe = comp.ticks ? " ticks = true;" : "";
+        out += indent + "case Id" + name + ": c = constructComponent<" + name + ">();" + subscribe + " break;"
     }
     out += indent + "default: return NULL;"
     out += indent + "}"
-    out += "}"
+    out += indent + "if (c) {"
+    out += indent + "    c->componentId = id;"
+    out += indent + "    c->created = true;"
+    out += indent + "    if (ticks) {"
+    out += indent + "        c->subscribeTicks();"
+    out += indent + "    }"
+    out += indent + "}"
+    out += indent + "return c;"
+    out += "\n}"
+    return out;
+}
+
+// Input ports which handle MsgBuffer themselves, marked with "buffers" in components.json.
+// Buffers to other ports are expanded to a bracketed stream by the Network
+var generateBufferPorts = function(componentLib) {
+    var out = "bool Component::acceptsBuffers(int port) const {";
+    var indent = "\n    ";
+    out += indent + "switch (componentId) {";
+    for (var name in componentLib.listComponents()) {
+        var ports = componentLib.inputPortsFor(name);
+        var accepting = [];
+        for (var portName in ports) {
+            if (ports[portName].buffers) {
+                accepting.push("port == " + ports[portName].id);
+            }
+        }
+        if (accepting.length) {
+            out += indent + "case Id" + name + ": return " + accepting.join(" || ") + ";";
+        }
+    }
+    out += indent + "default: return false;";
+    out += indent + "}";
+    out += "\n}";
+    return out;
+}
+
+// Size of the static component arena used on device, see components.cpp.
+// Without a @graph, room for MAX_NODES of the largest component
+var generateComponentArena = function(componentLib, graph, graphFile) {
+    var slot = function(name) {
+        return "MICROFLO_ARENA_SLOT(sizeof(" + name + "))";
+    }
+    var out = "";
+    if (graph) {
+        out += "// Component arena for " + graphFile + "\n";
+        var sizes = [];
+        for (var nodeName in graph.processes) {
+            if (graph.processes.hasOwnProperty(nodeName)) {
+                sizes.push(slot(graph.processes[nodeName].component));
+            }
+        }
+        out += "#define MICROFLO_ARENA_SIZE (0";
+        sizes.forEach(function(size) {
+            out += " \\\n    + " + size;
+        });
+        out += ")\n";
+    } else {
+        out += "// Component arena for any graph, up to MAX_NODES of the largest component\n";
+        out += "union MicroFloLargestComponent {\n";
+        var index = 0;
+        for (var name in componentLib.listComponents()) {
+            out += "    char size" + index++ + "[sizeof(" + name + ")];\n";
+        }
+        out += "};\n";
+        out += "#define MICROFLO_ARENA_SIZE (MAX_NODES*" + slot("MicroFloLargestComponent") + ")\n";
+    }
     return out;
 }
 
@@ -365,24 +1284,75 @@ var portDefAsArray = function(port) {
 }
 
 // Main
-var cmd = process.argv[2];
+// Options are --name=value or --name, anywhere on the commandline
+var options = {};
+var args = process.argv.filter(function(arg) {
+    var option = arg.match(/^--([a-z]+)(=(.*))?$/);
+    if (option) {
+        options[option[1]] = (option[3] !== undefined) ? option[3] : true;
+    }
+    return !option;
+});
+
+var cmd = args[2];
 if (cmd == "generate") {
     addon = require("./build/Release/MicroFlo.node");
     fbp = require("fbp");
     noflo = require("noflo");
 
-    var inputFile = process.argv[3];
-    var outputFile = process.argv[4] || inputFile
-    generateOutput(componentLib, inputFile, outputFile);
+    // --format=2 for the v2 command stream format,
+    // --live for firmware which accepts new graphs with 'microflo.js upload'
+    var inputFile = args[3];
+    var outputFile = args[4] || inputFile
+    generateOutput(componentLib, inputFile, outputFile,
+                   { version: parseInt(options.format || 1), live: options.live });
+} else if (cmd == "upload") {
+    // Replace the graph on a device running firmware generated with --live
+    var serialport = require("serialport");
+    fbp = require("fbp");
+
+    var serial = new serialport.SerialPort(options.serial || "/dev/ttyUSB0",
+                                           {baudrate: parseInt(options.baudrate || 9600)}, false);
+    loadFile(args[3], function(err, graph) {
+        if (err) throw err;
+        var stream = cmdStreamFromGraph(componentLib, graph, {version: 2});
+        serial.open(function(err) {
+            if (err) throw err;
+            uploadGraph(serial, stream, function(err, stats) {
+                serial.close();
+                if (err) {
+                    console.error("Upload failed: " + err.message);
+                    process.exit(1);
+                }
+                console.log("Uploaded " + stats.bytes + " bytes in " + stats.ms + " ms, "
+                            + stats.resent + " frames resent");
+            });
+        });
+    });
+} else if (cmd == "compile") {
+    fbp = require("fbp");
+
+    // --depth=N for the longest chain of direct calls, which is how deep they nest on the stack
+    var inputFile = args[3];
+    var outputFile = args[4] || inputFile.replace(path.extname(inputFile), ".cpp");
+    compileGraph(componentLib, inputFile, outputFile, parseInt(options.depth || 32));
 } else if (cmd == "update-defs") {
     fs.writeFile("microflo/components-gen.h", generateEnum("ComponentId", "Id", componentLib.listComponents()),
                  function(err) { if (err) throw err });
-    fs.writeFile("microflo/components-gen-bottom.hpp", generateComponentFactory(componentLib),
+    fs.writeFile("microflo/components-gen-bottom.hpp", generateComponentFactory(componentLib) +
+                 "\n\n" + generateBufferPorts(componentLib),
+                 function(err) { if (err) throw err });
+    fs.writeFile("microflo/components-gen-arena.h", generateComponentArena(componentLib),
                  function(err) { if (err) throw err });
     fs.writeFile("microflo/components-gen-top.hpp", generateComponentPortDefinitions(componentLib),
                  function(err) { if (err) throw err });
     fs.writeFile("microflo/commandformat-gen.h", generateEnum("GraphCmd", "GraphCmd", cmdFormat.commands) +
-                 "\n" + generateEnum("Msg", "Msg", cmdFormat.packetTypes),
+                 "\n" + generateEnum("Msg", "Msg", cmdFormat.packetTypes) +
+                 "\n" + generateEnum("OverflowPolicy", "Overflow", cmdFormat.overflowPolicies) +
+                 "\n" + generateEnum("Priority", "Priority", cmdFormat.priorities) +
+                 "\n" + generateEnum("UploadFrame", "UploadFrame", cmdFormat.uploadFrames) +
+                 "\n" + generateEnum("UploadError", "UploadError", cmdFormat.uploadErrors) +
+                 "\n" + generateEnum("TraceEvent", "TraceEvent", cmdFormat.traceEvents),
                  function(err) { if (err) throw err });
 } else if (cmd == "runtime") {
     var http = require('http');
@@ -435,93 +1405,61 @@ if (cmd == "generate") {
     });
 
 } else if (cmd == "debug") {
+    // Decodes the trace of firmware built with MICROFLO_TRACE defined
     var serialport = require("serialport");
+    fbp = require("fbp");
 
-    serialport.list(function (err, ports) {
-      ports.forEach(function(port) {
-        console.log(port.comName);
-        console.log(port.pnpId);
-        console.log(port.manufacturer);
-      });
+    var serial = new serialport.SerialPort(options.serial || "/dev/ttyUSB0",
+                                           {baudrate: parseInt(options.baudrate || 9600)}, false);
+    loadFile(args[3], function(err, graph) {
+        if (err) throw err;
+        // XXX: exploits the sideeffect that the nodeId->nodeName mappping is created
+        cmdStreamFromGraph(componentLib, graph);
+        var decoder = new TraceDecoder(componentLib, graph, function(record) {
+            console.log(formatTraceRecord(record));
+        });
+        serial.open(function(err) {
+            if (err) throw err;
+            serial.on("data", function(data) {
+                decoder.push(data);
+            });
+        });
     });
-    var buf = "";
-    var parseSerial = function(graph, data) {
-        buf += data;
-        //process.stdout.write(buf);
-        var lines = buf.split("\r\n");
-        for (var i=0; i<lines.length-1; i++) {
-            var line = lines[i];
-            // TEMP: use binary commandstream protocol instead
-
-            var nodeNameById = function(nodeId) {
-                for (name in graph.nodeMap) {
-                    var id = graph.nodeMap[name];
-                    if (id == nodeId) {
-                        return name;
-                    }
-                }
-            }
-            var portNameFor = function(nodeId, portId, inputOrOutput) {
-                var nodeName = nodeNameById(nodeId);
-                var componentName = graph.processes[nodeName].component;
-                if (inputOrOutput == "input") {
-                    return componentLib.inputPortById(componentName, portId).name;
-                } else {
-                    return componentLib.outputPortById(componentName, portId).name;
-                }
-            }
 
-            var tokens = "";
-            if (line.indexOf("ADD: ") == 0) {
-                line = line.replace("ADD: ", "");
-                tokens = line.split(",");
-                var componentId = parseInt(tokens[0]);
-                var nodeId = parseInt(tokens[1]);
-                var c = componentLib.getComponentById(componentId);
-                console.log("CREATED: " + nodeNameById(nodeId) + "(" + c.name + ")");
-            } else if (line.indexOf("CONNECT: ") == 0) {
-                line = line.replace("CONNECT: ", "");
-                tokens = line.split(",");
-                var srcNodeId = parseInt(tokens[0]);
-                var srcPortId = parseInt(tokens[1]);
-                var targetNodeId = parseInt(tokens[2]);
-                var targetPortId = parseInt(tokens[3]);
-                console.log("CONNECTED:",
-                            nodeNameById(srcNodeId),
-                            portNameFor(srcNodeId, srcPortId), "->",
-                            portNameFor(targetNodeId, targetPortId, "input"),
-                            nodeNameById(targetNodeId)
-                );
-            } else if (line.indexOf("SEND: ") == 0) {
-                line = line.replace("SEND: ", "");
-                tokens = line.split(",");
-                srcNodeId = parseInt(tokens[1]);
-                srcPortId = parseInt(tokens[2]);
-                targetNodeId = parseInt(tokens[3]);
-                targetPortId = parseInt(tokens[4]);
-                var message = tokens[5]; // TODO: decode
-                console.log("SENT:",
-                            nodeNameById(srcNodeId),
-                            portNameFor(srcNodeId, srcPortId), "-> " + message + " ->",
-                            portNameFor(targetNodeId, targetPortId, "input"),
-                            nodeNameById(targetNodeId)
-                );
-            } else if (line.indexOf("DELIVER: ") == 0) {
-
-            }
-        }
-        buf = lines[lines.length-1];
-    }
-    // FIXME: automatically detect correct port, allow to override
-    var serial = new serialport.SerialPort("/dev/ttyUSB1", {baudrate: 9600}, false);
-    loadFile(process.argv[3], function(err, graph) {
+} else if (cmd == "profile") {
+    // Queries the counters of firmware generated with --live and built with MICROFLO_PROFILE.
+    // The DumpProfile command is sent like a graph upload, and runs against the current graph
+    var serialport = require("serialport");
+    fbp = require("fbp");
+
+    var serial = new serialport.SerialPort(options.serial || "/dev/ttyUSB0",
+                                           {baudrate: parseInt(options.baudrate || 9600)}, false);
+    loadFile(args[3], function(err, graph) {
+        if (err) throw err;
         // XXX: exploits the sideeffect that the nodeId->nodeName mappping is created
         cmdStreamFromGraph(componentLib, graph);
-
-        serial.open(function(){
-            console.log("opened")
+        var body = new Buffer([cmdFormat.commands.DumpProfile.id]);
+        var stream = Buffer.concat([new Buffer(cmdFormat.magicStringV2), body, cmdEncoders[2].end(body)]);
+        var timer = undefined;
+        var decoder = new ProfileDecoder(graph, function(snapshot) {
+            clearTimeout(timer);
+            console.log(formatProfile(snapshot));
+            serial.close();
+        });
+        serial.open(function(err) {
+            if (err) throw err;
             serial.on("data", function(data) {
-                parseSerial(graph, data);
+                decoder.push(data);
+            });
+            uploadGraph(serial, stream, function(err) {
+                if (err) {
+                    console.error("Query failed: " + err.message);
+                    process.exit(1);
+                }
+                timer = setTimeout(function() {
+                    console.error("No profile from device, is it built with MICROFLO_PROFILE?");
+                    process.exit(1);
+                }, 1000);
             });
         });
     });
@@ -534,12 +1472,7 @@ if (cmd == "generate") {
     var io = undefined; // new addon.IO()
     var net = new addon.Network(io);
     loadFile("./examples/monitorPin.fbp", function(err, graph) {
-        var stream = cmdStreamFromGraph(componentLib, graph);
-        var endpoint = new addon.GraphStreamer(net);
-        for (var i=0; i<stream.length; i++) {
-            var b = stream.readUInt8(i);
-            endpoint.parseByte(b);
-        }
+        net.loadGraph(cmdStreamFromGraph(componentLib, graph));
         var comp = new addon.Component();
         comp.on("process", function(packet, port) {
             console.log(packet, port);
@@ -548,11 +1481,20 @@ if (cmd == "generate") {
 
         console.log("Running MicroFlo network in host");
         net.runSetup();
-        setInterval(function () { net.runTick(); }, 100);
+        if (options.thread) {
+            // On its own thread, so the event loop is not stalled by the network
+            net.start();
+        } else {
+            setInterval(function () { net.runTick(); }, 100);
+        }
     });
 
 } else if (require.main === module) {
-    throw "Invalid commandline arguments. Usage: node microflo.js generate INPUT [OUTPUT]"
+    throw "Invalid commandline arguments. Usage: node microflo.js generate INPUT [OUTPUT] [--format=2] [--live]\n"
+        + "    node microflo.js compile GRAPH [OUTPUT] [--depth=32]\n"
+        + "    node microflo.js upload GRAPH [--serial=/dev/ttyUSB0] [--baudrate=9600]\n"
+        + "    node microflo.js debug GRAPH [--serial=/dev/ttyUSB0] [--baudrate=9600]\n"
+        + "    node microflo.js profile GRAPH [--serial=/dev/ttyUSB0] [--baudrate=9600]"
 }
 
 module.exports = {
@@ -560,5 +1502,11 @@ module.exports = {
     ComponentLibrary: ComponentLibrary,
     componentLib: componentLib,
     cmdStreamFromGraph: cmdStreamFromGraph,
+    uploadFrame: uploadFrame,
+    uploadGraph: uploadGraph,
+    TraceDecoder: TraceDecoder,
+    formatTraceRecord: formatTraceRecord,
+    ProfileDecoder: ProfileDecoder,
+    formatProfile: formatProfile,
     generateOutput: generateOutput
 }
@@ -7,8 +7,22 @@
 
 #include "microflo.h"
 
+#include <avr/sleep.h>
+
+#ifdef HAVE_DALLAS_TEMPERATURE
+#include <OneWire.h>
+#include <DallasTemperature.h>
+static const int MAX_ONEWIRE_BUSES = 2;
+#endif
+
 static const int MAX_EXTERNAL_INTERRUPTS = 3;
 
+#ifdef SERIAL_TX_BUFFER_SIZE
+static const int SERIAL_TX_RING = SERIAL_TX_BUFFER_SIZE;
+#else
+static const int SERIAL_TX_RING = 16; // the smallest ring HardwareSerial uses
+#endif
+
 struct InterruptHandler {
     IOInterruptFunction func;
     void *user;
@@ -50,13 +64,25 @@ public:
     }
 
 public:
-    ArduinoIO() {}
+    ArduinoIO()
+        : txByteMicros(10000000L/9600)
+        , txQueued(0)
+        , txMark(0)
+#ifdef HAVE_DALLAS_TEMPERATURE
+        , busCount(0)
+#endif
+    {}
     ~ArduinoIO() {}
 
     // Serial
     // TODO: support multiple serial devices
+    // HardwareSerial receives and transmits from interrupts, through rings. Writing blocks
+    // when the transmit ring is full, and how full it is cannot be asked, so bulk writes
+    // assume it empties at the baudrate, like Tracer::drain()
     virtual void SerialBegin(int serialDevice, int baudrate) {
         Serial.begin(baudrate);
+        txByteMicros = (baudrate > 0) ? 10000000L/baudrate : 1; // 10 bits per byte
+        txQueued = 0;
     }
     virtual long SerialDataAvailable(int serialDevice) {
         return Serial.available();
@@ -65,7 +91,26 @@ public:
         return Serial.read();
     }
     virtual void SerialWrite(int serialDevice, unsigned char b) {
+        updateTxQueued();
         Serial.write(b);
+        txQueued = (txQueued < SERIAL_TX_RING) ? txQueued+1 : SERIAL_TX_RING;
+    }
+    virtual long SerialRead(int serialDevice, unsigned char *buffer, long length) {
+        long n = 0;
+        while (n < length && Serial.available() > 0) {
+            buffer[n++] = Serial.read();
+        }
+        return n;
+    }
+    virtual long SerialWrite(int serialDevice, const unsigned char *buffer, long length) {
+        updateTxQueued();
+        const long room = SERIAL_TX_RING - txQueued;
+        const long n = (room < length) ? room : length;
+        for (long i=0; i<n; i++) {
+            Serial.write(buffer[i]);
+        }
+        txQueued += n;
+        return n;
     }
 
     // Pin config
@@ -100,6 +145,23 @@ public:
     virtual long TimerCurrentMs() {
         return millis();
     }
+    // In steps of 4 us on 16 MHz boards
+    virtual unsigned long TimerCurrentMicros() {
+        return micros();
+    }
+
+    // Power management
+    // Any interrupt wakes us up, including the millis() timer overflow every ~1ms,
+    // so the timeout is met by the caller checking its deadlines again
+    virtual void WaitForEvent(long timeoutMs) {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        sleep_cpu();
+        sleep_disable();
+    }
+    virtual void NotifyEvent() {
+        // Interrupts wake the CPU by themselves
+    }
 
     virtual void AttachExternalInterrupt(int interrupt, IO::Interrupt::Mode mode, IOInterruptFunction func, void *user) {
         externalInterruptHandlers[interrupt].func = func;
@@ -113,83 +175,89 @@ public:
             attachInterrupt(interrupt, externalInterrupt2, m);
         }
     }
-};
-
-#ifdef DEBUG
-class Debugger {
-public:
-    static void setup(Network *network);
-    static void printPacket(Packet *p);
-    static void printSend(int index, Message m, Component *sender, int senderPort);
-    static void printDeliver(int index, Message m);
-    static void printAdd(Component *c);
-    static void printConnect(Component *src, int srcPort, Component *target, int targetPort);
-};
+    virtual void DetachExternalInterrupt(int interrupt) {
+        detachInterrupt(interrupt);
+        externalInterruptHandlers[interrupt].func = 0;
+        externalInterruptHandlers[interrupt].user = 0;
+    }
 
-void Debugger::setup(Network *network) {
-    Serial.begin(9600);
-    network->setNotifications(&Debugger::printSend, &Debugger::printDeliver,
-                              &Debugger::printConnect, &Debugger::printAdd);
-}
+    // Asynchronous operations
+    virtual long PollCompletions() {
+        return completions.poll(millis());
+    }
+    virtual void CancelCompletions(void *user) {
+        completions.cancel(user);
+    }
 
-// FIXME: print async, currently output gets truncated on networks with > 3 edges
-void Debugger::printPacket(Packet *p) {
-    Serial.print("IP(");
-    Serial.print(p->type());
-    Serial.print(":");
-    if (p->isByte()) {
-        Serial.print(p->asByte(), HEX);
-    } else if (p->isAscii()) {
-        Serial.print(p->asAscii());
-    } else {
-        // FIXME:
-    }
-    Serial.print(")");
-}
+    // OneWire. The conversion is started without waiting for it, and done after the time
+    // the sensors need for the resolution
+    virtual void OneWireStartConversion(int pin, int resolution, IOCompletionFunction done, void *user) {
+        if (completions.join(pin, done, user)) {
+            return;
+        }
+#ifdef HAVE_DALLAS_TEMPERATURE
+        DallasTemperature *sensors = bus(pin);
+        if (sensors) {
+            sensors->setResolution(resolution);
+            sensors->setWaitForConversion(false);
+            sensors->requestTemperatures();
+            completions.add(pin, millis(), oneWireConversionMillis(resolution), true, done, user);
+            return;
+        }
+#endif
+        completions.add(pin, millis(), 0, false, done, user);
+    }
+    virtual float OneWireTemperature(int pin, const unsigned char address[8]) {
+#ifdef HAVE_DALLAS_TEMPERATURE
+        DallasTemperature *sensors = bus(pin);
+        if (sensors) {
+            return sensors->getTempC(const_cast<uint8_t *>(address));
+        }
+#endif
+        return ONEWIRE_NO_SENSOR;
+    }
 
-void Debugger::printSend(int index, Message m, Component *sender, int senderPort) {
-    Serial.print("SEND: ");
-    Serial.print(index);
-    Serial.print(",");
-    Serial.print(sender->nodeId);
-    Serial.print(",");
-    Serial.print(senderPort);
-    Serial.print(",");
-    Serial.print(m.target->nodeId);
-    Serial.print(",");
-    Serial.print(m.targetPort, DEC);
-    Serial.print(",");
-    printPacket(&m.pkg);
-    Serial.println();
-}
+private:
+    // Bytes sent since txMark are no longer queued
+    void updateTxQueued() {
+        const unsigned long now = micros();
+        const unsigned long sent = (now - txMark) / txByteMicros;
+        if (sent >= (unsigned long)txQueued) {
+            txQueued = 0;
+            txMark = now;
+        } else {
+            txQueued -= sent;
+            txMark += sent*txByteMicros;
+        }
+    }
 
-void Debugger::printDeliver(int index, Message m) {
-    Serial.print("DELIVER: ");
-    Serial.print(index);
-    Serial.print(",");
-    Serial.print(m.target->nodeId);
-    Serial.print(",");
-    printPacket(&m.pkg);
-    Serial.println();
-}
+    unsigned long txByteMicros;
+    int txQueued;
+    unsigned long txMark;
 
-void Debugger::printAdd(Component *c) {
-    Serial.print("ADD: ");
-    Serial.print(c->componentId);
-    Serial.print(",");
-    Serial.print(c->nodeId);
-    Serial.println();
-}
+#ifdef HAVE_DALLAS_TEMPERATURE
+    // Set up on first use, NULL if there are too many buses
+    DallasTemperature *bus(int pin) {
+        for (int i=0; i<busCount; i++) {
+            if (busPins[i] == pin) {
+                return &sensors[i];
+            }
+        }
+        if (busCount >= MAX_ONEWIRE_BUSES) {
+            return 0;
+        }
+        const int i = busCount++;
+        busPins[i] = pin;
+        wires[i].setPin(pin);
+        sensors[i].setWire(&wires[i]);
+        sensors[i].begin();
+        return &sensors[i];
+    }
 
-void Debugger::printConnect(Component *src, int srcPort, Component *target, int targetPort) {
-    Serial.print("CONNECT: ");
-    Serial.print(src->nodeId);
-    Serial.print(",");
-    Serial.print(srcPort);
-    Serial.print(",");
-    Serial.print(target->nodeId);
-    Serial.print(",");
-    Serial.print(targetPort);
-    Serial.println();
-}
+    int busPins[MAX_ONEWIRE_BUSES];
+    OneWire wires[MAX_ONEWIRE_BUSES];
+    DallasTemperature sensors[MAX_ONEWIRE_BUSES];
+    int busCount;
 #endif
+    IOCompletions completions;
+};
@@ -13,7 +13,7 @@
 // Generic
 class Forward : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         if (in.isData()) {
             send(in, port);
         }
@@ -22,7 +22,7 @@ public:
 
 class Split : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         using namespace SplitPorts;
         if (in.isData()) {
             const int first = (int)OutPorts::out1;
@@ -40,43 +40,144 @@ class Invalid : public DummyComponent {};
 class Max : public DummyComponent {};
 
 // I/O
+// Sends what was received since the previous tick as one text buffer. When no buffer
+// is free, sends a few bytes one by one and leaves the rest for the next tick
 class SerialIn : public Component {
 public:
-    virtual void process(Packet in, int port) {
-        // FIXME: make device and baudrate configurable
-        const int serialDevice = -1;
-
+    virtual void process(const Packet &in, int port) {
+        using namespace SerialInPorts;
         if (in.isSetup()) {
-            // FIXME: do based on input data instead of hardcode
-            io->SerialBegin(serialDevice, 9600);
+            // defaults
+            serialDevice = -1;
+            baudrate = 9600;
+            io->SerialBegin(serialDevice, baudrate);
         } else if (in.isTick()) {
-            if (io->SerialDataAvailable(serialDevice) > 0) {
-                char c = io->SerialRead(serialDevice);
-                send(Packet(c));
-            }
+            receive();
+        } else if (port == InPorts::device && in.isData()) {
+            serialDevice = in.asInteger();
+            io->SerialBegin(serialDevice, baudrate);
+        } else if (port == InPorts::baudrate && in.isData()) {
+            baudrate = in.asInteger();
+            io->SerialBegin(serialDevice, baudrate);
+        }
+    }
+private:
+    void receive() {
+        const long available = io->SerialDataAvailable(serialDevice);
+        if (available <= 0) {
+            return;
+        }
+        const Packet buffer = allocateBuffer((available < BUFFER_SIZE) ? available : BUFFER_SIZE, true);
+        if (buffer.isBuffer()) {
+            io->SerialRead(serialDevice, bufferData(buffer), buffer.bufferLength());
+            send(buffer);
+            releaseBuffer(buffer);
+            return;
+        }
+        unsigned char bytes[DEFAULT_QUEUE_CAPACITY]; // fits an outgoing queue
+        const long received = io->SerialRead(serialDevice, bytes, sizeof(bytes));
+        for (long i=0; i<received; i++) {
+            send(Packet((char)bytes[i]));
         }
     }
+
+    int serialDevice;
+    long baudrate;
 };
 
+// Never blocks: what the serial port does not take yet is kept, up to SERIAL_OUT_PENDING
+// bytes, and written from a timer. Sends false on ready when more than half of that
+// is used, and true once all is written. Bytes which do not fit are lost: the total
+// number lost so far is sent on dropped each time it grows
+const int SERIAL_OUT_PENDING = 2*BUFFER_SIZE;
 class SerialOut : public Component {
 public:
-    virtual void process(Packet in, int port) {
-        // FIXME: make device and baudrate configurable
-        const int serialDevice = -1;
-
+    SerialOut() : pendingStart(0), pendingSize(0), ready(true), dropped(0) {}
+    virtual void process(const Packet &in, int port) {
+        using namespace SerialOutPorts;
         if (in.isSetup()) {
-            io->SerialBegin(serialDevice, 9600);
-        } else if (in.isByte()) {
-            io->SerialWrite(serialDevice, in.asByte());
-        } else if (in.isAscii()) {
-            io->SerialWrite(serialDevice, in.asAscii());
+            // defaults
+            serialDevice = -1;
+            baudrate = 9600;
+            io->SerialBegin(serialDevice, baudrate);
+        } else if (port == TIMER_PORT) {
+            flush();
+        } else if (port == InPorts::device && in.isData()) {
+            serialDevice = in.asInteger();
+            io->SerialBegin(serialDevice, baudrate);
+        } else if (port == InPorts::baudrate && in.isData()) {
+            baudrate = in.asInteger();
+            io->SerialBegin(serialDevice, baudrate);
+        } else if (port == InPorts::in) {
+            if (in.isByte()) {
+                const unsigned char b = in.asByte();
+                write(&b, 1);
+            } else if (in.isAscii()) {
+                const unsigned char c = in.asAscii();
+                write(&c, 1);
+            } else if (in.isBuffer()) {
+                write(bufferData(in), in.bufferLength());
+            }
+        }
+    }
+private:
+    void write(const unsigned char *data, int length) {
+        // Straight to the port when nothing is waiting, to keep the order
+        int written = 0;
+        if (pendingSize == 0) {
+            written = io->SerialWrite(serialDevice, data, length);
+        }
+        int i = written;
+        for (; i<length && pendingSize<SERIAL_OUT_PENDING; i++) {
+            pending[(pendingStart+pendingSize++) % SERIAL_OUT_PENDING] = data[i];
+        }
+        update();
+        if (i < length) {
+            dropped += length - i;
+            send(Packet(dropped), SerialOutPorts::OutPorts::dropped);
+        }
+    }
+
+    void flush() {
+        while (pendingSize > 0) {
+            // In at most two parts, as the pending bytes may wrap around
+            const int contiguous = SERIAL_OUT_PENDING - pendingStart;
+            const int length = (pendingSize < contiguous) ? pendingSize : contiguous;
+            const long written = io->SerialWrite(serialDevice, pending+pendingStart, length);
+            pendingStart = (pendingStart + written) % SERIAL_OUT_PENDING;
+            pendingSize -= written;
+            if (written < length) {
+                break;
+            }
+        }
+        update();
+    }
+
+    void update() {
+        if (pendingSize > 0) {
+            startTimer(0, 1); // until the port has taken everything
+        }
+        if (ready && pendingSize > SERIAL_OUT_PENDING/2) {
+            ready = false;
+            send(Packet(false), SerialOutPorts::OutPorts::ready);
+        } else if (!ready && pendingSize == 0) {
+            ready = true;
+            send(Packet(true), SerialOutPorts::OutPorts::ready);
         }
     }
+
+    int serialDevice;
+    long baudrate;
+    unsigned char pending[SERIAL_OUT_PENDING];
+    int pendingStart;
+    int pendingSize;
+    bool ready;
+    long dropped;
 };
 
 class DigitalWrite : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         using namespace DigitalWritePorts;
         if (in.isSetup()) {
             outPin = 13; // default
@@ -95,7 +196,7 @@ private:
 
 class DigitalRead : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         // Note: have to match components.json
         const int triggerPort = 0;
         const int pinConfigPort = 1;
@@ -125,13 +226,23 @@ private:
 
 class MonitorPin : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    MonitorPin() : intr(-1) {}
+    virtual ~MonitorPin() {
+        // The handler would otherwise be called on freed memory after Network::reset()
+        if (intr >= 0) {
+            io->DetachExternalInterrupt(intr);
+        }
+    }
+    virtual void process(const Packet &in, int port) {
         using namespace MonitorPinPorts;
         if (port == InPorts::pin) {
             pin = in.asInteger();
             // FIXME: report error when attempting to use pin without interrupt
             // TODO: support pin mappings for other devices than than Uno/Micro
-            int intr = 0;
+            if (intr >= 0) {
+                io->DetachExternalInterrupt(intr);
+            }
+            intr = 0;
             if (pin == 2) {
                 intr = 0;
             } else if (pin == 3) {
@@ -143,15 +254,16 @@ public:
 private:
     static void interrupt(void *user) {
         MonitorPin *thisptr = static_cast<MonitorPin *>(user);
-        thisptr->send(Packet(thisptr->io->DigitalRead(thisptr->pin)));
+        thisptr->post(Packet(thisptr->io->DigitalRead(thisptr->pin)));
     }
     int pin;
+    int intr;
 };
 
 
 class PwmWrite : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         using namespace PwmWritePorts;
         if (in.isSetup()) {
             // no defaults
@@ -169,7 +281,7 @@ private:
 
 class AnalogRead : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         using namespace AnalogReadPorts;
         if (in.isSetup()) {
             // no defaults
@@ -187,7 +299,7 @@ private:
 
 class MapLinear : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         using namespace MapLinearPorts;
         if (in.isSetup()) {
             // no defaults
@@ -215,97 +327,100 @@ private:
 
 class Timer : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         using namespace TimerPorts;
         if (in.isSetup()) {
             // defaults
-            previousMillis = 0;
             interval = 1000;
             enabled = false;
-        } else if (in.isTick()) {
-            unsigned long currentMillis = io->TimerCurrentMs();
-            if (currentMillis - previousMillis > interval) {
-                previousMillis = currentMillis;
-                if (enabled) {
-                    send(Packet());
-                }
-            }
+        } else if (port == TIMER_PORT) {
+            send(Packet());
         } else if (port == InPorts::interval && in.isData()) {
-            previousMillis = io->TimerCurrentMs();
             interval = in.asInteger();
+            schedule();
         } else if (port == InPorts::enable && in.isData()) {
-            enabled = in.asBool();
+            if (in.asBool() != enabled) {
+                enabled = in.asBool();
+                schedule();
+            }
         } else if (port == InPorts::reset && in.isData()) {
-            previousMillis = io->TimerCurrentMs();
+            schedule();
         }
     }
 private:
+    // Starts the period over
+    void schedule() {
+        if (enabled) {
+            startTimer(0, interval, true);
+        } else {
+            stopTimer(0);
+        }
+    }
+
     bool enabled;
-    unsigned long previousMillis;
     unsigned long interval;
 };
 
-#ifdef HAVE_DALLAS_TEMPERATURE
-#include <OneWire.h>
-#include <DallasTemperature.h>
-
+// Conversions run in the background through IO::OneWireStartConversion(), so the network keeps
+// running meanwhile. Triggers during a conversion are answered by that conversion
 class ReadDallasTemperature : public Component {
 public:
     ReadDallasTemperature()
         : pin(-1) // default
+        , resolution(12)
         , addressIndex(0)
+        , converting(false)
     {}
 
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         using namespace ReadDallasTemperaturePorts;
 
         if (in.isSetup()) {
             // defaults
         } else if (port == InPorts::pin && in.isNumber()) {
-            updateConfig(in.asInteger(), sensors.getResolution());
+            pin = in.asInteger();
         } else if (port == InPorts::address) {
-            if (in.isStartBracket()) {
+            if (in.isBuffer()) {
+                const unsigned char *data = bufferData(in);
+                for (addressIndex=0; addressIndex < in.bufferLength() && addressIndex < ADDRESS_SIZE; addressIndex++) {
+                    address[addressIndex] = data[addressIndex];
+                }
+            } else if (in.isStartBracket()) {
                 addressIndex = 0;
             } else if (in.isData()) {
-                if (addressIndex < sizeof(address)) {
+                if (addressIndex < ADDRESS_SIZE) {
                     address[addressIndex++] = in.asByte();
                 }
             } else if (in.isEndBracket()) {
-                // ASSERT(addressIndex == sizeof(DeviceAddress));
+                // ASSERT(addressIndex == ADDRESS_SIZE);
             }
 
         } else if (port == InPorts::trigger && in.isData()) {
-            if (addressIndex == sizeof(DeviceAddress) && sensors.getWire()) {
-                sensors.requestTemperatures();
-                const float tempC = sensors.getTempC(address);
-                if (tempC != -127) {
-                    send(Packet(tempC));
-                }
+            if (!converting && addressIndex == ADDRESS_SIZE && pin > -1) {
+                converting = true;
+                io->OneWireStartConversion(pin, resolution, &Component::ioCompletion, this);
+            }
+        } else if (port == IO_COMPLETION_PORT) {
+            converting = false;
+            const float tempC = in.asBool() ? io->OneWireTemperature(pin, address) : ONEWIRE_NO_SENSOR;
+            if (tempC != ONEWIRE_NO_SENSOR) {
+                send(Packet(tempC));
             }
         }
     }
 private:
-    void updateConfig(int newPin, int newResolution) {
-        if (newPin != pin && newPin > -1) {
-            oneWire.setPin(newPin);
-            sensors.setWire(&oneWire);
-        }
-        sensors.setResolution(newResolution);
-    }
+    static const int ADDRESS_SIZE = 8;
 
     int pin;
+    int resolution;
     int addressIndex;
-    DeviceAddress address;
-    OneWire oneWire;
-    DallasTemperature sensors;
+    unsigned char address[ADDRESS_SIZE];
+    bool converting;
 };
-#else
-class ReadDallasTemperature : public DummyComponent {};
-#endif
 
 class ToggleBoolean : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         using namespace ToggleBooleanPorts;
         if (in.isSetup()) {
             currentState = false;
@@ -323,7 +438,7 @@ private:
 
 class InvertBoolean : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         if (in.isData()) {
             Packet p = Packet((bool)!in.asBool());
             send(p);
@@ -333,7 +448,7 @@ public:
 
 class ArduinoUno : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         const int digitalPins = 14;
         const int analogPins = 6;
         if (in.isSetup()) {
@@ -349,7 +464,7 @@ public:
 class HysteresisLatch : public Component
 {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         const int inputPort = 0;
         const int lowThresholdPort = 1;
         const int highThresholdPort = 2;
@@ -402,36 +517,22 @@ private:
 class ToString : public Component
 {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
 
     // XXX: probably too generic a name for this component?
         if (in.isInteger()) {
 #ifdef ARDUINO
-            String s(in.asInteger(), DEC);
-            send(Packet(MsgBracketStart));
-            for (int i=0; i<s.length(); i++) {
-                send(Packet(s.charAt(i)));
-            }
-            send(Packet(MsgBracketEnd));
+            char s[12];
+            ltoa(in.asInteger(), s, 10);
+            sendText(s);
 #endif
 #ifdef HOST_BUILD
             std::stringstream ss;
             ss << in.asInteger();
-            std::string s = ss.str();
-            send(Packet(MsgBracketStart));
-            for (int i=0; i<s.size(); i++) {
-                send(Packet(s[i]));
-            }
-            send(Packet(MsgBracketEnd));
+            sendText(ss.str().c_str());
 #endif
         } else if (in.isBool()) {
-            const char *s = in.asBool() ? "true" : "false";
-            const int l = in.asBool() ? 4 : 5;
-            send(Packet(MsgBracketStart));
-            for (int i=0; i<l; i++) {
-                send(Packet(s[i]));
-            }
-            send(Packet(MsgBracketEnd));
+            sendText(in.asBool() ? "true" : "false");
         } else if (in.isFloat()) {
 
             char s[20] = {0,};
@@ -443,29 +544,42 @@ public:
 #ifdef HOST_BUILD
             snprintf(s, sizeof(s), "%.2f", in.asFloat());
 #endif
-            send(Packet(MsgBracketStart));
-            for (int i=0; i<strlen(s); i++) {
-                send(Packet(s[i]));
-            }
-            send(Packet(MsgBracketEnd));
+            sendText(s);
         }
     }
 };
 
 // IDEA: ability to express components as finite state machines using a DSL and/or GUI
+// If a monitor does not confirm a switch within the timeout (in ms, 0 to wait forever),
+// both outputs are turned off
 class BreakBeforeMake : public Component
 {
 public:
-    BreakBeforeMake() : state(Init) {}
-    virtual void process(Packet in, int port) {
+    BreakBeforeMake() : state(Init), timeout(0) {}
+    virtual void process(const Packet &in, int port) {
         const int inPort = 0;
         const int out1MonitorPort = 1;
         const int out2MonitorPort = 2;
+        const int timeoutPort = 3;
 
         const int out1Port = 0;
         const int out2Port = 1;
 
+        if (port == timeoutPort && in.isData()) {
+            timeout = in.asInteger();
+            return;
+        }
+        if (port == TIMER_PORT) {
+            if (state != SettledOff && state != SettledOn) {
+                send(Packet((bool)false), out1Port);
+                send(Packet((bool)false), out2Port);
+                state = SettledOff;
+            }
+            return;
+        }
+
         // XXX: inputs are ignored while in transition
+        const State previous = state;
         switch (state) {
         case Init:
             state = SettledOff;
@@ -506,6 +620,14 @@ public:
         default:
             break;
         }
+
+        if (state == previous) {
+            return;
+        } else if (state == SettledOff || state == SettledOn) {
+            stopTimer(0);
+        } else if (timeout > 0) {
+            startTimer(0, timeout); // for each step of the transition
+        }
     }
 private:
     enum State {
@@ -520,12 +642,13 @@ private:
 
 private:
     enum State state;
+    long timeout;
 };
 
 class Delimit : public Component {
 public:
     Delimit(): startBracketRecieved(false) {}
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         if (in.isSetup()) {
             delimiter = '\r';
         }
@@ -553,7 +676,7 @@ private:
 
 class Count : public Component {
 public:
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         using namespace CountPorts;
         if (port == InPorts::in) {
             current += 1;
@@ -572,7 +695,7 @@ class Gate : public Component {
 public:
     Gate() : enabled(false) {}
 
-    virtual void process(Packet in, int port) {
+    virtual void process(const Packet &in, int port) {
         using namespace GatePorts;
         if (port == InPorts::in) {
             lastInput = in;
@@ -593,4 +716,78 @@ private:
     bool enabled;
 };
 
+// Component memory
+// On device, components live in a static arena instead of the heap. It is sized
+// for the graph by 'microflo.js generate' (microflo-arena.h next to the firmware, used
+// with MICROFLO_GRAPH_ARENA and the firmware directory on the include path), else for
+// any graph by update-defs (components-gen-arena.h). It is rewound once all components
+// are destroyed by Network::reset().
+// The host uses the heap, since it may run several networks at once
+#ifdef HOST_BUILD
+#include <new>
+#include <stdlib.h>
+
+static void *allocateComponent(size_t size) {
+    return malloc(size);
+}
+
+static void releaseComponent(void *memory) {
+    free(memory);
+}
+#else
+#ifdef __AVR__
+#define MICROFLO_ARENA_ALIGNMENT 1
+#ifndef MICROFLO_HAVE_PLACEMENT_NEW
+inline void *operator new(size_t, void *memory) throw() { return memory; }
+#endif
+#else
+#define MICROFLO_ARENA_ALIGNMENT 8
+#include <new>
+#endif
+#define MICROFLO_ARENA_SLOT(size) (((size)+MICROFLO_ARENA_ALIGNMENT-1) & ~(MICROFLO_ARENA_ALIGNMENT-1))
+
+#ifdef MICROFLO_GRAPH_ARENA
+#include <microflo-arena.h>
+#else
+#include "components-gen-arena.h"
+#endif
+
+static union {
+    unsigned char bytes[MICROFLO_ARENA_SIZE > 0 ? MICROFLO_ARENA_SIZE : 1];
+    long alignLong;
+    double alignDouble;
+    void *alignPointer;
+} arena;
+static size_t arenaUsed = 0;
+static int arenaLive = 0;
+
+static void *allocateComponent(size_t size) {
+    size = MICROFLO_ARENA_SLOT(size);
+    if (arenaUsed + size > sizeof(arena.bytes)) {
+        return 0;
+    }
+    void *memory = arena.bytes + arenaUsed;
+    arenaUsed += size;
+    arenaLive++;
+    return memory;
+}
+
+static void releaseComponent(void *memory) {
+    if (--arenaLive == 0) {
+        arenaUsed = 0;
+    }
+}
+#endif
+
+template <class T>
+static Component *constructComponent() {
+    void *memory = allocateComponent(sizeof(T));
+    return memory ? new (memory) T : 0;
+}
+
+void Component::destroy(Component *c) {
+    c->~Component();
+    releaseComponent(c);
+}
+
 #include "components-gen-bottom.hpp"
@@ -0,0 +1,481 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+#include "microflo.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+
+// Worker the current thread is acting as, if any
+static __thread Executor *executorOfCurrentThread = 0;
+static __thread int workerOfCurrentThread = -1;
+
+// Multi-threaded executor, for host simulations of large graphs.
+// Nodes are partitioned across a pool of worker threads. Each worker has a work-stealing
+// deque (Chase-Lev) of nodes which have input, and steals from the others when it runs dry.
+// A node is in at most one deque, and run by at most one worker at a time,
+// so each node still processes its inputs sequentially.
+// Connections are lock-free single-producer, single-consumer rings.
+//
+// Differences from the default single-threaded Network::runTick():
+// - runTick() keeps delivering until the graph is idle or @tickBudget packets were delivered,
+//   instead of deferring packets sent during delivery to the next tick
+// - OverflowDropOldest and OverflowConflate connections take a spinlock around queue operations,
+//   since the producer also removes packets. The others stay lock-free
+// - process() and notifications are called from the worker threads.
+//   IIPs, packets from the ingress queue and ticks are handled on the thread calling runTick()
+// - The thread calling runTick() acts as worker 0
+class WorkStealingExecutor : public Executor {
+public:
+    WorkStealingExecutor(int threadCount, long tickBudget=1000000)
+        : network(0)
+        , workers(threadCount > 0 ? threadCount : 1)
+        , deques(workers)
+        , budgetPerTick(tickBudget)
+        , budget(0)
+        , active(0)
+        , generation(0)
+        , finished(0)
+        , quit(false)
+    {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&startCondition, NULL);
+        pthread_cond_init(&doneCondition, NULL);
+        for (int i=0; i<workers; i++) {
+            deques[i].top = 0;
+            deques[i].bottom = 0;
+            deques[i].buffer.resize(DEQUE_SIZE, -1);
+        }
+        threadArgs.resize(workers);
+        threads.resize(workers);
+        for (int i=1; i<workers; i++) {
+            threadArgs[i].executor = this;
+            threadArgs[i].worker = i;
+            pthread_create(&threads[i], NULL, &WorkStealingExecutor::threadMain, &threadArgs[i]);
+        }
+    }
+
+    ~WorkStealingExecutor() {
+        pthread_mutex_lock(&mutex);
+        quit = true;
+        pthread_cond_broadcast(&startCondition);
+        pthread_mutex_unlock(&mutex);
+        for (int i=1; i<workers; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_cond_destroy(&doneCondition);
+        pthread_cond_destroy(&startCondition);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    // Implements Executor
+    virtual void attach(Network *net) {
+        network = net;
+    }
+
+    virtual void queueMessage(int connection, const Packet &pkg) {
+        if (connection >= (int)rings.size()) {
+            updateTopology(); // connected after last tick, workers are not running
+        }
+        Ring &r = rings[connection];
+        Connection &c = network->connections[connection];
+        if (isLossy(c)) {
+            queueLossy(r, c, pkg);
+        } else if (__atomic_load_n(&r.size, __ATOMIC_ACQUIRE) >= r.capacity) {
+            __atomic_fetch_add(&c.dropped, 1, __ATOMIC_RELAXED);
+            if (pkg.isBuffer()) {
+                network->buffers.release(pkg);
+            }
+            return;
+        } else {
+            append(r, c, pkg);
+        }
+
+        if (network->messageSentNotify) {
+            Message msg;
+            msg.target = c.target;
+            msg.targetPort = c.targetPort;
+            msg.pkg = pkg;
+            network->messageSentNotify(connection, msg, c.source, c.sourcePort);
+        }
+        schedule(r.target);
+    }
+
+    virtual void runTick() {
+        updateTopology();
+
+        // Single-threaded part, sends are scheduled on the partition owning the target
+        network->spliceIngress();
+        network->runTickSubscribers();
+
+        __atomic_store_n(&budget, budgetPerTick, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&mutex);
+        finished = 0;
+        generation++;
+        pthread_cond_broadcast(&startCondition);
+        pthread_mutex_unlock(&mutex);
+
+        work(0);
+
+        pthread_mutex_lock(&mutex);
+        while (finished < workers-1) {
+            pthread_cond_wait(&doneCondition, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    virtual bool hasQueuedMessages() {
+        if (__atomic_load_n(&active, __ATOMIC_SEQ_CST) > 0) {
+            return true;
+        }
+        for (size_t i=0; i<rings.size(); i++) {
+            if (__atomic_load_n(&rings[i].size, __ATOMIC_ACQUIRE)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    virtual void reset() {
+        rings.clear();
+        storage.clear();
+        nodeState.clear();
+        inputs.clear();
+        outputs.clear();
+        for (int i=0; i<workers; i++) {
+            deques[i].top = 0;
+            deques[i].bottom = 0;
+        }
+        active = 0;
+    }
+
+private:
+    static const int DEQUE_SIZE = 1024; // power of two >= MAX_NODES, nodes are queued at most once
+    enum NodeState {
+        Idle = 0,
+        Active // queued in a deque, or running
+    };
+
+    struct Ring {
+        unsigned int offset;
+        unsigned int capacity;
+        unsigned int head; // consumer only
+        unsigned int tail; // producer only
+        unsigned int size;
+        int lock; // OverflowDropOldest and OverflowConflate only
+        int source;
+        int target;
+    };
+
+    struct Deque {
+        long top;
+        long bottom;
+        std::vector<int> buffer;
+        char padding[64]; // avoid false sharing between workers
+    };
+
+    struct ThreadArgs {
+        WorkStealingExecutor *executor;
+        int worker;
+    };
+
+    // Called between ticks only. Existing rings keep their contents
+    void updateTopology() {
+        const int nodes = network->lastAddedNodeIndex;
+        const int connections = network->connectionsUsed;
+        if (nodes != (int)nodeState.size()) {
+            nodeState.resize(nodes, Idle);
+        }
+        bool changed = (connections != (int)rings.size()) || (nodes != (int)inputs.size());
+        for (int i=(int)rings.size(); i<connections; i++) {
+            const Connection &c = network->connections[i];
+            Ring r;
+            r.capacity = c.capacity > 0 ? c.capacity : 1;
+            r.offset = storage.size();
+            r.head = 0;
+            r.tail = 0;
+            r.size = 0;
+            r.lock = 0;
+            r.source = -1;
+            r.target = -1;
+            rings.push_back(r);
+            storage.resize(storage.size()+r.capacity);
+        }
+        for (int i=0; i<connections; i++) {
+            const Connection &c = network->connections[i];
+            if (rings[i].target != c.target->nodeId || rings[i].source != c.source->nodeId) {
+                rings[i].source = c.source->nodeId;
+                rings[i].target = c.target->nodeId;
+                changed = true;
+            }
+        }
+        if (!changed) {
+            return;
+        }
+        inputs.assign(nodes, std::vector<int>());
+        outputs.assign(nodes, std::vector<int>());
+        for (int i=0; i<connections; i++) {
+            inputs[rings[i].target].push_back(i);
+            outputs[rings[i].source].push_back(i);
+        }
+    }
+
+    // Partitions are contiguous ranges of node ids, good for chains
+    int partitionOwner(int node) const {
+        const int nodes = nodeState.size();
+        return (nodes > 0) ? (long)node*workers/nodes : 0;
+    }
+
+    void schedule(int node) {
+        int expected = Idle;
+        if (!__atomic_compare_exchange_n(&nodeState[node], &expected, Active, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return; // already queued or running, will see the new input
+        }
+        __atomic_fetch_add(&active, 1, __ATOMIC_SEQ_CST);
+        const bool isWorker = executorOfCurrentThread == this && workerOfCurrentThread >= 0;
+        push(deques[isWorker ? workerOfCurrentThread : partitionOwner(node)], node);
+    }
+
+    bool hasInput(int node) {
+        const std::vector<int> &in = inputs[node];
+        for (size_t i=0; i<in.size(); i++) {
+            if (__atomic_load_n(&rings[in[i]].size, __ATOMIC_SEQ_CST)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool isBlocked(int node) {
+        const std::vector<int> &out = outputs[node];
+        for (size_t i=0; i<out.size(); i++) {
+            const Ring &r = rings[out[i]];
+            if (network->connections[out[i]].policy == OverflowBlock
+                    && __atomic_load_n(&r.size, __ATOMIC_SEQ_CST) >= r.capacity) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void runNode(int n) {
+        static const int batch = 64; // packets before giving other nodes in our deque a chance
+        Component *node = network->nodes[n];
+        const std::vector<int> &in = inputs[n];
+        int delivered = 0;
+        bool progress = true;
+        while (progress && delivered < batch && !isBlocked(n)) {
+            progress = false;
+            for (size_t i=0; i<in.size(); i++) {
+                Ring &r = rings[in[i]];
+                if (__atomic_load_n(&r.size, __ATOMIC_ACQUIRE) == 0) {
+                    continue;
+                }
+                const Connection &c = network->connections[in[i]];
+                const bool lossy = isLossy(c);
+                if (lossy) {
+                    lock(r);
+                    if (r.size == 0) {
+                        unlock(r); // conflated away by the producer
+                        continue;
+                    }
+                }
+                const Packet pkg = storage[r.offset+r.head];
+                r.head = (r.head+1) % r.capacity;
+                const unsigned int before = __atomic_fetch_sub(&r.size, 1, __ATOMIC_SEQ_CST);
+                if (lossy) {
+                    unlock(r);
+                }
+                if (before == r.capacity && c.policy == OverflowBlock) {
+                    schedule(r.source); // may have been waiting for room
+                }
+                network->deliver(node, c.targetPort, pkg, in[i]);
+                delivered++;
+                progress = true;
+            }
+        }
+        __atomic_fetch_sub(&budget, delivered, __ATOMIC_RELAXED);
+
+        // Check for input again after going idle, so a concurrent send is not lost
+        __atomic_store_n(&nodeState[n], Idle, __ATOMIC_SEQ_CST);
+        if (hasInput(n) && !isBlocked(n)) {
+            schedule(n);
+        }
+        __atomic_fetch_sub(&active, 1, __ATOMIC_SEQ_CST);
+    }
+
+    static bool isLossy(const Connection &c) {
+        return c.policy == OverflowDropOldest || c.policy == OverflowConflate;
+    }
+
+    // Only the worker running the source node queues on a connection
+    void append(Ring &r, Connection &c, const Packet &pkg) {
+        storage[r.offset+r.tail] = pkg;
+        r.tail = (r.tail+1) % r.capacity;
+#ifdef MICROFLO_PROFILE
+        const int size = __atomic_add_fetch(&r.size, 1, __ATOMIC_SEQ_CST);
+        if (size > c.highWater) {
+            c.highWater = size;
+        }
+#else
+        __atomic_fetch_add(&r.size, 1, __ATOMIC_SEQ_CST);
+#endif
+    }
+
+    // As Network::queueMessage(), the producer removes the oldest packets to make room.
+    // Under the lock of the ring, since the consumer may be taking the same packet
+    void queueLossy(Ring &r, Connection &c, const Packet &pkg) {
+        lock(r);
+        if (c.policy == OverflowConflate) {
+            // Replaces what was not delivered yet, which is not counted as dropped
+            dropOldest(r, r.size);
+        } else if (r.size >= r.capacity) {
+            __atomic_fetch_add(&c.dropped, 1, __ATOMIC_RELAXED);
+            dropOldest(r, 1);
+        }
+        append(r, c, pkg);
+        unlock(r);
+    }
+
+    void dropOldest(Ring &r, unsigned int count) {
+        for (; count > 0; count--) {
+            const Packet &oldest = storage[r.offset+r.head];
+            if (oldest.isBuffer()) {
+                network->buffers.release(oldest);
+            }
+            r.head = (r.head+1) % r.capacity;
+            __atomic_fetch_sub(&r.size, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    static void lock(Ring &r) {
+        while (__atomic_exchange_n(&r.lock, 1, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+
+    static void unlock(Ring &r) {
+        __atomic_store_n(&r.lock, 0, __ATOMIC_RELEASE);
+    }
+
+    void work(int worker) {
+        executorOfCurrentThread = this;
+        workerOfCurrentThread = worker;
+        for (;;) {
+            if (__atomic_load_n(&budget, __ATOMIC_RELAXED) <= 0) {
+                break; // the rest stays queued for next tick
+            }
+            int node = pop(deques[worker]);
+            for (int i=1; node < 0 && i<workers; i++) {
+                node = steal(deques[(worker+i) % workers]);
+            }
+            if (node >= 0) {
+                runNode(node);
+            } else if (__atomic_load_n(&active, __ATOMIC_SEQ_CST) == 0) {
+                break;
+            } else {
+                sched_yield();
+            }
+        }
+        workerOfCurrentThread = -1;
+        executorOfCurrentThread = 0;
+    }
+
+    static void *threadMain(void *arg) {
+        ThreadArgs *args = static_cast<ThreadArgs *>(arg);
+        WorkStealingExecutor *self = args->executor;
+        unsigned long seen = 0;
+        for (;;) {
+            pthread_mutex_lock(&self->mutex);
+            while (!self->quit && self->generation == seen) {
+                pthread_cond_wait(&self->startCondition, &self->mutex);
+            }
+            seen = self->generation;
+            const bool quit = self->quit;
+            pthread_mutex_unlock(&self->mutex);
+            if (quit) {
+                return NULL;
+            }
+
+            self->work(args->worker);
+
+            pthread_mutex_lock(&self->mutex);
+            self->finished++;
+            pthread_cond_signal(&self->doneCondition);
+            pthread_mutex_unlock(&self->mutex);
+        }
+    }
+
+    // Chase-Lev deque. Owner pushes and pops at the bottom, thieves take from the top
+    static void push(Deque &d, int node) {
+        const long b = __atomic_load_n(&d.bottom, __ATOMIC_RELAXED);
+        __atomic_store_n(&d.buffer[b & (DEQUE_SIZE-1)], node, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&d.bottom, b+1, __ATOMIC_RELAXED);
+    }
+
+    static int pop(Deque &d) {
+        const long b = __atomic_load_n(&d.bottom, __ATOMIC_RELAXED) - 1;
+        __atomic_store_n(&d.bottom, b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long t = __atomic_load_n(&d.top, __ATOMIC_RELAXED);
+        int node = -1;
+        if (t <= b) {
+            node = __atomic_load_n(&d.buffer[b & (DEQUE_SIZE-1)], __ATOMIC_RELAXED);
+            if (t == b) {
+                // Last item, race against thieves
+                if (!__atomic_compare_exchange_n(&d.top, &t, t+1, false,
+                                                 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                    node = -1;
+                }
+                __atomic_store_n(&d.bottom, b+1, __ATOMIC_RELAXED);
+            }
+        } else {
+            __atomic_store_n(&d.bottom, b+1, __ATOMIC_RELAXED);
+        }
+        return node;
+    }
+
+    static int steal(Deque &d) {
+        long t = __atomic_load_n(&d.top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        const long b = __atomic_load_n(&d.bottom, __ATOMIC_ACQUIRE);
+        if (t >= b) {
+            return -1;
+        }
+        const int node = __atomic_load_n(&d.buffer[t & (DEQUE_SIZE-1)], __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(&d.top, &t, t+1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return -1;
+        }
+        return node;
+    }
+
+private:
+    Network *network;
+    const int workers;
+    std::vector<Deque> deques;
+    std::vector<ThreadArgs> threadArgs;
+    std::vector<pthread_t> threads;
+
+    std::vector<Ring> rings; // one per Network connection
+    std::vector<Packet> storage;
+    std::vector<int> nodeState;
+    std::vector<std::vector<int> > inputs; // ring indices per node
+    std::vector<std::vector<int> > outputs;
+
+    const long budgetPerTick;
+    long budget;
+    long active; // nodes in Active state
+
+    pthread_mutex_t mutex;
+    pthread_cond_t startCondition;
+    pthread_cond_t doneCondition;
+    unsigned long generation;
+    int finished;
+    bool quit;
+};
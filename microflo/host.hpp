@@ -5,11 +5,23 @@
 
 #include "microflo.h"
 
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
 // TODO: implement, not just have stubs
 class HostIO : public IO {
 public:
-    HostIO() {}
-    ~HostIO() {}
+    HostIO()
+        : eventPending(false)
+    {
+        pthread_mutex_init(&eventMutex, NULL);
+        pthread_cond_init(&eventCondition, NULL);
+    }
+    ~HostIO() {
+        pthread_cond_destroy(&eventCondition);
+        pthread_mutex_destroy(&eventMutex);
+    }
 
     // Serial
     virtual void SerialBegin(int serialDevice, int baudrate) {
@@ -24,6 +36,15 @@ public:
     virtual void SerialWrite(int serialDevice, unsigned char b) {
 
     }
+    virtual long SerialRead(int serialDevice, unsigned char *buffer, long length) {
+        return 0;
+    }
+    virtual long SerialWrite(int serialDevice, const unsigned char *buffer, long length) {
+        for (long i=0; i<length; i++) {
+            SerialWrite(serialDevice, buffer[i]);
+        }
+        return length;
+    }
 
     // Pin config
     virtual void PinSetMode(int pin, PinMode mode) {
@@ -43,7 +64,45 @@ public:
 
     // Timer
     virtual long TimerCurrentMs() {
-        return 0;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec*1000 + now.tv_nsec/1000000;
+    }
+    virtual unsigned long TimerCurrentMicros() {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec*1000000UL + now.tv_nsec/1000;
+    }
+
+    // Power management
+    virtual void WaitForEvent(long timeoutMs) {
+        pthread_mutex_lock(&eventMutex);
+        if (timeoutMs < 0) {
+            while (!eventPending) {
+                pthread_cond_wait(&eventCondition, &eventMutex);
+            }
+        } else {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeoutMs / 1000;
+            deadline.tv_nsec += (timeoutMs % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000;
+            }
+            int err = 0;
+            while (!eventPending && err != ETIMEDOUT) {
+                err = pthread_cond_timedwait(&eventCondition, &eventMutex, &deadline);
+            }
+        }
+        eventPending = false;
+        pthread_mutex_unlock(&eventMutex);
+    }
+    virtual void NotifyEvent() {
+        pthread_mutex_lock(&eventMutex);
+        eventPending = true;
+        pthread_cond_signal(&eventCondition);
+        pthread_mutex_unlock(&eventMutex);
     }
 
     // Analog
@@ -57,5 +116,36 @@ public:
     virtual void AttachExternalInterrupt(int interrupt, IO::Interrupt::Mode mode, IOInterruptFunction func, void *user) {
         ;
     }
+    virtual void DetachExternalInterrupt(int interrupt) {
+        ;
+    }
+
+    // Asynchronous operations
+    virtual long PollCompletions() {
+        return completions.poll(TimerCurrentMs());
+    }
+    virtual void CancelCompletions(void *user) {
+        completions.cancel(user);
+    }
+
+    // OneWire, with simulated sensors
+    virtual void OneWireStartConversion(int pin, int resolution, IOCompletionFunction done, void *user) {
+        if (!completions.join(pin, done, user)) {
+            const long duration = oneWire.startConversion(pin, resolution);
+            completions.add(pin, TimerCurrentMs(), duration, duration >= 0, done, user);
+        }
+    }
+    virtual float OneWireTemperature(int pin, const unsigned char address[8]) {
+        return oneWire.temperature(pin, address);
+    }
+
+    // The sensors on the OneWire buses, and their conversion time
+    OneWireMock oneWire;
+
+private:
+    IOCompletions completions;
+    pthread_mutex_t eventMutex;
+    pthread_cond_t eventCondition;
+    bool eventPending;
 };
 
@@ -7,27 +7,71 @@
 #include <avr/pgmspace.h>
 #include "arduino.hpp"
 
+#ifndef MICROFLO_STATIC_GRAPH
 GraphStreamer parser;
+#endif
 ArduinoIO io;
 Network network(&io);
+#ifdef MICROFLO_UPLOAD
+// New graphs can be sent with 'microflo.js upload', without reflashing
+#ifdef MICROFLO_STATIC_GRAPH
+#error "A statically compiled graph cannot be replaced by uploading"
+#endif
+#ifndef MICROFLO_UPLOAD_BAUDRATE
+#define MICROFLO_UPLOAD_BAUDRATE 9600
+#endif
+GraphUploader uploader(&network, &io);
+#endif
+#ifdef MICROFLO_TRACE
+// Binary trace of the network on the serial port, read with 'microflo.js debug'
+#ifndef MICROFLO_TRACE_BAUDRATE
+#define MICROFLO_TRACE_BAUDRATE 9600
+#endif
+Tracer tracer(&io, 0, MICROFLO_TRACE_BAUDRATE);
+#endif
+
 void setup()
 {
-#ifdef DEBUG
+#ifdef MICROFLO_TRACE
     // TODO: allow to enable/disable at runtime
-    Debugger::setup(&network);
+    io.SerialBegin(0, MICROFLO_TRACE_BAUDRATE);
+    network.setTracer(&tracer);
+#endif
+    network.setSleepWhenIdle(true);
+#ifdef MICROFLO_TICK_BUDGET
+    // Run-to-completion, see Network::setRunToCompletion()
+    network.setRunToCompletion(MICROFLO_TICK_BUDGET);
 #endif
+#ifdef MICROFLO_STATIC_GRAPH
+    microfloStaticSetup(&network);
+#else
     parser.setNetwork(&network);
-    for (int i=0; i<sizeof(graph); i++) {
-        //unsigned char c = graph[i];
-        unsigned char c = pgm_read_byte_near(graph+i);
-        parser.parseByte(c);
+    // Copied from flash in chunks, so the parser can take whole commands at a time
+    unsigned char chunk[4*GRAPH_CMD_SIZE];
+    for (size_t offset=0; offset<sizeof(graph); offset+=sizeof(chunk)) {
+        const size_t remaining = sizeof(graph) - offset;
+        const size_t length = (remaining < sizeof(chunk)) ? remaining : sizeof(chunk);
+        memcpy_P(chunk, graph+offset, length);
+        parser.parse(chunk, length);
     }
+#endif
+#ifdef MICROFLO_UPLOAD
+    io.SerialBegin(0, MICROFLO_UPLOAD_BAUDRATE);
+#endif
     network.runSetup();
 }
 
 void loop()
 {
+#ifdef MICROFLO_UPLOAD
+    uploader.poll();
+#endif
+#ifdef MICROFLO_TICK_MICROS
+    // Bounded loop period, see Network::runTick()
+    network.runTick(MICROFLO_TICK_MICROS);
+#else
     network.runTick();
+#endif
 }
 #endif // ARDUINO
 
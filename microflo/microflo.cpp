@@ -9,81 +9,60 @@
 #include <cstring>
 #endif
 
+#ifdef ARDUINO
+#include <util/atomic.h>
+#endif
+
+// Conversions switch on the type tag, so they compile to a jump table
 bool Packet::asBool() const {
-    if (msg == MsgBoolean) {
-        return data.boolean;
-    } else if (msg == MsgByte) {
-        return data.byte;
-    } else if (msg == MsgInteger) {
-        return data.lng;
-    } else if (msg == MsgFloat) {
-        return data.flt;
-    } else if (msg == MsgAscii) {
-        return data.ch;
-    } else {
-        return false;
+    switch (msg) {
+    case MsgBoolean: return data.boolean;
+    case MsgByte: return data.byte;
+    case MsgInteger: return data.lng;
+    case MsgFloat: return data.flt;
+    case MsgAscii: return data.ch;
+    default: return false;
     }
 }
 long Packet::asInteger() const {
-    if (msg == MsgBoolean){
-        return data.boolean;
-    } else if (msg == MsgByte) {
-        return data.byte;
-    } else if (msg == MsgInteger) {
-        return data.lng;
-    } else if (msg == MsgFloat) {
-        return data.flt;
-    } else if (msg == MsgAscii) {
-        return data.ch;
-    } else {
-        return -33;
+    switch (msg) {
+    case MsgBoolean: return data.boolean;
+    case MsgByte: return data.byte;
+    case MsgInteger: return data.lng;
+    case MsgFloat: return data.flt;
+    case MsgAscii: return data.ch;
+    default: return -33;
     }
 }
 float Packet::asFloat() const {
-    if (msg == MsgBoolean){
-        return data.boolean;
-    } else if (msg == MsgByte) {
-        return data.byte;
-    } else if (msg == MsgInteger) {
-        return data.lng;
-    } else if (msg == MsgFloat) {
-        return data.flt;
-    } else if (msg == MsgAscii) {
-        return data.ch;
-    } else if (msg == MsgVoid) {
-        return 0.0;
-    } else {
-        return -44.0;
+    switch (msg) {
+    case MsgBoolean: return data.boolean;
+    case MsgByte: return data.byte;
+    case MsgInteger: return data.lng;
+    case MsgFloat: return data.flt;
+    case MsgAscii: return data.ch;
+    case MsgVoid: return 0.0;
+    default: return -44.0;
     }
 }
 char Packet::asAscii() const {
-    if (msg == MsgBoolean){
-        return data.boolean;
-    } else if (msg == MsgByte) {
-        return data.byte;
-    } else if (msg == MsgInteger) {
-        return data.lng;
-    } else if (msg == MsgFloat) {
-        return data.flt;
-    } else if (msg == MsgAscii) {
-        return data.ch;
-    } else {
-        return '\0';
+    switch (msg) {
+    case MsgBoolean: return data.boolean;
+    case MsgByte: return data.byte;
+    case MsgInteger: return data.lng;
+    case MsgFloat: return data.flt;
+    case MsgAscii: return data.ch;
+    default: return '\0';
     }
 }
 unsigned char Packet::asByte() const {
-    if (msg == MsgBoolean){
-        return data.boolean;
-    } else if (msg == MsgByte) {
-        return data.byte;
-    } else if (msg == MsgInteger) {
-        return data.lng;
-    } else if (msg == MsgFloat) {
-        return data.flt;
-    } else if (msg == MsgAscii) {
-        return data.ch;
-    } else {
-        return 0;
+    switch (msg) {
+    case MsgBoolean: return data.boolean;
+    case MsgByte: return data.byte;
+    case MsgInteger: return data.lng;
+    case MsgFloat: return data.flt;
+    case MsgAscii: return data.ch;
+    default: return 0;
     }
 }
 
@@ -91,21 +70,114 @@ bool Packet::operator==(const Packet& rhs) const {
     return msg == rhs.msg && memcmp(&data, &rhs.data, sizeof(PacketData)) == 0;
 }
 
+BufferPool::BufferPool() {
+    reset();
+}
+
+Packet BufferPool::allocate(int length, bool text) {
+    if (length < 0 || length > BUFFER_SIZE) {
+        return Packet();
+    }
+    for (int i=0; i<MAX_BUFFERS; i++) {
+#ifdef HOST_BUILD
+        unsigned int expected = 0;
+        if (!__atomic_compare_exchange_n(&refs[i], &expected, 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+#else
+        if (refs[i] != 0) {
+            continue;
+        }
+        refs[i] = 1;
+#endif
+        Packet p(MsgBuffer);
+        p.data.buffer.block = i;
+        p.data.buffer.text = text;
+        p.data.buffer.length = length;
+        return p;
+    }
+    return Packet();
+}
+
+void BufferPool::retain(const Packet &pkg) {
+#ifdef HOST_BUILD
+    __atomic_fetch_add(&refs[pkg.data.buffer.block], 1, __ATOMIC_RELAXED);
+#else
+    refs[pkg.data.buffer.block]++;
+#endif
+}
+
+void BufferPool::release(const Packet &pkg) {
+#ifdef HOST_BUILD
+    __atomic_fetch_sub(&refs[pkg.data.buffer.block], 1, __ATOMIC_RELEASE);
+#else
+    refs[pkg.data.buffer.block]--;
+#endif
+}
+
+int BufferPool::available() const {
+    int free = 0;
+    for (int i=0; i<MAX_BUFFERS; i++) {
+#ifdef HOST_BUILD
+        free += (__atomic_load_n(&refs[i], __ATOMIC_RELAXED) == 0);
+#else
+        free += (refs[i] == 0);
+#endif
+    }
+    return free;
+}
+
+void BufferPool::reset() {
+    for (int i=0; i<MAX_BUFFERS; i++) {
+        refs[i] = 0;
+    }
+}
+
 GraphStreamer::GraphStreamer()
     : network(0)
     , currentByte(0)
     , state(ParseHeader)
+    , opcode(0)
+    , part(0)
+    , varintsLeft(0)
+    , bytesLeft(0)
+    , fieldCount(0)
+    , varint(0)
+    , shift(0)
+    , crc(0)
 {}
 
+// CRC-16/CCITT-FALSE (polynomial 0x1021), for the End command of v2 streams.
+// Byte at a time without a lookup table
+static uint16_t crc16Update(uint16_t crc, unsigned char b) {
+    crc = (crc >> 8) | (crc << 8);
+    crc ^= b;
+    crc ^= (crc & 0xff) >> 4;
+    crc ^= crc << 12;
+    crc ^= (crc & 0xff) << 5;
+    return crc;
+}
+
 void GraphStreamer::parseByte(char b) {
 
+    if (state == ParseCmdV2) {
+        parseByteV2(b);
+        return;
+    }
+
     buffer[currentByte++] = b;
 
     if (state == ParseHeader) {
         if (currentByte == GRAPH_MAGIC_SIZE) {
             static const char magic[GRAPH_MAGIC_SIZE] = { GRAPH_MAGIC };
+            static const char magicV2[GRAPH_MAGIC_SIZE] = { GRAPH_MAGIC_V2 };
             if (memcmp(buffer, magic, GRAPH_MAGIC_SIZE) == 0) {
                 state = ParseCmd;
+            } else if (memcmp(buffer, magicV2, GRAPH_MAGIC_SIZE) == 0) {
+                state = ParseCmdV2;
+                part = 0;
+                crc = 0xFFFF;
             } else {
                 state = Invalid;
             }
@@ -113,216 +185,2013 @@ void GraphStreamer::parseByte(char b) {
         }
     } else if (state == ParseCmd) {
         if (currentByte == GRAPH_CMD_SIZE) {
-            GraphCmd cmd = (GraphCmd)buffer[0];
-            if (cmd >= GraphCmdInvalid) {
-                state = Invalid; // XXX: or maybe just ignore?
-            } else {
-                if (cmd == GraphCmdReset) {
-                    // TODO: implement
-                } else if (cmd == GraphCmdCreateComponent) {
-                    ComponentId id = (ComponentId)buffer[1];
-                    // FIXME: validate
-#ifdef DEBUG
-                    Serial.println("Component create start");
-#endif
-                    Component *c = Component::create(id);
-#ifdef DEBUG
-                    Serial.println("Component create done");
-#endif
-                    network->addNode(c);
-                } else if (cmd == GraphCmdConnectNodes) {
-                    // FIXME: validate
-                    const int src = (unsigned int)buffer[1];
-                    const int target = (unsigned int)buffer[2];
-                    const int srcPort = (unsigned int)buffer[3];
-                    const int targetPort = (unsigned int)buffer[4];
-                    network->connect(src, srcPort, target, targetPort);
-                } else if (cmd == GraphCmdSendPacket) {
-                    // FIXME: validate
-                    const int target = (unsigned int)buffer[1];
-                    const int targetPort = (unsigned int)buffer[2];
-                    const Msg packetType = (Msg)buffer[3];
-                    if (packetType == MsgBracketStart || packetType == MsgBracketEnd
-                            || packetType == MsgVoid) {
-                        network->sendMessage(target, targetPort, Packet(packetType));
-                    } else if (packetType == MsgInteger) {
-                        const long val = buffer[4] + 256*buffer[5] + 256*256*buffer[6] + 256*256*256*buffer[7];
-                        network->sendMessage(target, targetPort, Packet(val));
-                    } else if (packetType == MsgByte) {
-                        const unsigned char b = buffer[4];
-                        network->sendMessage(target, targetPort, Packet(b));
-                    } else if (packetType == MsgBoolean) {
-                        const bool b = !(buffer[4] == 0);
-                        network->sendMessage(target, targetPort, Packet(b));
-                    }
-
-                }
-            }
+            executeCommand(buffer);
             currentByte = 0;
         }
 
     } else if (state == Invalid) {
-#ifdef DEBUG
-       Serial.println("Parser in invalid state");
-#endif
         currentByte = 0; // avoid overflow
+    }
+}
+
+void GraphStreamer::parse(const unsigned char *data, size_t length) {
+    size_t i = 0;
+    while (i < length && state != Invalid) {
+        if (state == ParseCmd && currentByte == 0 && length-i >= GRAPH_CMD_SIZE) {
+            executeCommand(data+i);
+            i += GRAPH_CMD_SIZE;
+        } else {
+            parseByte(data[i++]);
+        }
+    }
+}
+
+// IIPs are kept by the network until delivered, so a graph may have any number of them.
+// One that cannot be kept would leave the graph incomplete
+void GraphStreamer::sendPacket(int target, int targetPort, const Packet &pkg) {
+    if (network && !network->sendInitialPacket(target, targetPort, pkg)) {
+        state = Invalid;
+    }
+}
+
+void GraphStreamer::executeCommand(const unsigned char *buffer) {
+    GraphCmd cmd = (GraphCmd)buffer[0];
+    if (cmd >= GraphCmdInvalid) {
+        state = Invalid; // XXX: or maybe just ignore?
+    } else if (!network) {
+        // Only checking, see check()
     } else {
-#ifdef DEBUG
-       Serial.println("Parser in unknown state");
+        if (cmd == GraphCmdReset) {
+            network->reset();
+        } else if (cmd == GraphCmdCreateComponent) {
+            ComponentId id = (ComponentId)buffer[1];
+            // FIXME: validate
+            Component *c = Component::create(id);
+            if (network->addNode(c) < 0) {
+                state = Invalid; // out of memory, rest of the graph would be misconnected
+            }
+        } else if (cmd == GraphCmdConnectNodes) {
+            // FIXME: validate
+            const int src = (unsigned int)buffer[1];
+            const int target = (unsigned int)buffer[2];
+            const int srcPort = (unsigned int)buffer[3];
+            const int targetPort = (unsigned int)buffer[4];
+            const int capacity = (unsigned int)buffer[5];
+            const OverflowPolicy policy = (OverflowPolicy)buffer[6];
+            network->connect(src, srcPort, target, targetPort, capacity, policy);
+        } else if (cmd == GraphCmdSendPacket) {
+            // FIXME: validate
+            const int target = (unsigned int)buffer[1];
+            const int targetPort = (unsigned int)buffer[2];
+            const Msg packetType = (Msg)buffer[3];
+            if (packetType == MsgBracketStart || packetType == MsgBracketEnd
+                    || packetType == MsgVoid) {
+                sendPacket(target, targetPort, Packet(packetType));
+            } else if (packetType == MsgInteger) {
+                const long val = buffer[4] + 256*buffer[5] + 256*256*buffer[6] + 256*256*256*buffer[7];
+                sendPacket(target, targetPort, Packet(val));
+            } else if (packetType == MsgByte) {
+                const unsigned char b = buffer[4];
+                sendPacket(target, targetPort, Packet(b));
+            } else if (packetType == MsgBoolean) {
+                const bool b = !(buffer[4] == 0);
+                sendPacket(target, targetPort, Packet(b));
+            }
+
+        } else if (cmd == GraphCmdDumpProfile) {
+#ifdef MICROFLO_PROFILE
+            network->writeProfile(0);
 #endif
+        } else if (cmd == GraphCmdSetNodePriority) {
+            network->setPriority(buffer[1], (Priority)buffer[2]);
+        } else if (cmd == GraphCmdSetEdgePriority) {
+            const int src = (unsigned int)buffer[1];
+            const int target = (unsigned int)buffer[2];
+            const int srcPort = (unsigned int)buffer[3];
+            const int targetPort = (unsigned int)buffer[4];
+            network->setPriority(src, srcPort, target, targetPort, (Priority)buffer[5]);
+        }
     }
 }
 
-void Component::send(Packet out, int port) {
-    if (connections[port].target && connections[port].targetPort >= 0) {
-        network->sendMessage(connections[port].target, connections[port].targetPort, out,
-                             this, port);
+void GraphStreamer::parseByteV2(unsigned char b) {
+    if (part == 0) {
+        crc = crc16Update(crc, b);
+        opcode = b;
+        fieldCount = 0;
+        currentByte = 0;
+        varint = 0;
+        shift = 0;
+        if (!nextPartV2()) {
+            executeCommandV2();
+        }
+        return;
+    }
+
+    if (opcode != GraphCmdEnd) {
+        crc = crc16Update(crc, b);
+    }
+    if (varintsLeft > 0) {
+        varint |= (unsigned long)(b & 0x7f) << shift;
+        if (b & 0x80) {
+            shift += 7;
+            if (shift > 28) {
+                state = Invalid; // does not fit in 32 bits
+            }
+            return;
+        }
+        fields[fieldCount++] = varint;
+        varint = 0;
+        shift = 0;
+        varintsLeft--;
+    } else if (payload.isBuffer()) {
+        network->buffers.data(payload)[payload.bufferLength() - bytesLeft--] = b;
+    } else if (payload.isStartBracket()) {
+        const bool text = fields[2] & 1;
+        sendPacket(fields[0], fields[1], text ? Packet((char)b) : Packet(b));
+        bytesLeft--;
+    } else {
+        buffer[currentByte++] = b;
+        bytesLeft--;
+    }
+
+    if (varintsLeft == 0 && bytesLeft == 0 && !nextPartV2()) {
+        executeCommandV2();
     }
 }
 
-void Component::connect(int outPort, Component *target, int targetPort) {
-    connections[outPort].target = target;
-    connections[outPort].targetPort = targetPort;
+// Sets up reading the next part of the current v2 command: a number of varints,
+// followed by a number of bytes. Returns false when the command is complete
+bool GraphStreamer::nextPartV2() {
+    const unsigned char current = ++part;
+    varintsLeft = 0;
+    bytesLeft = 0;
+    if (opcode == GraphCmdCreateComponent) {
+        varintsLeft = (current == 1) ? 1 : 0;
+    } else if (opcode == GraphCmdConnectNodes) {
+        if (current == 1) {
+            varintsLeft = 5; // src, target, srcPort, targetPort, capacity
+            bytesLeft = 1; // overflow policy
+        }
+    } else if (opcode == GraphCmdSetNodePriority) {
+        if (current == 1) {
+            varintsLeft = 1; // node
+            bytesLeft = 1; // priority
+        }
+    } else if (opcode == GraphCmdSetEdgePriority) {
+        if (current == 1) {
+            varintsLeft = 4; // src, target, srcPort, targetPort
+            bytesLeft = 1; // priority
+        }
+    } else if (opcode == GraphCmdEnd) {
+        bytesLeft = (current == 1) ? 2 : 0;
+    } else if (opcode == GraphCmdSendPacket) {
+        const Msg packetType = (Msg)buffer[0];
+        if (current == 1) {
+            varintsLeft = 2; // target, targetPort
+            bytesLeft = 1; // packet type
+            payload = Packet();
+        } else if (current == 2) {
+            if (packetType == MsgInteger || packetType == MsgBuffer) {
+                varintsLeft = 1;
+            } else if (packetType == MsgFloat) {
+                bytesLeft = 4;
+            } else if (packetType == MsgByte || packetType == MsgAscii || packetType == MsgBoolean) {
+                bytesLeft = 1;
+            }
+        } else if (current == 3 && packetType == MsgBuffer) {
+            // Too large for a buffer, or none free: streamed as bracketed bytes while parsing
+            const unsigned long length = fields[2] >> 1;
+            const bool text = fields[2] & 1;
+            if (network && length <= (unsigned long)BUFFER_SIZE) {
+                payload = network->buffers.allocate(length, text);
+            }
+            if (!payload.isBuffer()) {
+                payload = Packet(MsgBracketStart);
+                sendPacket(fields[0], fields[1], payload);
+            }
+            bytesLeft = length;
+        }
+    }
+    return varintsLeft > 0 || bytesLeft > 0;
 }
 
-void Component::setNetwork(Network *net, int n, IO *i) {
-    network = net;
-    nodeId = n;
-    io = i;
-    for(int i=0; i<MAX_PORTS; i++) {
-        connections[i].target = 0;
-        connections[i].targetPort = -1;
+void GraphStreamer::executeCommandV2() {
+    part = 0;
+    if (!network && opcode != GraphCmdEnd) {
+        // Only checking, see check()
+        if (opcode < GraphCmdReset || opcode >= GraphCmdInvalid) {
+            state = Invalid;
+        }
+        payload = Packet();
+        return;
+    }
+    if (opcode == GraphCmdReset) {
+        network->reset();
+    } else if (opcode == GraphCmdCreateComponent) {
+        Component *c = Component::create((ComponentId)fields[0]);
+        if (network->addNode(c) < 0) {
+            state = Invalid;
+        }
+    } else if (opcode == GraphCmdConnectNodes) {
+        network->connect(fields[0], fields[2], fields[1], fields[3], fields[4], (OverflowPolicy)buffer[0]);
+    } else if (opcode == GraphCmdSendPacket) {
+        const int target = fields[0];
+        const int targetPort = fields[1];
+        const Msg packetType = (Msg)buffer[0];
+        if (packetType == MsgBracketStart || packetType == MsgBracketEnd || packetType == MsgVoid) {
+            sendPacket(target, targetPort, Packet(packetType));
+        } else if (packetType == MsgInteger) {
+            const long val = (long)(fields[2] >> 1) ^ -(long)(fields[2] & 1);
+            sendPacket(target, targetPort, Packet(val));
+        } else if (packetType == MsgFloat) {
+            float val;
+            memcpy(&val, buffer+1, sizeof(val));
+            sendPacket(target, targetPort, Packet(val));
+        } else if (packetType == MsgByte) {
+            sendPacket(target, targetPort, Packet(buffer[1]));
+        } else if (packetType == MsgAscii) {
+            sendPacket(target, targetPort, Packet((char)buffer[1]));
+        } else if (packetType == MsgBoolean) {
+            sendPacket(target, targetPort, Packet(buffer[1] != 0));
+        } else if (packetType == MsgBuffer && payload.isBuffer()) {
+            sendPacket(target, targetPort, payload);
+            network->buffers.release(payload);
+        } else if (packetType == MsgBuffer) {
+            sendPacket(target, targetPort, Packet(MsgBracketEnd));
+        } else {
+            state = Invalid;
+        }
+        payload = Packet();
+    } else if (opcode == GraphCmdEnd) {
+        const uint16_t expected = buffer[0] | (buffer[1] << 8);
+        if (expected != crc) {
+            if (network) {
+                network->reset(); // corrupted, do not run a partial or misconnected graph
+            }
+            state = Invalid;
+        } else {
+            state = ParseHeader;
+        }
+        currentByte = 0;
+    } else if (opcode == GraphCmdDumpProfile) {
+#ifdef MICROFLO_PROFILE
+        network->writeProfile(0);
+#endif
+    } else if (opcode == GraphCmdSetNodePriority) {
+        network->setPriority(fields[0], (Priority)buffer[0]);
+    } else if (opcode == GraphCmdSetEdgePriority) {
+        network->setPriority(fields[0], fields[2], fields[1], fields[3], (Priority)buffer[0]);
+    } else {
+        state = Invalid; // unknown command, the length of the rest is not known
     }
 }
 
-Network::Network(IO *io)
-    : lastAddedNodeIndex(0)
-    , messageWriteIndex(0)
-    , messageReadIndex(0)
-    , messageSentNotify(0)
-    , messageDeliveredNotify(0)
-    , addNodeNotify(0)
-    , nodeConnectNotify(0)
+bool GraphStreamer::check(const unsigned char *data, size_t length) {
+    GraphStreamer checker;
+    checker.parse(data, length);
+    // Ends after a whole command in v1, or after End in v2
+    return checker.currentByte == 0 && (checker.state == ParseHeader || checker.state == ParseCmd);
+}
+
+GraphUploader::GraphUploader(Network *net, IO *io, int serialDevice)
+    : network(net)
     , io(io)
-{
-    for (int i=0; i<MAX_NODES; i++) {
-        nodes[i] = 0;
+    , serialDevice(serialDevice)
+    , frameLength(0)
+    , lastByteMs(0)
+    , receiving(false)
+    , expectedSeq(0)
+    , lastCommitSeq(-1)
+    , lastCommitError(UploadErrorNone)
+    , streamLength(0)
+    , staged(0)
+{}
+
+void GraphUploader::poll() {
+    if (io->SerialDataAvailable(serialDevice) <= 0) {
+        return;
+    }
+    const long now = io->TimerCurrentMs();
+    if (frameLength > 0 && now - lastByteMs > UPLOAD_FRAME_TIMEOUT_MS) {
+        frameLength = 0; // rest of the frame was lost, look for the next marker
+    }
+    unsigned char chunk[UPLOAD_FRAME_PAYLOAD];
+    long received;
+    while ((received = io->SerialRead(serialDevice, chunk, sizeof(chunk))) > 0) {
+        for (long i=0; i<received; i++) {
+            receiveByte(chunk[i]);
+        }
     }
+    lastByteMs = now;
 }
 
-void Network::setNotifications(MessageSendNotification send,
-                               MessageDeliveryNotification deliver,
-                               NodeConnectNotification nodeConnect,
-                               AddNodeNotification addNode)
-{
-    messageSentNotify = send;
-    messageDeliveredNotify = deliver;
-    nodeConnectNotify = nodeConnect;
-    addNodeNotify = addNode;
+void GraphUploader::receiveByte(unsigned char b) {
+    if (frameLength == 0 && b != UPLOAD_MARKER) {
+        return;
+    }
+    frame[frameLength++] = b;
+    if (frameLength < 4) {
+        return;
+    }
+    const int payloadLength = frame[3];
+    if (payloadLength > UPLOAD_FRAME_PAYLOAD) {
+        frameLength = 0; // corrupted, or not a frame
+        return;
+    }
+    if (frameLength < 4 + payloadLength + 2) {
+        return;
+    }
+
+    frameLength = 0;
+    uint16_t crc = 0xFFFF;
+    for (int i=1; i<4+payloadLength; i++) {
+        crc = crc16Update(crc, frame[i]);
+    }
+    const uint16_t expected = frame[4+payloadLength] | (frame[4+payloadLength+1] << 8);
+    if (crc != expected) {
+        nak(UploadErrorChecksum);
+        return;
+    }
+    handleFrame((UploadFrame)frame[1], frame[2], frame+4, payloadLength);
 }
 
-void Network::deliverMessages(int firstIndex, int lastIndex) {
-        if (firstIndex > lastIndex || lastIndex > MAX_MESSAGES-1 || firstIndex < 0) {
+void GraphUploader::handleFrame(UploadFrame kind, unsigned char seq, const unsigned char *payload, int length) {
+    if (kind == UploadFrameBegin) {
+        unsigned long total = 0;
+        for (int i=0; i<length && i<4; i++) {
+            total |= (unsigned long)payload[i] << (8*i);
+        }
+        expectedSeq = seq+1;
+        if (total > UPLOAD_BUFFER_SIZE) {
+            receiving = false;
+            nak(UploadErrorTooLarge);
+            return;
+        }
+        receiving = true;
+        streamLength = total;
+        staged = 0;
+        lastCommitSeq = -1;
+        const unsigned char limits[] = { UPLOAD_WINDOW, UPLOAD_FRAME_PAYLOAD,
+            (unsigned char)(UPLOAD_BUFFER_SIZE), (unsigned char)(UPLOAD_BUFFER_SIZE >> 8),
+            (unsigned char)(UPLOAD_BUFFER_SIZE >> 16), (unsigned char)(UPLOAD_BUFFER_SIZE >> 24) };
+        reply(UploadFrameAck, seq, limits, sizeof(limits));
+    } else if (kind == UploadFrameCommit && lastCommitSeq == seq) {
+        // Our reply was lost
+        if (lastCommitError == UploadErrorNone) {
+            reply(UploadFrameAck, seq, 0, 0);
+        } else {
+            nak(lastCommitError);
+        }
+    } else if (!receiving) {
+        nak(UploadErrorNotStarted);
+    } else if (seq != expectedSeq) {
+        // In-flight frames after a lost one, or a resend of one already acknowledged
+        const unsigned char behind = expectedSeq - seq;
+        if (behind > 0 && behind <= UPLOAD_WINDOW) {
+            reply(UploadFrameAck, expectedSeq-1, 0, 0);
+        } else {
+            nak(UploadErrorSequence);
+        }
+    } else if (kind == UploadFrameData) {
+        if (staged + length > streamLength) {
+            receiving = false;
+            nak(UploadErrorTooLarge);
             return;
         }
+        memcpy(staging+staged, payload, length);
+        staged += length;
+        reply(UploadFrameAck, expectedSeq++, 0, 0);
+    } else if (kind == UploadFrameCommit) {
+        commit(seq);
+    } else if (kind == UploadFrameAbort) {
+        receiving = false;
+        reply(UploadFrameAck, seq, 0, 0);
+    }
+}
 
-        for (int i=firstIndex; i<=lastIndex; i++) {
-            Component *target = messages[i].target;
-            if (!target) {
-                // FIXME: this should not happen
-                continue;
-            }
-            target->process(messages[i].pkg, messages[i].targetPort);
-            if (messageDeliveredNotify) {
-                messageDeliveredNotify(i, messages[i]);
+void GraphUploader::commit(unsigned char seq) {
+    receiving = false;
+    expectedSeq = seq+1;
+    lastCommitSeq = seq;
+    if (staged != streamLength) {
+        lastCommitError = UploadErrorIncomplete;
+    } else if (!GraphStreamer::check(staging, staged)) {
+        lastCommitError = UploadErrorInvalidGraph; // before Reset, so the old graph keeps running
+    } else {
+        // A new graph begins with Reset, which tears down the running one
+        const bool newGraph = staged > GRAPH_MAGIC_SIZE && staging[GRAPH_MAGIC_SIZE] == GraphCmdReset;
+        GraphStreamer parser;
+        parser.setNetwork(network);
+        parser.parse(staging, staged);
+        if (parser.isValid()) {
+            lastCommitError = UploadErrorNone;
+            if (newGraph) {
+                network->runSetup();
             }
+        } else {
+            // Out of memory, the old graph is gone already
+            lastCommitError = UploadErrorInvalidGraph;
+            network->reset();
         }
+    }
+    if (lastCommitError == UploadErrorNone) {
+        reply(UploadFrameAck, seq, 0, 0);
+    } else {
+        nak(lastCommitError);
+    }
 }
 
-void Network::processMessages() {
-    // Messages may be emitted during delivery, so copy the range we intend to deliver
-    const int readIndex = messageReadIndex;
-    const int writeIndex = messageWriteIndex;
-    if (readIndex > writeIndex) {
-        deliverMessages(readIndex, MAX_MESSAGES-1);
-        deliverMessages(0, writeIndex-1);
-    } else if (readIndex < writeIndex) {
-        deliverMessages(readIndex, writeIndex-1);
+void GraphUploader::nak(UploadError error) {
+    const unsigned char code = error;
+    reply(UploadFrameNak, expectedSeq, &code, 1);
+}
+
+void GraphUploader::reply(UploadFrame kind, unsigned char seq, const unsigned char *payload, int length) {
+    const unsigned char header[] = { UPLOAD_MARKER, (unsigned char)kind, seq, (unsigned char)length };
+    uint16_t crc = 0xFFFF;
+    for (int i=0; i<4+length; i++) {
+        const unsigned char b = (i < 4) ? header[i] : payload[i-4];
+        if (i > 0) {
+            crc = crc16Update(crc, b);
+        }
+        io->SerialWrite(serialDevice, b);
+    }
+    io->SerialWrite(serialDevice, crc & 0xFF);
+    io->SerialWrite(serialDevice, crc >> 8);
+}
+
+void TimerWheel::reset() {
+    for (int i=0; i<LISTS; i++) {
+        lists[i] = -1;
+    }
+    for (int i=0; i<TIMER_WHEEL_LEVELS; i++) {
+        occupied[i] = 0;
+    }
+    for (int i=0; i<MAX_NODES; i++) {
+        nodeTimers[i] = -1;
+    }
+    dueLast = -1;
+    current = 0;
+    running = 0;
+    dueTimers = 0;
+    for (int i=MAX_TIMERS-1; i>=0; i--) {
+        link(i, FREE_LIST);
+    }
+}
+
+TimerIndex TimerWheel::find(int nodeId, int id) const {
+    for (TimerIndex t=nodeTimers[nodeId]; t>=0; t=timers[t].nextOfNode) {
+        if (timers[t].id == id) {
+            return t;
+        }
+    }
+    return -1;
+}
+
+bool TimerWheel::start(int nodeId, int id, unsigned long deadline, unsigned long period,
+                       unsigned long now) {
+    if (nodeId < 0 || nodeId >= MAX_NODES) {
+        return false;
+    }
+    TimerIndex t = find(nodeId, id);
+    if (t >= 0) {
+        unlink(t);
     } else {
-        // no messages
+        t = lists[FREE_LIST];
+        if (t < 0) {
+            return false;
+        }
+        unlink(t);
+        if (running++ == 0) {
+            current = now; // nothing was waiting for the time in between
+        }
+        Timer &timer = timers[t];
+        timer.nodeId = nodeId;
+        timer.id = id;
+        timer.nextOfNode = nodeTimers[nodeId];
+        nodeTimers[nodeId] = t;
+    }
+    timers[t].deadline = deadline;
+    timers[t].period = period;
+    place(t);
+    return true;
+}
+
+void TimerWheel::stop(int nodeId, int id) {
+    if (nodeId < 0 || nodeId >= MAX_NODES) {
+        return;
+    }
+    const TimerIndex t = find(nodeId, id);
+    if (t >= 0) {
+        unlink(t);
+        release(t);
     }
-    messageReadIndex = writeIndex;
 }
 
-void Network::sendMessage(Component *target, int targetPort, const Packet &pkg, Component *sender, int senderPort) {
+// Of a timer which is in no list
+void TimerWheel::release(TimerIndex t) {
+    TimerIndex *p = &nodeTimers[timers[t].nodeId];
+    while (*p != t) {
+        p = &timers[*p].nextOfNode;
+    }
+    *p = timers[t].nextOfNode;
+    link(t, FREE_LIST);
+    running--;
+}
 
-    if (messageWriteIndex > MAX_MESSAGES-1) {
-        messageWriteIndex = 0;
+void TimerWheel::place(TimerIndex t) {
+    const unsigned long deadline = timers[t].deadline;
+    if ((long)(deadline - current) <= 0) {
+        link(t, DUE_LIST);
+        return;
     }
-    Message &msg = messages[messageWriteIndex++];
-    msg.target = target;
-    msg.targetPort = targetPort;
-    msg.pkg = pkg;
-    if (messageSentNotify) {
-        messageSentNotify(messageWriteIndex-1, msg, sender, senderPort);
+    // The digit of the deadline at that level is above the one of the current time,
+    // and the higher digits are the same. So the slots up to the current one are empty
+    const unsigned long differs = deadline ^ current;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS && (differs >> (TIMER_WHEEL_BITS*(level+1))) != 0) {
+        level++;
+    }
+    if (level == TIMER_WHEEL_LEVELS) {
+        link(t, OVERFLOW_LIST);
+        return;
     }
+    const int slot = (deadline >> (TIMER_WHEEL_BITS*level)) & (TIMER_WHEEL_SLOTS-1);
+    link(t, level*TIMER_WHEEL_SLOTS + slot);
 }
 
-void Network::sendMessage(int targetId, int targetPort, const Packet &pkg) {
-    sendMessage(nodes[targetId], targetPort, pkg);
+void TimerWheel::link(TimerIndex t, int list) {
+    Timer &timer = timers[t];
+    timer.list = list;
+    if (list == DUE_LIST) {
+        // Appended, to keep them in order of expiry
+        timer.next = -1;
+        timer.prev = dueLast;
+        if (dueLast >= 0) {
+            timers[dueLast].next = t;
+        } else {
+            lists[DUE_LIST] = t;
+        }
+        dueLast = t;
+        dueTimers++;
+        return;
+    }
+    timer.prev = -1;
+    timer.next = lists[list];
+    if (timer.next >= 0) {
+        timers[timer.next].prev = t;
+    }
+    lists[list] = t;
+    if (list < DUE_LIST) {
+        occupied[list / TIMER_WHEEL_SLOTS] |= (TimerSlotMask)1 << (list % TIMER_WHEEL_SLOTS);
+    }
 }
 
-void Network::runSetup() {
-    for (int i=0; i<MAX_NODES; i++) {
-        if (nodes[i]) {
-            nodes[i]->process(Packet(MsgSetup), -1);
+void TimerWheel::unlink(TimerIndex t) {
+    const Timer &timer = timers[t];
+    const int list = timer.list;
+    if (timer.prev >= 0) {
+        timers[timer.prev].next = timer.next;
+    } else {
+        lists[list] = timer.next;
+    }
+    if (timer.next >= 0) {
+        timers[timer.next].prev = timer.prev;
+    }
+    if (list == DUE_LIST) {
+        if (dueLast == t) {
+            dueLast = timer.prev;
         }
+        dueTimers--;
+    } else if (list < DUE_LIST && lists[list] < 0) {
+        occupied[list / TIMER_WHEEL_SLOTS] &= ~((TimerSlotMask)1 << (list % TIMER_WHEEL_SLOTS));
     }
 }
 
-void Network::runTick() {
+// Places the timers of @list again, for the current time. Those in the overflow list
+// may go back to it
+void TimerWheel::moveAll(int list) {
+    TimerIndex t = lists[list];
+    lists[list] = -1;
+    if (list < DUE_LIST) {
+        occupied[list / TIMER_WHEEL_SLOTS] &= ~((TimerSlotMask)1 << (list % TIMER_WHEEL_SLOTS));
+    }
+    while (t >= 0) {
+        const TimerIndex next = timers[t].next;
+        place(t);
+        t = next;
+    }
+}
 
-    // TODO: consider the balance between scheduling and messaging (bounded-buffer problem)
+static int lowestBit(TimerSlotMask mask) {
+#ifdef HOST_BUILD
+    return __builtin_ctzll(mask);
+#else
+    int bit = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+// When the first occupied slot starts, or when the overflow list is to be looked at.
+// The lowest level with a slot after the current one has the first, since the
+// slots of the lower levels all start before that
+bool TimerWheel::nextEvent(unsigned long *time) const {
+    for (int level=0; level<TIMER_WHEEL_LEVELS; level++) {
+        const int shift = TIMER_WHEEL_BITS*level;
+        const int digit = (current >> shift) & (TIMER_WHEEL_SLOTS-1);
+        const TimerSlotMask later = occupied[level] >> digit >> 1;
+        if (later) {
+            const unsigned long block = current & ~((1UL << (shift + TIMER_WHEEL_BITS)) - 1);
+            *time = block | ((unsigned long)(digit + 1 + lowestBit(later)) << shift);
+            return true;
+        }
+    }
+    if (lists[OVERFLOW_LIST] >= 0) {
+        *time = (current | ((1UL << (TIMER_WHEEL_BITS*TIMER_WHEEL_LEVELS)) - 1)) + 1;
+        return true;
+    }
+    return false;
+}
 
-    // Deliver messages
-    processMessages();
+void TimerWheel::advance(unsigned long now) {
+    unsigned long time;
+    while (nextEvent(&time) && (long)(time - now) <= 0) {
+        current = time;
+        if ((time & ((1UL << (TIMER_WHEEL_BITS*TIMER_WHEEL_LEVELS)) - 1)) == 0) {
+            moveAll(OVERFLOW_LIST);
+        }
+        // Every level at the start of a slot hands it down, level 0 to the due list
+        for (int level=TIMER_WHEEL_LEVELS-1; level>=0; level--) {
+            const int shift = TIMER_WHEEL_BITS*level;
+            if ((time & ((1UL << shift) - 1)) == 0) {
+                moveAll(level*TIMER_WHEEL_SLOTS + ((time >> shift) & (TIMER_WHEEL_SLOTS-1)));
+            }
+        }
+    }
+    if ((long)(now - current) > 0) {
+        current = now;
+    }
+}
 
-    // Schedule
-    for (int i=0; i<MAX_NODES; i++) {
-        Component *t = nodes[i];
-        if (t) {
-            t->process(Packet(MsgTick), -1);
+long TimerWheel::nextTimeout(unsigned long now) const {
+    if (dueTimers > 0) {
+        return 0;
+    }
+    unsigned long time;
+    if (!nextEvent(&time)) {
+        return -1;
+    }
+    const long remaining = (long)(time - now);
+    return (remaining > 0) ? remaining : 0;
+}
+
+int TimerWheel::fireDue() {
+    const TimerIndex t = lists[DUE_LIST];
+    Timer &timer = timers[t];
+    const int id = timer.id;
+    unlink(t);
+    if (timer.period > 0) {
+        timer.deadline += timer.period;
+        if ((long)(timer.deadline - current) <= 0) {
+            timer.deadline = current + timer.period;
+        }
+        place(t);
+    } else {
+        release(t);
+    }
+    return id;
+}
+
+void TimerWheel::deferDue() {
+    const TimerIndex t = lists[DUE_LIST];
+    unlink(t);
+    link(t, DUE_LIST);
+}
+
+bool IOCompletions::join(int key, IOCompletionFunction done, void *user) {
+    for (int i=0; i<count; i++) {
+        if (pending[i].key != key) {
+            continue;
         }
+        if (count >= MAX_PENDING_IO) {
+            done(user, false);
+            return true;
+        }
+        Pending &p = pending[count++];
+        p = pending[i];
+        p.done = done;
+        p.user = user;
+        return true;
     }
+    return false;
 }
 
-void Network::connect(int srcId, int srcPort, int targetId, int targetPort) {
-    if (srcId < 0 || srcId > lastAddedNodeIndex ||
-        targetId < 0 || targetId > lastAddedNodeIndex) {
+void IOCompletions::add(int key, unsigned long nowMs, long durationMs, bool ok,
+                        IOCompletionFunction done, void *user) {
+    if (count >= MAX_PENDING_IO) {
+        done(user, false);
         return;
     }
+    Pending &p = pending[count++];
+    p.key = key;
+    p.deadline = nowMs + (durationMs > 0 ? durationMs : 0);
+    p.ok = ok;
+    p.done = done;
+    p.user = user;
+}
+
+long IOCompletions::poll(unsigned long nowMs) {
+    long next = -1;
+    int i = 0;
+    while (i < count) {
+        const long remaining = (long)(pending[i].deadline - nowMs);
+        if (remaining > 0) {
+            next = (next < 0 || remaining < next) ? remaining : next;
+            i++;
+            continue;
+        }
+        // Removed before calling, in order, so the function may start a new operation
+        const Pending done = pending[i];
+        for (int j=i+1; j<count; j++) {
+            pending[j-1] = pending[j];
+        }
+        count--;
+        done.done(done.user, done.ok);
+    }
+    return next;
+}
 
-    connect(nodes[srcId], srcPort, nodes[targetId], targetPort);
+void IOCompletions::cancel(void *user) {
+    int write = 0;
+    for (int read=0; read<count; read++) {
+        if (pending[read].user != user) {
+            pending[write++] = pending[read];
+        }
+    }
+    count = write;
 }
 
-void Network::connect(Component *src, int srcPort, Component *target, int targetPort) {
-    src->connect(srcPort, target, targetPort);
-    if (nodeConnectNotify) {
-        nodeConnectNotify(src, srcPort, target, targetPort);
+#ifdef HOST_BUILD
+int OneWireMock::find(int pin, const unsigned char address[8]) const {
+    for (int i=0; i<sensorCount; i++) {
+        if (sensors[i].pin == pin && memcmp(sensors[i].address, address, 8) == 0) {
+            return i;
+        }
     }
+    return -1;
 }
 
-int Network::addNode(Component *node) {
-    const int nodeId = lastAddedNodeIndex;
-    nodes[nodeId] = node;
-    node->setNetwork(this, nodeId, this->io);
-    if (addNodeNotify) {
-        addNodeNotify(node);
+void OneWireMock::setTemperature(int pin, const unsigned char address[8], float celcius) {
+    int i = find(pin, address);
+    if (i < 0) {
+        if (sensorCount >= MAX_SENSORS) {
+            return;
+        }
+        i = sensorCount++;
+        sensors[i].pin = pin;
+        memcpy(sensors[i].address, address, 8);
+        sensors[i].converted = 85; // power-on value of the scratchpad
     }
-    lastAddedNodeIndex++;
-    return nodeId;
+    sensors[i].current = celcius;
 }
 
-void Network::reset() {
-    // FIXME: implement
+long OneWireMock::startConversion(int pin, int resolution) {
+    bool found = false;
+    for (int i=0; i<sensorCount; i++) {
+        if (sensors[i].pin == pin) {
+            sensors[i].converted = sensors[i].current;
+            found = true;
+        }
+    }
+    if (!found) {
+        return -1;
+    }
+    if (conversionMs >= 0) {
+        return conversionMs;
+    }
+    return oneWireConversionMillis(resolution);
 }
+
+float OneWireMock::temperature(int pin, const unsigned char address[8]) const {
+    const int i = find(pin, address);
+    return (i < 0) ? ONEWIRE_NO_SENSOR : sensors[i].converted;
+}
+#endif
+
+Tracer::Tracer(IO *io, int serialDevice, long baudrate)
+    : io(io)
+    , serialDevice(serialDevice)
+    , bytesPerSecond(baudrate/10) // 8N1
+    , lastDrainMs(0)
+    , budget(TRACE_DRAIN_BURST*1000L)
+    , head(0)
+    , size(0)
+    , droppedSinceReport(0)
+    , droppedTotal(0)
+#ifdef HOST_BUILD
+    , busy(false)
+#endif
+{}
+
+void Tracer::record(TraceEvent event, int connection, int srcNode, int srcPort,
+                    int dstNode, int dstPort, const Packet &pkg) {
+    TraceRecord r;
+    r.event = event;
+    r.connection = connection;
+    r.time = io->TimerCurrentMs();
+    r.srcNode = srcNode;
+    r.srcPort = srcPort;
+    r.dstNode = dstNode;
+    r.dstPort = dstPort;
+    r.pkg = pkg;
+
+    lock();
+    if (size+2 <= (unsigned int)TRACE_RING_SIZE) {
+        pushDroppedReport(r.time);
+    }
+    if (droppedSinceReport == 0 && size < (unsigned int)TRACE_RING_SIZE) {
+        push(r);
+    } else {
+        droppedSinceReport++;
+        droppedTotal++;
+    }
+    unlock();
+}
+
+void Tracer::push(const TraceRecord &r) {
+    ring[(head+size) % TRACE_RING_SIZE] = r;
+    size++;
+}
+
+// Caller must hold the lock, and make sure there is room
+void Tracer::pushDroppedReport(uint16_t time) {
+    if (droppedSinceReport == 0) {
+        return;
+    }
+    TraceRecord report;
+    report.event = TraceEventDropped;
+    report.connection = 0xFFFF;
+    report.time = time;
+    report.srcNode = report.dstNode = 0xFFFF;
+    report.srcPort = report.dstPort = 0xFF;
+    report.pkg = Packet((long)droppedSinceReport);
+    push(report);
+    droppedSinceReport = 0;
+}
+
+void Tracer::drain() {
+    // In thousandths of a byte, so that calling often does not round the budget down to nothing
+    const long now = io->TimerCurrentMs();
+    const long elapsed = now - lastDrainMs;
+    const long burst = TRACE_DRAIN_BURST*1000L;
+    budget = (elapsed < 0 || elapsed > 1000) ? burst : budget + elapsed*bytesPerSecond;
+    if (budget > burst) {
+        budget = burst;
+    }
+    lastDrainMs = now;
+
+    const long recordSize = (1 + sizeof(TraceRecord))*1000L;
+    lock();
+    while (size > 0 && budget >= recordSize) {
+        const unsigned char *bytes = (const unsigned char *)&ring[head];
+        io->SerialWrite(serialDevice, TRACE_MARKER);
+        for (size_t i=0; i<sizeof(TraceRecord); i++) {
+            io->SerialWrite(serialDevice, bytes[i]);
+        }
+        head = (head+1) % TRACE_RING_SIZE;
+        size--;
+        budget -= recordSize;
+        pushDroppedReport(now); // also when nothing is recorded after the gap
+    }
+    unlock();
+}
+
+long Tracer::nextDrainMs() const {
+    if (size == 0) {
+        return -1;
+    }
+    const long missing = (1 + sizeof(TraceRecord))*1000L - budget;
+    return (missing <= 0) ? 0 : (missing + bytesPerSecond-1)/bytesPerSecond;
+}
+
+void Tracer::lock() {
+#ifdef HOST_BUILD
+    while (__atomic_test_and_set(&busy, __ATOMIC_ACQUIRE)) {
+        ;
+    }
+#endif
+}
+
+void Tracer::unlock() {
+#ifdef HOST_BUILD
+    __atomic_clear(&busy, __ATOMIC_RELEASE);
+#endif
+}
+
+Component::Component()
+    : blockedOutputs(0)
+    , network(0)
+    , nodeId(-1)
+    , componentId(0)
+    , ticksRequested(false)
+    , created(false)
+    , priority(PriorityNormal)
+{
+}
+
+void Component::send(const Packet &out, int port) {
+    if (port < 0 || port >= MAX_PORTS) {
+        return;
+    }
+#ifdef MICROFLO_STATIC_GRAPH
+    if (microfloStaticSend(nodeId, port, out)) {
+        return;
+    }
+#endif
+    if (network) {
+        network->sendFromOutput(nodeId, port, out);
+    }
+}
+
+void Component::post(const Packet &out, int port) {
+    if (port < 0 || port >= MAX_PORTS) {
+        return;
+    }
+    network->postMessage(this, port, true, out);
+}
+
+void Component::sendBuffer(const unsigned char *data, int length, int port) {
+    const Packet buffer = allocateBuffer(length);
+    if (!buffer.isBuffer()) {
+        sendBracketed(data, length, false, port);
+        return;
+    }
+    memcpy(bufferData(buffer), data, length);
+    send(buffer, port);
+    releaseBuffer(buffer);
+}
+
+void Component::sendText(const char *str, int port) {
+    const int length = strlen(str);
+    const Packet buffer = allocateBuffer(length, true);
+    if (!buffer.isBuffer()) {
+        sendBracketed((const unsigned char *)str, length, true, port);
+        return;
+    }
+    memcpy(bufferData(buffer), str, length);
+    send(buffer, port);
+    releaseBuffer(buffer);
+}
+
+void Component::sendBracketed(const unsigned char *data, int length, bool text, int port) {
+    send(Packet(MsgBracketStart), port);
+    for (int i=0; i<length; i++) {
+        send(text ? Packet((char)data[i]) : Packet(data[i]), port);
+    }
+    send(Packet(MsgBracketEnd), port);
+}
+
+void Component::expandBuffer(const Packet &buffer, int port) {
+    const unsigned char *data = bufferData(buffer);
+    const int length = buffer.bufferLength();
+    const bool text = buffer.isText();
+    process(Packet(MsgBracketStart), port);
+    for (int i=0; i<length; i++) {
+        process(text ? Packet((char)data[i]) : Packet(data[i]), port);
+    }
+    process(Packet(MsgBracketEnd), port);
+}
+
+unsigned char *Component::bufferData(const Packet &buffer) {
+    return network->buffers.data(buffer);
+}
+
+Packet Component::allocateBuffer(int length, bool text) {
+    return network ? network->buffers.allocate(length, text) : Packet();
+}
+
+void Component::releaseBuffer(const Packet &buffer) {
+    if (network && buffer.isBuffer()) {
+        network->buffers.release(buffer);
+    }
+}
+
+void Component::setNetwork(Network *net, int n, IO *i) {
+    network = net;
+    nodeId = n;
+    io = i;
+    blockedOutputs = 0;
+}
+
+void Component::subscribeTicks(bool enable) {
+    if (network) {
+        network->subscribeTicks(this, enable);
+    } else {
+        ticksRequested = enable;
+    }
+}
+
+void Component::scheduleTick(unsigned long deadline) {
+    if (network) {
+        network->scheduleTick(this, deadline);
+    }
+}
+
+bool Component::startTimer(int timer, unsigned long ms, bool periodic) {
+    if (!network || timer < 0) {
+        return false;
+    }
+    const unsigned long now = io->TimerCurrentMs();
+    const unsigned long period = periodic ? (ms > 0 ? ms : 1) : 0; // 0 is one-shot
+    return network->timers.start(nodeId, timer, now + ms, period, now);
+}
+
+void Component::stopTimer(int timer) {
+    if (network) {
+        network->timers.stop(nodeId, timer);
+    }
+}
+
+void Component::ioCompletion(void *user, bool ok) {
+    Component *c = static_cast<Component *>(user);
+    if (c->network) {
+        c->network->sendMessage(c, IO_COMPLETION_PORT, Packet(ok));
+    }
+}
+
+Network::Network(IO *io, Executor *executor)
+    : lastAddedNodeIndex(0)
+    , connectionsUsed(0)
+    , queueStorageUsed(0)
+    , initialUsed(0)
+    , initialDelivered(0)
+    , messageSentNotify(0)
+    , messageDeliveredNotify(0)
+    , addNodeNotify(0)
+    , nodeConnectNotify(0)
+    , tickSubscriptionCount(0)
+    , sleepWhenIdle(false)
+    , tickBudget(0)
+    , prioritiesUsed(false)
+    , deliveryOrderValid(false)
+    , tickTimed(false)
+    , outOfTime(false)
+    , ticksDeferred(false)
+    , tickDeadline(0)
+    , resumeTick(0)
+    , executor(executor)
+    , tracer(0)
+    , io(io)
+{
+    for (int i=0; i<MAX_NODES; i++) {
+        nodes[i] = 0;
+    }
+    firstOutgoing[0] = 0;
+    memset(overruns, 0, sizeof(overruns));
+#ifdef MICROFLO_PROFILE
+    memset(profiles, 0, sizeof(profiles));
+#endif
+    if (executor) {
+        executor->attach(this);
+    }
+}
+
+void Network::setNotifications(MessageSendNotification send,
+                               MessageDeliveryNotification deliver,
+                               NodeConnectNotification nodeConnect,
+                               AddNodeNotification addNode)
+{
+    messageSentNotify = send;
+    messageDeliveredNotify = deliver;
+    nodeConnectNotify = nodeConnect;
+    addNodeNotify = addNode;
+}
+
+void Network::deliver(Component *target, int targetPort, const Packet &pkg, int index) {
+    if (tracer) {
+        // Before processing, so the trace shows the packets sent in response after it
+        const int source = (index >= 0) ? connections[index].source->nodeId : -1;
+        const int sourcePort = (index >= 0) ? connections[index].sourcePort : -1;
+        tracer->record(TraceEventDeliver, index, source, sourcePort, target->nodeId, targetPort, pkg);
+    }
+#ifdef MICROFLO_PROFILE
+    const unsigned long start = io->TimerCurrentMicros();
+#endif
+    if (pkg.isBuffer() && !target->acceptsBuffers(targetPort)) {
+        target->expandBuffer(pkg, targetPort);
+    } else {
+        target->process(pkg, targetPort);
+    }
+#ifdef MICROFLO_PROFILE
+    profileCall(target->nodeId, start);
+    profiles[target->nodeId].received++;
+#endif
+    if (messageDeliveredNotify) {
+        Message msg;
+        msg.target = target;
+        msg.targetPort = targetPort;
+        msg.pkg = pkg;
+        messageDeliveredNotify(index, msg);
+    }
+    if (pkg.isBuffer()) {
+        buffers.release(pkg); // taken by queueMessage() or postMessage()
+    }
+}
+
+void Network::processMessages() {
+    spliceIngress();
+    if (outOfTime) {
+        return;
+    }
+    if (!deliveryOrderValid) {
+        updateDeliveryOrder();
+    }
+
+    // Messages may be emitted during delivery, only deliver those queued before we started.
+    // This includes those sent while delivering external messages above
+    QueueIndex pending[MAX_CONNECTIONS];
+    for (int i=0; i<connectionsUsed; i++) {
+        pending[i] = connections[i].size;
+    }
+
+    // Connection queues, by priority class
+    for (int cls=0; cls<PRIORITY_CLASSES; cls++) {
+        const int first = firstOfClass[cls];
+        const int classSize = firstOfClass[cls+1] - first;
+        for (int n=0; n<classSize; n++) {
+            const int position = (resumeInClass[cls] + n) % classSize;
+            const int i = deliveryOrder[first + position];
+            Connection &c = connections[i];
+            int count = pending[i];
+            while (count-- > 0 && c.size > 0) {
+                if (c.target->blockedOutputs) {
+                    break; // deferred until the target can send again
+                }
+                deliverNext(i);
+                if (budgetSpent(c.target)) {
+                    resumeInClass[cls] = (position + 1) % classSize;
+                    return;
+                }
+            }
+        }
+    }
+}
+
+// Classes are drained highest first, and after a lower class has run, the highest class
+// with queued packets is drained again. A class may use the whole remaining budget only when
+// the classes below it are idle, else they keep 1/PRIORITY_RESERVE of it
+void Network::processMessagesToCompletion() {
+    long budget = tickBudget - spliceIngress(tickBudget);
+    if (!deliveryOrderValid) {
+        updateDeliveryOrder();
+    }
+
+    int current = 0;
+    while (current < PRIORITY_CLASSES && budget > 0 && !outOfTime) {
+        long limit = budget;
+        if (hasQueuedMessages(current+1, PRIORITY_CLASSES)) {
+            limit -= budget/PRIORITY_RESERVE;
+        }
+        const long delivered = drainClass(current, limit);
+        budget -= delivered;
+        if (delivered == 0 || delivered == limit) {
+            current++; // idle or blocked, or used up its share
+            continue;
+        }
+        // Drained, possibly sending to higher classes
+        int highest = 0;
+        while (highest < current && !hasQueuedMessages(highest, highest+1)) {
+            highest++;
+        }
+        current = (highest < current) ? highest : current+1;
+    }
+}
+
+// Each pass empties the connections of the class in order, so a packet sent to a later
+// connection is delivered in the same pass. Passes repeat until the class is idle, or
+// @limit packets were delivered. The next tick resumes at the connection where the limit
+// was reached, so a busy cycle early in the class does not starve those after it
+long Network::drainClass(int priorityClass, long limit) {
+    const int first = firstOfClass[priorityClass];
+    const int count = firstOfClass[priorityClass+1] - first;
+    ConnectionIndex &resume = resumeInClass[priorityClass];
+    long delivered = 0;
+    bool progress = true;
+    while (progress && delivered < limit) {
+        progress = false;
+        for (int n=0; n<count && delivered < limit; n++) {
+            const int position = (resume + n) % count;
+            const int i = deliveryOrder[first + position];
+            Connection &c = connections[i];
+            while (c.size > 0 && delivered < limit && !c.target->blockedOutputs) {
+                deliverNext(i);
+                delivered++;
+                progress = true;
+                if (budgetSpent(c.target)) {
+                    resume = (position + 1) % count;
+                    return delivered;
+                }
+            }
+            if (delivered == limit) {
+                resume = position;
+            }
+        }
+    }
+    return delivered;
+}
+
+// Whether any connection of the classes [@firstClass, @lastClass) has queued packets
+bool Network::hasQueuedMessages(int firstClass, int lastClass) {
+    for (int n=firstOfClass[firstClass]; n<firstOfClass[lastClass]; n++) {
+        if (connections[deliveryOrder[n]].size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int Network::priorityClass(const Connection &c) const {
+    const int priority = (c.priority != PriorityDefault) ? c.priority : c.target->priority;
+    return priority - PriorityHigh;
+}
+
+// Counting sort of the connections by class, keeping index order within a class.
+// Done before delivering instead of for every change, so loading a graph stays linear
+void Network::updateDeliveryOrder() {
+    deliveryOrderValid = true;
+    int counts[PRIORITY_CLASSES+1] = { 0 };
+    for (int i=0; i<connectionsUsed; i++) {
+        counts[priorityClass(connections[i])+1]++;
+    }
+    for (int p=0; p<PRIORITY_CLASSES; p++) {
+        counts[p+1] += counts[p];
+        firstOfClass[p] = counts[p];
+        resumeInClass[p] = 0;
+    }
+    firstOfClass[PRIORITY_CLASSES] = connectionsUsed;
+    for (int i=0; i<connectionsUsed; i++) {
+        deliveryOrder[counts[priorityClass(connections[i])]++] = i;
+    }
+}
+
+void Network::setPriority(int nodeId, Priority priority) {
+    if (nodeId < 0 || nodeId >= lastAddedNodeIndex || priority >= PriorityMaxDefined) {
+        return;
+    }
+    nodes[nodeId]->priority = (priority == PriorityDefault) ? PriorityNormal : priority;
+    prioritiesUsed = prioritiesUsed || priority != PriorityNormal;
+    deliveryOrderValid = false;
+}
+
+void Network::setPriority(int srcId, int srcPort, int targetId, int targetPort, Priority priority) {
+    if (srcId < 0 || srcId >= lastAddedNodeIndex || priority >= PriorityMaxDefined) {
+        return;
+    }
+    for (int n=firstOutgoing[srcId]; n<firstOutgoing[srcId+1]; n++) {
+        Connection &c = connections[outgoing[n]];
+        if (c.sourcePort == srcPort && c.target->nodeId == targetId && c.targetPort == targetPort) {
+            c.priority = priority;
+        }
+    }
+    deliveryOrderValid = false;
+}
+
+void Network::deliverNext(int connection) {
+    Connection &c = connections[connection];
+    const Packet pkg = queueStorage[c.queueOffset+c.head];
+    if (c.policy == OverflowBlock && c.isFull()) {
+        c.source->blockedOutputs--;
+    }
+    c.head = (c.head+1) % c.capacity;
+    c.size--;
+    deliver(c.target, c.targetPort, pkg, connection);
+}
+
+bool Network::hasQueuedMessages() {
+    if (!ingress.isEmpty() || initialDelivered < initialUsed) {
+        return true;
+    }
+    if (executor) {
+        return executor->hasQueuedMessages();
+    }
+    for (int i=0; i<connectionsUsed; i++) {
+        if (connections[i].size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Network::queueMessage(int connection, const Packet &pkg) {
+    if (pkg.isBuffer()) {
+        buffers.retain(pkg); // one reference per queued copy, released when delivered or dropped
+    }
+    if (executor) {
+        executor->queueMessage(connection, pkg);
+        return;
+    }
+    Connection &c = connections[connection];
+
+    if (c.policy == OverflowConflate) {
+        // Replaces what was not delivered yet, which is not counted as dropped
+        for (; c.size > 0; c.size--) {
+            const Packet &queued = queueStorage[c.queueOffset+c.head];
+            if (queued.isBuffer()) {
+                buffers.release(queued);
+            }
+            c.head = (c.head+1) % c.capacity;
+        }
+    }
+    if (c.isFull()) {
+        c.dropped++;
+        if (c.policy != OverflowDropOldest || c.capacity == 0) {
+            // Also the case for OverflowBlock, when a single process() sent more than fit
+            if (pkg.isBuffer()) {
+                buffers.release(pkg);
+            }
+            return;
+        }
+        const Packet &oldest = queueStorage[c.queueOffset+c.head];
+        if (oldest.isBuffer()) {
+            buffers.release(oldest);
+        }
+        c.head = (c.head+1) % c.capacity;
+        c.size--;
+    }
+    const int index = (c.head+c.size) % c.capacity;
+    queueStorage[c.queueOffset+index] = pkg;
+    c.size++;
+#ifdef MICROFLO_PROFILE
+    if (c.size > c.highWater) {
+        c.highWater = c.size;
+    }
+#endif
+    if (c.policy == OverflowBlock && c.isFull()) {
+        c.source->blockedOutputs++;
+    }
+
+    if (messageSentNotify) {
+        Message msg;
+        msg.target = c.target;
+        msg.targetPort = c.targetPort;
+        msg.pkg = pkg;
+        messageSentNotify(connection, msg, c.source, c.sourcePort);
+    }
+    if (tracer) {
+        tracer->record(TraceEventSend, connection, c.source->nodeId, c.sourcePort,
+                       c.target->nodeId, c.targetPort, pkg);
+    }
+}
+
+// Delivers at most @limit IIPs, stopping early if the target blocks or the tick runs out
+// of time. Returns the number delivered
+long Network::deliverInitialPackets(long limit) {
+    long delivered = 0;
+    while (initialDelivered < initialUsed && delivered < limit) {
+        const long header = queueStorage[MAX_MESSAGES-1-initialDelivered].asInteger();
+        Component *node = nodes[header / 256];
+        const int port = header % 256;
+        if (node->blockedOutputs) {
+            return delivered; // stop here, to keep ordering
+        }
+        const Packet pkg = queueStorage[MAX_MESSAGES-2-initialDelivered];
+        initialDelivered += 2;
+
+        if (messageSentNotify) {
+            Message msg;
+            msg.target = node;
+            msg.targetPort = port;
+            msg.pkg = pkg;
+            messageSentNotify(-1, msg, 0, -1);
+        }
+        if (tracer) {
+            tracer->record(TraceEventSend, -1, -1, -1, node->nodeId, port, pkg);
+        }
+        deliver(node, port, pkg, -1);
+        delivered++;
+        if (budgetSpent(node)) {
+            break;
+        }
+    }
+    if (initialDelivered == initialUsed) {
+        // All delivered, the storage can be used by connections again
+        initialUsed = 0;
+        initialDelivered = 0;
+    }
+    return delivered;
+}
+
+// Delivers IIPs and then external messages, at most @limit packets in total, stopping
+// early if the tick runs out of time. Returns the number delivered
+long Network::spliceIngress(long limit) {
+    // IIPs go first, they were sent before anything else could
+    long delivered = deliverInitialPackets(limit);
+    // Bounded, in case a component keeps sending directly to itself
+    for (int budget=MAX_EXTERNAL_MESSAGES; budget>0 && delivered<limit && !outOfTime; budget--) {
+        IngressMessage *front = ingress.front();
+        if (!front) {
+            break;
+        }
+        Component *node = front->node;
+        if (front->fromOutput) {
+            const int port = front->port;
+            const Packet pkg = front->pkg;
+            ingress.pop();
+            node->send(pkg, port);
+            if (pkg.isBuffer()) {
+                buffers.release(pkg);
+            }
+            continue;
+        }
+        if (node->blockedOutputs) {
+            break; // stop here, to keep ordering
+        }
+        const int port = front->port;
+        const Packet pkg = front->pkg;
+        ingress.pop();
+
+        if (messageSentNotify) {
+            Message msg;
+            msg.target = node;
+            msg.targetPort = port;
+            msg.pkg = pkg;
+            messageSentNotify(-1, msg, 0, -1);
+        }
+        if (tracer) {
+            tracer->record(TraceEventSend, -1, -1, -1, node->nodeId, port, pkg);
+        }
+        deliver(node, port, pkg, -1);
+        delivered++;
+        if (budgetSpent(node)) {
+            break;
+        }
+    }
+    return delivered;
+}
+
+void Network::sendFromOutput(int nodeId, int port, const Packet &pkg) {
+#ifdef MICROFLO_PROFILE
+    profiles[nodeId].sent++;
+#endif
+    const int last = firstOutgoing[nodeId+1];
+    for (int i=firstOutgoing[nodeId]; i<last; i++) {
+        const int connection = outgoing[i];
+        const int sourcePort = connections[connection].sourcePort;
+        if (sourcePort == port) {
+            queueMessage(connection, pkg);
+        } else if (sourcePort > port) {
+            break;
+        }
+    }
+}
+
+bool Network::postMessage(Component *node, int port, bool fromOutput, const Packet &pkg) {
+    IngressMessage msg;
+    msg.node = node;
+    msg.port = port;
+    msg.fromOutput = fromOutput;
+    msg.pkg = pkg;
+    if (pkg.isBuffer()) {
+        buffers.retain(pkg);
+    }
+    if (ingress.push(msg)) {
+        io->NotifyEvent();
+        return true;
+    }
+    if (pkg.isBuffer()) {
+        buffers.release(pkg);
+    }
+    return false;
+}
+
+bool Network::sendMessage(Component *target, int targetPort, const Packet &pkg, Component *sender, int senderPort) {
+    if (!target) {
+        return false;
+    }
+    return postMessage(target, targetPort, false, pkg);
+}
+
+bool Network::sendMessage(int targetId, int targetPort, const Packet &pkg) {
+    if (targetId < 0 || targetId >= lastAddedNodeIndex) {
+        return false;
+    }
+    return sendMessage(nodes[targetId], targetPort, pkg);
+}
+
+bool Network::sendInitialPacket(int targetId, int targetPort, const Packet &pkg) {
+    if (targetId < 0 || targetId >= lastAddedNodeIndex || targetPort < 0 || targetPort > 255) {
+        return false;
+    }
+    if (MAX_MESSAGES - queueStorageUsed - initialUsed < 2) {
+        return false;
+    }
+    if (pkg.isBuffer()) {
+        buffers.retain(pkg); // released by deliver()
+    }
+    queueStorage[MAX_MESSAGES-1-initialUsed] = Packet((long)(targetId*256 + targetPort));
+    queueStorage[MAX_MESSAGES-2-initialUsed] = pkg;
+    initialUsed += 2;
+    return true;
+}
+
+void Network::runSetup() {
+    for (int i=0; i<MAX_NODES; i++) {
+        if (nodes[i]) {
+            nodes[i]->process(Packet(MsgSetup), -1);
+        }
+    }
+}
+
+void Network::runTick(unsigned long budgetMicros) {
+
+    // TODO: consider the balance between scheduling and messaging (bounded-buffer problem)
+
+    // Completions are sent through the external queue, so they are delivered in this tick
+    io->PollCompletions();
+
+    if (executor) {
+        executor->runTick();
+    } else {
+        outOfTime = false;
+        tickTimed = budgetMicros > 0;
+        if (tickTimed) {
+            tickDeadline = io->TimerCurrentMicros() + budgetMicros;
+        }
+
+        if (ticksDeferred) {
+            ticksDeferred = false;
+            runTickSubscribers();
+        }
+        // Deliver messages
+        if (!outOfTime) {
+            if (tickBudget > 0) {
+                processMessagesToCompletion();
+            } else {
+                processMessages();
+            }
+            ticksDeferred = outOfTime;
+        }
+        // Schedule
+        if (!outOfTime && !ticksDeferred) {
+            runTickSubscribers();
+        }
+        tickTimed = false;
+    }
+
+    if (tracer && !hasQueuedMessages()) {
+        tracer->drain(); // only when idle, so tracing does not delay packets
+    }
+
+    if (sleepWhenIdle) {
+        sleepUntilNextEvent();
+    }
+}
+
+// Called after a process() call of @node in a timed tick
+bool Network::budgetSpent(Component *node) {
+    if (!tickTimed || (long)(io->TimerCurrentMicros() - tickDeadline) < 0) {
+        return false;
+    }
+    overruns[node->nodeId]++;
+    outOfTime = true;
+    tickTimed = false; // the rest of the tick was skipped, nothing more to check
+    return true;
+}
+
+int Network::findTickSubscription(Component *node) {
+    for (int i=0; i<tickSubscriptionCount; i++) {
+        if (tickSubscriptions[i].node == node) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void Network::subscribeTicks(Component *node, bool enable) {
+    timers.stop(node->nodeId, TICK_TIMER);
+    int index = findTickSubscription(node);
+    if (!enable) {
+        if (index >= 0) {
+            // Compacted after the current tick, in case we are inside runTickSubscribers()
+            tickSubscriptions[index].node = 0;
+        }
+        return;
+    }
+
+    if (index < 0) {
+        if (tickSubscriptionCount >= MAX_NODES) {
+            return;
+        }
+        index = tickSubscriptionCount++;
+    }
+    tickSubscriptions[index].node = node;
+}
+
+void Network::scheduleTick(Component *node, unsigned long deadline) {
+    subscribeTicks(node, false);
+    timers.start(node->nodeId, TICK_TIMER, deadline, 0, io->TimerCurrentMs());
+}
+
+void Network::runTimers() {
+    timers.advance(io->TimerCurrentMs());
+
+    // Timers which become due while firing wait for the next tick
+    for (int n=timers.dueCount(); n>0 && timers.dueCount()>0; n--) {
+        Component *node = nodes[timers.dueNode()];
+        if (node->blockedOutputs) {
+            timers.deferDue();
+            continue;
+        }
+        const int timer = timers.fireDue();
+        const Packet pkg = (timer == TICK_TIMER) ? Packet(MsgTick) : Packet((long)timer);
+        const int port = (timer == TICK_TIMER) ? -1 : TIMER_PORT;
+#ifdef MICROFLO_PROFILE
+        const unsigned long start = io->TimerCurrentMicros();
+        node->process(pkg, port);
+        profileCall(node->nodeId, start);
+#else
+        node->process(pkg, port);
+#endif
+        if (budgetSpent(node)) {
+            break;
+        }
+    }
+}
+
+void Network::runTickSubscribers() {
+    runTimers();
+
+    // Subscriptions added while ticking are not run until next time
+    const int count = tickSubscriptionCount;
+
+    // One pass per priority class, unless all nodes are Normal
+    const int passes = prioritiesUsed ? PRIORITY_CLASSES : 1;
+    const int start = (count > 0) ? resumeTick % count : 0;
+    for (int pass=0; pass<passes && !outOfTime; pass++) {
+    for (int n=0; n<count; n++) {
+        const int i = (start + n) % count;
+        Component *node = tickSubscriptions[i].node;
+        if (!node || node->blockedOutputs) {
+            continue;
+        }
+        if (prioritiesUsed && node->priority - PriorityHigh != pass) {
+            continue;
+        }
+#ifdef MICROFLO_PROFILE
+        const unsigned long start = io->TimerCurrentMicros();
+        node->process(Packet(MsgTick), -1);
+        profileCall(node->nodeId, start);
+#else
+        node->process(Packet(MsgTick), -1);
+#endif
+        if (budgetSpent(node)) {
+            resumeTick = (i + 1) % count;
+            break;
+        }
+    }
+    }
+
+    // Remove unsubscribed entries, keeping order
+    int write = 0;
+    int resume = 0;
+    for (int read=0; read<tickSubscriptionCount; read++) {
+        if (read == resumeTick) {
+            resume = write;
+        }
+        if (tickSubscriptions[read].node) {
+            tickSubscriptions[write++] = tickSubscriptions[read];
+        }
+    }
+    tickSubscriptionCount = write;
+    resumeTick = resume;
+}
+
+void Network::sleepUntilNextEvent() {
+    // Again, for operations started during this tick
+    const long completionTimeout = io->PollCompletions();
+    if (hasQueuedMessages() || tickSubscriptionCount > 0) {
+        return; // subscribers are ticked every time, never idle
+    }
+
+    long timeout = timers.nextTimeout(io->TimerCurrentMs());
+    if (timeout == 0) {
+        return;
+    }
+    if (completionTimeout >= 0 && (timeout < 0 || completionTimeout < timeout)) {
+        timeout = completionTimeout;
+    }
+    if (tracer) {
+        // Wake up to write out the records which did not fit in the serial port yet
+        const long traceTimeout = tracer->nextDrainMs();
+        if (traceTimeout >= 0 && (timeout < 0 || traceTimeout < timeout)) {
+            timeout = traceTimeout;
+        }
+    }
+    io->WaitForEvent(timeout);
+}
+
+void Network::connect(int srcId, int srcPort, int targetId, int targetPort,
+                      int capacity, OverflowPolicy policy) {
+    if (srcId < 0 || srcId >= lastAddedNodeIndex ||
+        targetId < 0 || targetId >= lastAddedNodeIndex) {
+        return;
+    }
+
+    connect(nodes[srcId], srcPort, nodes[targetId], targetPort, capacity, policy);
+}
+
+void Network::connect(Component *src, int srcPort, Component *target, int targetPort,
+                      int capacity, OverflowPolicy policy) {
+    if (!src || !target || src->network != this || srcPort < 0 || srcPort >= MAX_PORTS) {
+        return;
+    }
+
+    // Find the existing connection, or where a new one goes to keep outgoing[] ordered by port
+    const int node = src->nodeId;
+    int index = -1;
+    int position = firstOutgoing[node+1];
+    for (int i=firstOutgoing[node]; i<firstOutgoing[node+1]; i++) {
+        const Connection &existing = connections[outgoing[i]];
+        if (existing.sourcePort == srcPort && existing.target == target
+                && existing.targetPort == targetPort) {
+            index = outgoing[i];
+            break;
+        }
+        if (existing.sourcePort > srcPort) {
+            position = i;
+            break;
+        }
+    }
+
+    if (index >= 0) {
+        // Reconnecting, reuse the queue but not its contents
+        Connection &old = connections[index];
+        if (old.policy == OverflowBlock && old.isFull()) {
+            src->blockedOutputs--;
+        }
+        for (int i=0; i<old.size; i++) {
+            const Packet &queued = queueStorage[old.queueOffset + (old.head+i) % old.capacity];
+            if (queued.isBuffer()) {
+                buffers.release(queued);
+            }
+        }
+        old.size = 0;
+        old.head = 0;
+    } else {
+        if (connectionsUsed >= MAX_CONNECTIONS) {
+            return;
+        }
+        index = connectionsUsed++;
+        for (int i=connectionsUsed-1; i>position; i--) {
+            outgoing[i] = outgoing[i-1];
+        }
+        outgoing[position] = index;
+        for (int n=node+1; n<=lastAddedNodeIndex; n++) {
+            firstOutgoing[n]++;
+        }
+
+        Connection &c = connections[index];
+        if (policy == OverflowConflate) {
+            capacity = 1;
+        } else if (capacity <= 0) {
+            capacity = DEFAULT_QUEUE_CAPACITY;
+        }
+        const int available = MAX_MESSAGES - queueStorageUsed - initialUsed;
+        c.capacity = (capacity < available) ? capacity : available;
+        c.queueOffset = queueStorageUsed;
+        queueStorageUsed += c.capacity;
+        c.head = 0;
+        c.size = 0;
+        c.dropped = 0;
+        c.priority = PriorityDefault;
+    }
+#ifdef MICROFLO_PROFILE
+    connections[index].highWater = 0;
+#endif
+
+    Connection &c = connections[index];
+    c.source = src;
+    c.sourcePort = srcPort;
+    c.target = target;
+    c.targetPort = targetPort;
+    if (policy == OverflowDefault || policy >= OverflowMaxDefined) {
+        policy = OverflowBlock;
+    }
+    if (c.capacity == 0) {
+        policy = OverflowDropNewest; // storage exhausted, would block forever
+    }
+    c.policy = policy;
+    deliveryOrderValid = false;
+
+    if (nodeConnectNotify) {
+        nodeConnectNotify(src, srcPort, target, targetPort);
+    }
+    if (tracer) {
+        tracer->record(TraceEventConnect, index, src->nodeId, srcPort, target->nodeId, targetPort,
+                       Packet((long)c.capacity));
+    }
+}
+
+int Network::addNode(Component *node) {
+    if (!node || lastAddedNodeIndex >= MAX_NODES) {
+        return -1;
+    }
+    const int nodeId = lastAddedNodeIndex;
+    nodes[nodeId] = node;
+    firstOutgoing[nodeId+1] = firstOutgoing[nodeId];
+    node->setNetwork(this, nodeId, this->io);
+    if (node->ticksRequested) {
+        subscribeTicks(node, true);
+    }
+    if (addNodeNotify) {
+        addNodeNotify(node);
+    }
+    if (tracer) {
+        tracer->record(TraceEventAddNode, -1, nodeId, -1, -1, -1, Packet((long)node->componentId));
+    }
+    lastAddedNodeIndex++;
+    return nodeId;
+}
+
+void Network::reset() {
+    // Destroy in reverse order of creation, so the arena can be rewound
+    for (int i=lastAddedNodeIndex-1; i>=0; i--) {
+        Component *node = nodes[i];
+        nodes[i] = 0;
+        if (node) {
+            io->CancelCompletions(node);
+        }
+        if (node && node->created) {
+            Component::destroy(node);
+        }
+    }
+    lastAddedNodeIndex = 0;
+    firstOutgoing[0] = 0;
+    connectionsUsed = 0;
+    queueStorageUsed = 0;
+    initialUsed = 0;
+    initialDelivered = 0;
+    tickSubscriptionCount = 0;
+    timers.reset();
+    prioritiesUsed = false;
+    deliveryOrderValid = false;
+    ticksDeferred = false;
+    resumeTick = 0;
+    memset(overruns, 0, sizeof(overruns));
+
+    // Messages posted for the old graph would refer to destroyed nodes
+    while (!ingress.isEmpty()) {
+        ingress.pop();
+    }
+    if (executor) {
+        executor->reset();
+    }
+    buffers.reset();
+#ifdef MICROFLO_PROFILE
+    resetProfile();
+#endif
+}
+
+#ifdef MICROFLO_PROFILE
+void Network::profileCall(int nodeId, unsigned long startMicros) {
+    NodeProfile &p = profiles[nodeId];
+    const uint32_t elapsed = io->TimerCurrentMicros() - startMicros;
+    p.calls++;
+    p.totalMicros += elapsed;
+    if (elapsed > p.maxMicros) {
+        p.maxMicros = elapsed;
+    }
+}
+
+void Network::resetProfile() {
+    memset(profiles, 0, sizeof(profiles));
+    for (int i=0; i<connectionsUsed; i++) {
+        connections[i].highWater = connections[i].size;
+    }
+}
+
+// Writes the @bytes low bytes of @value, little-endian
+static uint16_t writeProfileValue(IO *io, int serialDevice, uint16_t crc, unsigned long value, int bytes) {
+    for (int i=0; i<bytes; i++) {
+        const unsigned char b = (value >> (8*i)) & 0xFF;
+        io->SerialWrite(serialDevice, b);
+        crc = crc16Update(crc, b);
+    }
+    return crc;
+}
+
+void Network::writeProfile(int serialDevice) {
+    uint16_t crc = 0xFFFF;
+    io->SerialWrite(serialDevice, PROFILE_MARKER);
+    crc = writeProfileValue(io, serialDevice, crc, lastAddedNodeIndex, 2);
+    crc = writeProfileValue(io, serialDevice, crc, connectionsUsed, 2);
+    for (int i=0; i<lastAddedNodeIndex; i++) {
+        const NodeProfile &p = profiles[i];
+        crc = writeProfileValue(io, serialDevice, crc, p.calls, 4);
+        crc = writeProfileValue(io, serialDevice, crc, p.totalMicros, 4);
+        crc = writeProfileValue(io, serialDevice, crc, p.maxMicros, 4);
+        crc = writeProfileValue(io, serialDevice, crc, p.received, 4);
+        crc = writeProfileValue(io, serialDevice, crc, p.sent, 4);
+    }
+    for (int i=0; i<connectionsUsed; i++) {
+        const Connection &c = connections[i];
+        crc = writeProfileValue(io, serialDevice, crc, c.capacity, 2);
+        crc = writeProfileValue(io, serialDevice, crc, c.highWater, 2);
+        crc = writeProfileValue(io, serialDevice, crc, c.dropped, 4);
+    }
+    io->SerialWrite(serialDevice, crc & 0xFF);
+    io->SerialWrite(serialDevice, crc >> 8);
+}
+#endif
+
+#ifdef ARDUINO
+IngressQueue::IngressQueue()
+    : writeIndex(0)
+    , readIndex(0)
+    , droppedCount(0)
+{
+}
+
+bool IngressQueue::push(const IngressMessage &msg) {
+    bool pushed = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        const unsigned char next = (writeIndex+1) % MAX_EXTERNAL_MESSAGES;
+        if (next == readIndex) {
+            droppedCount++;
+        } else {
+            slots[writeIndex] = msg;
+            writeIndex = next;
+            pushed = true;
+        }
+    }
+    return pushed;
+}
+
+IngressMessage *IngressQueue::front() {
+    // single byte reads are atomic, and the producer updates writeIndex last
+    return (readIndex == writeIndex) ? 0 : &slots[readIndex];
+}
+
+void IngressQueue::pop() {
+    readIndex = (readIndex+1) % MAX_EXTERNAL_MESSAGES;
+}
+
+bool IngressQueue::isEmpty() {
+    return readIndex == writeIndex;
+}
+#else
+// Bounded MPMC queue by Dmitry Vyukov, with a single consumer.
+// A slot is free for the producer claiming position p when sequence == p,
+// and ready for the consumer at position p when sequence == p+1
+IngressQueue::IngressQueue()
+    : writeIndex(0)
+    , readIndex(0)
+    , droppedCount(0)
+{
+    for (int i=0; i<MAX_EXTERNAL_MESSAGES; i++) {
+        sequence[i] = i;
+    }
+}
+
+bool IngressQueue::push(const IngressMessage &msg) {
+    unsigned int pos = __atomic_load_n(&writeIndex, __ATOMIC_RELAXED);
+    for (;;) {
+        const unsigned int seq = __atomic_load_n(&sequence[pos % MAX_EXTERNAL_MESSAGES], __ATOMIC_ACQUIRE);
+        const int diff = (int)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&writeIndex, &pos, pos+1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&droppedCount, 1, __ATOMIC_RELAXED);
+            return false;
+        } else {
+            pos = __atomic_load_n(&writeIndex, __ATOMIC_RELAXED);
+        }
+    }
+    slots[pos % MAX_EXTERNAL_MESSAGES] = msg;
+    __atomic_store_n(&sequence[pos % MAX_EXTERNAL_MESSAGES], pos+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+IngressMessage *IngressQueue::front() {
+    const unsigned int seq = __atomic_load_n(&sequence[readIndex % MAX_EXTERNAL_MESSAGES], __ATOMIC_ACQUIRE);
+    return (seq == readIndex+1) ? &slots[readIndex % MAX_EXTERNAL_MESSAGES] : 0;
+}
+
+void IngressQueue::pop() {
+    __atomic_store_n(&sequence[readIndex % MAX_EXTERNAL_MESSAGES], readIndex+MAX_EXTERNAL_MESSAGES,
+                     __ATOMIC_RELEASE);
+    readIndex++;
+}
+
+bool IngressQueue::isEmpty() {
+    return front() == 0;
+}
+#endif
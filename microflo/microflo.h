@@ -7,6 +7,7 @@
 #define MICROFLO_H
 
 #include <stdint.h>
+#include <limits.h>
 
 #ifdef ARDUINO
 #include <Arduino.h>
@@ -22,20 +23,23 @@ public:
 };
 
 // Packet
-// TODO: implement a proper variant type, or type erasure
+// A one byte type tag and 32 bits of data, packed to 5 bytes on all platforms.
+// Integers are stored as 32 bit, also on hosts where long is 64 bit.
+// A MsgBuffer packet refers to a block in the BufferPool of the Network, see below
 // XXX: should setup & ticks really be IPs??
 class Packet {
+    friend class BufferPool;
 
 public:
-    Packet(): msg(MsgVoid) {}
-    Packet(bool b): msg(MsgBoolean) { data.boolean = b; }
-    Packet(char c): msg(MsgAscii) { data.ch = c; }
-    Packet(unsigned char by): msg(MsgByte) { data.byte = by; }
+    Packet(): msg(MsgVoid) { data.lng = 0; }
+    Packet(bool b): msg(MsgBoolean) { data.lng = 0; data.boolean = b; }
+    Packet(char c): msg(MsgAscii) { data.lng = 0; data.ch = c; }
+    Packet(unsigned char by): msg(MsgByte) { data.lng = 0; data.byte = by; }
     Packet(long l): msg(MsgInteger) { data.lng = l; }
     Packet(float f): msg(MsgFloat) { data.flt = f; }
-    Packet(Msg m): msg(m) {}
+    Packet(Msg m): msg(m) { data.lng = 0; }
 
-    Msg type() const { return msg; }
+    Msg type() const { return (Msg)msg; }
     bool isValid() const { return msg > MsgInvalid && msg < MsgMaxDefined; }
 
     bool isSetup() const { return msg == MsgSetup; }
@@ -53,6 +57,11 @@ public:
     bool isInteger() const { return msg == MsgInteger; } // TODO: make into a long or long long
     bool isFloat() const { return msg == MsgFloat; }
     bool isNumber() const { return isInteger() || isFloat(); }
+    bool isBuffer() const { return msg == MsgBuffer; }
+
+    // For MsgBuffer. Text is expanded to MsgAscii by the bracketed stream adapter, else MsgByte
+    int bufferLength() const { return isBuffer() ? data.buffer.length : 0; }
+    bool isText() const { return isBuffer() && data.buffer.text; }
 
     bool asBool() const ;
     float asFloat() const ;
@@ -67,16 +76,82 @@ private:
         bool boolean;
         char ch;
         unsigned char byte;
-        long lng;
+        int32_t lng;
         float flt;
+        struct {
+            uint8_t block;
+            uint8_t text;
+            uint16_t length;
+        } buffer;
     } data;
-    enum Msg msg;
+    uint8_t msg; // enum Msg
+} __attribute__((packed));
+
+// Buffers
+#ifdef HOST_BUILD
+const int MAX_BUFFERS = 64;
+const int BUFFER_SIZE = 256;
+#else
+const int MAX_BUFFERS = 4;
+const int BUFFER_SIZE = 20; // fits the longest ToString output
+#endif
+
+// Fixed-size blocks for MsgBuffer packets, so a string or byte array travels as one message
+// instead of a bracketed stream of one message per byte.
+// Blocks are reference counted: the allocating component holds one reference, and the
+// Network takes one per queued copy, released after delivery. A receiver may only use the
+// data during process(); forwarding the packet with send() keeps it alive.
+// Allocate and release from the thread running the Network only, not from interrupts
+class BufferPool {
+public:
+    BufferPool();
+
+    // Returns a MsgBuffer with room for @length bytes and one reference owned by the caller,
+    // or MsgVoid if @length is larger than BUFFER_SIZE or all blocks are in use
+    Packet allocate(int length, bool text=false);
+    void retain(const Packet &pkg);
+    void release(const Packet &pkg);
+    unsigned char *data(const Packet &pkg) { return blocks[pkg.data.buffer.block]; }
+
+    int available() const;
+    // Free all blocks, for Network::reset()
+    void reset();
+private:
+    unsigned char blocks[MAX_BUFFERS][BUFFER_SIZE];
+#ifdef HOST_BUILD
+    unsigned int refs[MAX_BUFFERS];
+#else
+    volatile unsigned char refs[MAX_BUFFERS];
+#endif
 };
 
 // Network
+#ifdef HOST_BUILD
+// Simulations on host can be much larger than what fits on a microcontroller
+const int MAX_NODES = 1000;
+const int MAX_MESSAGES = 16000; // shared by all connection queues
+const int MAX_CONNECTIONS = 4000;
+typedef short ConnectionIndex;
+typedef unsigned short QueueIndex;
+#else
 const int MAX_NODES = 20;
-const int MAX_MESSAGES = 50;
+const int MAX_MESSAGES = 50; // shared by all connection queues
+const int MAX_CONNECTIONS = 30;
+typedef signed char ConnectionIndex;
+typedef unsigned char QueueIndex;
+#endif
+#ifdef ARDUINO
+const int MAX_EXTERNAL_MESSAGES = 20; // for packets from outside the network, like IIPs and interrupts
+#else
+const int MAX_EXTERNAL_MESSAGES = 32; // must be a power of two
+#endif
 const int MAX_PORTS = 20;
+const int IO_COMPLETION_PORT = -2; // input port of completions, see Component::ioCompletion()
+const int TIMER_PORT = -3; // input port of timer packets, see Component::startTimer()
+const int DEFAULT_QUEUE_CAPACITY = 4;
+const int PRIORITY_CLASSES = PriorityMaxDefined - PriorityHigh; // High, Normal and Low
+// With a tick budget, lower classes with queued packets get at least 1/PRIORITY_RESERVE of what is left
+const int PRIORITY_RESERVE = 4;
 
 class Component;
 
@@ -84,64 +159,370 @@ struct Message {
     Component *target;
     char targetPort;
     Packet pkg;
+} __attribute__((packed));
+
+// An edge from an output port to an input port, with its own bounded FIFO.
+// The queue is a slice of the Network message storage, assigned on connect
+struct Connection {
+    Component *source;
+    Component *target;
+    signed char sourcePort;
+    signed char targetPort;
+    unsigned char policy; // OverflowPolicy
+    unsigned char priority; // Priority, PriorityDefault follows the target node
+    QueueIndex queueOffset;
+    QueueIndex capacity;
+    QueueIndex head;
+    QueueIndex size;
+    unsigned int dropped;
+#ifdef MICROFLO_PROFILE
+    QueueIndex highWater; // largest size since connected
+#endif
+
+    bool isFull() const { return size >= capacity; }
+};
+
+#ifdef MICROFLO_PROFILE
+const unsigned char PROFILE_MARKER = 0xA6;
+
+// Counters kept per node by the Network when built with MICROFLO_PROFILE, else compiled out.
+// Times are from IO::TimerCurrentMicros() around process(), and include the time spent
+// queueing what the node sends. The total wraps around after about 71 minutes
+struct NodeProfile {
+    uint32_t calls; // of process(), for packets and ticks
+    uint32_t totalMicros;
+    uint32_t maxMicros;
+    uint32_t received; // packets delivered
+    uint32_t sent; // packets sent from output ports, once per send() regardless of fan-out
+};
+#endif
+
+
+// A packet from outside the network. Either directly to an input port of @node,
+// or (if @fromOutput) sent from an output port of @node through its connection
+struct IngressMessage {
+    Component *node;
+    signed char port;
+    bool fromOutput;
+    Packet pkg;
 };
 
+// Multi-producer, single-consumer queue used by interrupts, other threads and the host
+// to inject packets. Consumed by the thread running Network::runTick(), which splices
+// the messages into delivery in a batch. Lock-free using atomic sequence numbers on host,
+// and by masking interrupts during push on AVR. Full queue drops (and counts) the message
+class IngressQueue {
+public:
+    IngressQueue();
+
+    // Safe from any thread or interrupt
+    bool push(const IngressMessage &msg);
+    unsigned int dropped() const { return droppedCount; }
+
+    // Consumer only
+    IngressMessage *front();
+    void pop();
+    bool isEmpty();
+private:
+    IngressMessage slots[MAX_EXTERNAL_MESSAGES];
+#ifdef ARDUINO
+    volatile unsigned char writeIndex;
+    volatile unsigned char readIndex;
+#else
+    unsigned int sequence[MAX_EXTERNAL_MESSAGES];
+    unsigned int writeIndex;
+    unsigned int readIndex;
+#endif
+    volatile unsigned int droppedCount;
+};
 
 typedef void (*AddNodeNotification)(Component *);
 typedef void (*NodeConnectNotification)(Component *src, int srcPort, Component *target, int targetPort);
 typedef void (*MessageSendNotification)(int, Message, Component *, int);
 typedef void (*MessageDeliveryNotification)(int, Message);
 
+// Only components that subscribe get MsgTick. Ticks at a deadline are timers, see TimerWheel
+struct TickSubscription {
+    Component *node; // NULL if removed during iteration
+};
+
+// Timers
+// Hierarchical timer wheel owned by the Network. Level L has TIMER_WHEEL_SLOTS slots of
+// TIMER_WHEEL_SLOTS^L ms each. A timer sits at the level of the highest digit in which its
+// deadline differs from the wheel time, and moves down when the wheel reaches that digit,
+// so starting, stopping and expiring a timer cost the same however many are running.
+// Deadlines past the top level wait in an overflow list, looked at once per turn of it
+#ifdef HOST_BUILD
+const int MAX_TIMERS = 2*MAX_NODES;
+const int TIMER_WHEEL_BITS = 6;
+typedef short TimerIndex;
+typedef uint64_t TimerSlotMask;
+#else
+const int MAX_TIMERS = 8;
+const int TIMER_WHEEL_BITS = 4;
+typedef signed char TimerIndex;
+typedef uint16_t TimerSlotMask;
+#endif
+const int TIMER_WHEEL_LEVELS = 4;
+const int TIMER_WHEEL_SLOTS = 1 << TIMER_WHEEL_BITS;
+const int TICK_TIMER = -1; // the timer behind Component::scheduleTick()
+
+class TimerWheel {
+public:
+    TimerWheel() { reset(); }
+    void reset();
+
+    // Timer @id of node @nodeId expires at @deadline, and then every @period ms unless
+    // that is 0. Replaces the timer if running. Returns false if all timers are in use
+    bool start(int nodeId, int id, unsigned long deadline, unsigned long period, unsigned long now);
+    void stop(int nodeId, int id);
+    // Moves the timers which have expired by @now to the due list, in deadline order
+    void advance(unsigned long now);
+    // Ms from @now until advance() has something to do, which may be before the next
+    // deadline. 0 if timers are due, -1 if none are running
+    long nextTimeout(unsigned long now) const;
+
+    // The due timers, first one first
+    int dueCount() const { return dueTimers; }
+    int dueNode() const { return timers[lists[DUE_LIST]].nodeId; }
+    // Takes the first due timer and returns its id. Periodic timers start over, missing
+    // the periods which have passed already, the others are stopped
+    int fireDue();
+    // Puts the first due timer last
+    void deferDue();
+private:
+    enum {
+        DUE_LIST = TIMER_WHEEL_LEVELS*TIMER_WHEEL_SLOTS, // slots come first
+        OVERFLOW_LIST,
+        FREE_LIST,
+        LISTS
+    };
+    struct Timer {
+        unsigned long deadline;
+        unsigned long period;
+        short nodeId;
+        short id;
+        TimerIndex next; // in its list
+        TimerIndex prev;
+        TimerIndex nextOfNode;
+        TimerIndex list; // a slot or one of the lists above
+    };
+    TimerIndex find(int nodeId, int id) const;
+    void place(TimerIndex t);
+    void link(TimerIndex t, int list);
+    void unlink(TimerIndex t);
+    void release(TimerIndex t);
+    void moveAll(int list);
+    bool nextEvent(unsigned long *time) const;
+
+    Timer timers[MAX_TIMERS];
+    TimerIndex lists[LISTS];
+    TimerIndex dueLast;
+    TimerIndex nodeTimers[MAX_NODES];
+    TimerSlotMask occupied[TIMER_WHEEL_LEVELS];
+    unsigned long current; // everything up to here has expired
+    int running;
+    int dueTimers;
+};
+
+class Network;
+
+// Statically wired graph
+// With MICROFLO_STATIC_GRAPH, the graph is compiled into the firmware by 'microflo.js compile'
+// instead of being streamed in at boot. The generated code defines these:
+#ifdef MICROFLO_STATIC_GRAPH
+// Adds the nodes, the queued connections and the IIPs
+void microfloStaticSetup(Network *network);
+// Delivers @pkg from output @port of node @nodeId by calling the target directly.
+// Returns false if the edge is queued by the Network instead (edges in cycles)
+bool microfloStaticSend(int nodeId, int port, const Packet &pkg);
+#endif
+
+// Executor
+// Takes over packet delivery and scheduling from Network::runTick(). The default
+// (no executor) is single-threaded delivery inside Network itself.
+// Chosen at Network construction. See host-only WorkStealingExecutor in executor.hpp
+class Executor {
+public:
+    virtual ~Executor() {}
+    virtual void attach(Network *net) = 0;
+    // Called from Component::send(), in place of the Network connection queues
+    virtual void queueMessage(int connection, const Packet &pkg) = 0;
+    virtual void runTick() = 0;
+    virtual bool hasQueuedMessages() = 0;
+    // Network::reset() was called, forget all nodes and connections
+    virtual void reset() = 0;
+};
+
 class IO;
+class Tracer;
 class Network {
+    friend class Component;
+    friend class WorkStealingExecutor;
+    friend class GraphStreamer;
 public:
-    Network(IO *io);
+    Network(IO *io, Executor *executor=0);
 
+    // Remove all nodes and connections, discarding queued messages.
+    // Nodes made by Component::create() are destroyed, others are left to their owner
     void reset();
     int addNode(Component *node);
-    void connect(Component *src, int srcPort, Component *target, int targetPort);
-    void connect(int srcId, int srcPort, int targetId, int targetPort);
-
-    void sendMessage(Component *target, int targetPort, const Packet &pkg,
+    // An output port may be connected to any number of inputs, each connection has its own queue.
+    // Connecting the same ports again reconfigures the existing connection and empties its queue.
+    // A @capacity of 0 means DEFAULT_QUEUE_CAPACITY, limited by the free message storage.
+    // OverflowBlock (the default) defers processing of the sender while the queue is full.
+    // OverflowConflate keeps only the newest packet, in a queue of one
+    void connect(Component *src, int srcPort, Component *target, int targetPort,
+                 int capacity=0, OverflowPolicy policy=OverflowDefault);
+    void connect(int srcId, int srcPort, int targetId, int targetPort,
+                 int capacity=0, OverflowPolicy policy=OverflowDefault);
+
+    // Send directly to a node, not through a connection. Dropped if the external queue is full.
+    // Safe to call from interrupts and other threads. Returns false if the packet was not queued
+    bool sendMessage(Component *target, int targetPort, const Packet &pkg,
                      Component *sender=0, int senderPort=-1);
-    void sendMessage(int targetId, int targetPort, const Packet &pkg);
+    bool sendMessage(int targetId, int targetPort, const Packet &pkg);
+    // Initial information packet, sent while loading a graph. Not limited by the external
+    // queue: kept in the message storage until delivered, in order, at the start of the next tick.
+    // Not safe from interrupts. Returns false if the target does not exist or storage is full
+    bool sendInitialPacket(int targetId, int targetPort, const Packet &pkg);
 
     void setNotifications(MessageSendNotification send,
                           MessageDeliveryNotification deliver,
                           NodeConnectNotification nodeConnect,
                           AddNodeNotification addNode);
+    // Record sends, deliveries and graph changes in @tracer, drained when idle. NULL to stop
+    void setTracer(Tracer *t) { tracer = t; }
+
+    // When enabled, runTick() puts the device to sleep (through IO::WaitForEvent)
+    // until the next timer if no messages are queued and no node subscribes to every tick.
+    // Off by default, since the caller might inject messages from the same thread
+    void setSleepWhenIdle(bool enable) { sleepWhenIdle = enable; }
+
+    // Run-to-completion: when @budget > 0, runTick() also delivers the packets sent during
+    // delivery, until no packets are queued or @budget packets were delivered. A packet then
+    // crosses a chain of nodes in one tick. The budget keeps cycles in the graph from
+    // running forever. 0 (the default) delivers only what was queued when the tick started.
+    // Not used with an Executor, which has its own budget
+    void setRunToCompletion(long budget) { tickBudget = budget; }
+
+    // Priority classes. Queues are served in class order in every tick, High first,
+    // and tick subscribers are ticked in the class order of their node. Nodes are Normal,
+    // and edges follow their target node unless set. Within a class the order is by index.
+    // In run-to-completion mode, a class is drained again whenever a lower class has run,
+    // but lower classes keep a reserve of the budget so that a busy cycle cannot starve them.
+    // Not used with an Executor
+    void setPriority(int nodeId, Priority priority);
+    void setPriority(int srcId, int srcPort, int targetId, int targetPort, Priority priority);
+
+    // Queue introspection, for instance to read out drop counters
+    int connectionCount() const { return connectionsUsed; }
+    const Connection &connectionAt(int index) const { return connections[index]; }
+    unsigned int externalMessagesDropped() const { return ingress.dropped(); }
+    // Free blocks for MsgBuffer packets
+    int buffersAvailable() const { return buffers.available(); }
+    int nodeCount() const { return lastAddedNodeIndex; }
+    // Times a process() call of the node ended past the deadline of runTick(budgetMicros)
+    unsigned int nodeOverruns(int nodeId) const { return overruns[nodeId]; }
+
+#ifdef MICROFLO_PROFILE
+    // Cleared by reset() and resetProfile(). Queue high-water marks are in the connections
+    const NodeProfile &nodeProfile(int nodeId) const { return profiles[nodeId]; }
+    void resetProfile();
+    // Binary snapshot of all counters, see profileSnapshot in commandformat.json
+    void writeProfile(int serialDevice);
+#endif
 
     void runSetup();
-    void runTick();
+    // With @budgetMicros > 0, delivery and ticking stop at the first process() call which
+    // ends after the budget is spent, and that node gets an overrun. The next tick resumes
+    // after the connection or tick subscriber it stopped at, round-robin, and starts with
+    // the tick subscribers if delivery used up the previous budget. A single slow call
+    // still takes as long as it takes. 0 (the default) runs until done
+    void runTick(unsigned long budgetMicros=0);
 private:
-    void deliverMessages(int firstIndex, int lastIndex);
+    void deliver(Component *target, int targetPort, const Packet &pkg, int index);
     void processMessages();
+    void processMessagesToCompletion();
+    long drainClass(int priorityClass, long limit);
+    bool hasQueuedMessages(int firstClass, int lastClass);
+    void deliverNext(int connection);
+    int priorityClass(const Connection &c) const;
+    void updateDeliveryOrder();
+    bool hasQueuedMessages();
+    void queueMessage(int connection, const Packet &pkg);
+    void sendFromOutput(int nodeId, int port, const Packet &pkg);
+    bool postMessage(Component *node, int port, bool fromOutput, const Packet &pkg);
+    long spliceIngress(long limit=LONG_MAX);
+    long deliverInitialPackets(long limit);
+    void runTickSubscribers();
+    void runTimers();
+    bool budgetSpent(Component *node);
+    void sleepUntilNextEvent();
+
+    void subscribeTicks(Component *node, bool enable);
+    void scheduleTick(Component *node, unsigned long deadline);
+    int findTickSubscription(Component *node);
+#ifdef MICROFLO_PROFILE
+    void profileCall(int nodeId, unsigned long startMicros);
+#endif
 
 private:
     Component *nodes[MAX_NODES];
     int lastAddedNodeIndex;
-    Message messages[MAX_MESSAGES];
-    int messageWriteIndex;
-    int messageReadIndex;
+    Connection connections[MAX_CONNECTIONS];
+    int connectionsUsed;
+    // Outgoing connections per node, in compressed sparse row form. Those of node n are
+    // outgoing[firstOutgoing[n]] up to (not including) outgoing[firstOutgoing[n+1]], by source port
+    ConnectionIndex outgoing[MAX_CONNECTIONS];
+    ConnectionIndex firstOutgoing[MAX_NODES+1];
+    Packet queueStorage[MAX_MESSAGES];
+    int queueStorageUsed;
+    // IIPs take two slots each from the end of @queueStorage, a header holding the target
+    // and the packet itself, see sendInitialPacket()
+    int initialUsed;
+    int initialDelivered;
+    IngressQueue ingress;
+    BufferPool buffers;
     MessageSendNotification messageSentNotify;
     MessageDeliveryNotification messageDeliveredNotify;
     AddNodeNotification addNodeNotify;
     NodeConnectNotification nodeConnectNotify;
+    TickSubscription tickSubscriptions[MAX_NODES];
+    int tickSubscriptionCount;
+    TimerWheel timers;
+    bool sleepWhenIdle;
+    long tickBudget;
+    // Connection indexes ordered by priority class, and where each class starts
+    ConnectionIndex deliveryOrder[MAX_CONNECTIONS];
+    ConnectionIndex firstOfClass[PRIORITY_CLASSES+1];
+    ConnectionIndex resumeInClass[PRIORITY_CLASSES]; // where the budget ran out
+    bool prioritiesUsed;
+    bool deliveryOrderValid; // else updated before the next delivery
+    // Time budget of the current tick, see runTick()
+    bool tickTimed;
+    bool outOfTime;
+    bool ticksDeferred; // delivery ran out of time, tick subscribers go first next time
+    unsigned long tickDeadline;
+    int resumeTick; // tick subscription to start at
+    unsigned int overruns[MAX_NODES];
+    Executor *executor;
+    Tracer *tracer;
     IO *io;
+#ifdef MICROFLO_PROFILE
+    NodeProfile profiles[MAX_NODES];
+#endif
 };
 
-struct Connection {
-    Component *target;
-    char targetPort;
-};
-
-class Debugger;
-
 // IO interface for components
 // Used to move the sideeffects of I/O components out of the component,
 // to allow different target implementations, and to let tests inject mocks
 
 typedef void (*IOInterruptFunction)(void *user);
+// Called when an asynchronous IO operation has finished, @ok is false if it failed
+typedef void (*IOCompletionFunction)(void *user, bool ok);
+
+const float ONEWIRE_NO_SENSOR = -127; // like DallasTemperature
 
 class IO {
 public:
@@ -152,6 +533,11 @@ public:
     virtual long SerialDataAvailable(int serialDevice) = 0;
     virtual unsigned char SerialRead(int serialDevice) = 0;
     virtual void SerialWrite(int serialDevice, unsigned char b) = 0;
+    // Bulk transfers, which never block. Reading returns how many bytes were put in @buffer,
+    // up to @length, and gives all that SerialDataAvailable() counted. Writing returns how
+    // many bytes of @buffer the transmit buffer took, which is fewer when it is full
+    virtual long SerialRead(int serialDevice, unsigned char *buffer, long length) = 0;
+    virtual long SerialWrite(int serialDevice, const unsigned char *buffer, long length) = 0;
 
     // Pin config
     enum PinMode {
@@ -175,6 +561,15 @@ public:
 
     // Timer
     virtual long TimerCurrentMs() = 0;
+    // For measuring short durations. Wraps around, after about 71 minutes on the device
+    virtual unsigned long TimerCurrentMicros() = 0;
+
+    // Power management
+    // Block until an interrupt or external event occurs, or at most timeoutMs.
+    // A timeoutMs of -1 means no deadline. Spurious wakeups are allowed
+    virtual void WaitForEvent(long timeoutMs) = 0;
+    // Make a pending WaitForEvent() return. Safe to call from interrupts/other threads
+    virtual void NotifyEvent() = 0;
 
     // Interrupts
     struct Interrupt {
@@ -190,6 +585,152 @@ public:
     // XXX: user responsible for mapping pin number to interrupt number
     virtual void AttachExternalInterrupt(int interrupt, IO::Interrupt::Mode mode,
                                          IOInterruptFunction func, void *user) = 0;
+    virtual void DetachExternalInterrupt(int interrupt) = 0;
+
+    // Asynchronous operations, for devices which take long to answer. Starting one returns
+    // at once, and its IOCompletionFunction is called from a later PollCompletions().
+    // Components use Component::ioCompletion to get the outcome as a packet
+    //
+    // Called by the Network on every tick. Returns the ms until the next pending operation
+    // may finish, for sleeping until then, or -1 if none are pending
+    virtual long PollCompletions() = 0;
+    // Forget the pending operations of @user, which is going away. Its function is not called
+    virtual void CancelCompletions(void *user) = 0;
+
+    // OneWire temperature sensors (DS18x20). Starts one conversion on all the sensors on
+    // the bus at @pin, with @resolution bits, which takes up to 750 ms at 12 bits.
+    // Joins the conversion already running on that bus, if any
+    virtual void OneWireStartConversion(int pin, int resolution, IOCompletionFunction done, void *user) = 0;
+    // Celcius, from the last completed conversion. ONEWIRE_NO_SENSOR if not on the bus
+    virtual float OneWireTemperature(int pin, const unsigned char address[8]) = 0;
+};
+
+// Time a DS18x20 conversion takes with @resolution bits, clamped to 9..12, as in the datasheet
+inline long oneWireConversionMillis(int resolution) {
+    resolution = (resolution < 9) ? 9 : (resolution > 12) ? 12 : resolution;
+    return 750 >> (12 - resolution);
+}
+
+// Pending asynchronous operations of an IO implementation, each finishing at a deadline.
+// Operations with the same @key (like the pin of a bus) are done together
+#ifdef HOST_BUILD
+const int MAX_PENDING_IO = 32;
+#else
+const int MAX_PENDING_IO = 4;
+#endif
+class IOCompletions {
+public:
+    IOCompletions() : count(0) {}
+
+    // Waits for the operation already pending for @key, returns false if there is none
+    bool join(int key, IOCompletionFunction done, void *user);
+    // An operation started at @nowMs. If too many are pending, @done is called with false at once
+    void add(int key, unsigned long nowMs, long durationMs, bool ok, IOCompletionFunction done, void *user);
+    // For IO::PollCompletions() and IO::CancelCompletions()
+    long poll(unsigned long nowMs);
+    void cancel(void *user);
+private:
+    struct Pending {
+        int key;
+        unsigned long deadline;
+        bool ok;
+        IOCompletionFunction done;
+        void *user;
+    };
+    Pending pending[MAX_PENDING_IO];
+    int count;
+};
+
+#ifdef HOST_BUILD
+// Simulated OneWire temperature sensors, for host IO implementations. A conversion takes
+// as long as on a DS18B20 for the resolution, unless set with setConversionMs(), and reads
+// the temperatures as they were when it was started. Before that, sensors read 85 C
+class OneWireMock {
+public:
+    static const int MAX_SENSORS = 16;
+
+    OneWireMock() : sensorCount(0), conversionMs(-1) {}
+
+    // Adds the sensor to the bus at @pin, if not there yet
+    void setTemperature(int pin, const unsigned char address[8], float celcius);
+    // -1 for the time taken by a DS18B20
+    void setConversionMs(long ms) { conversionMs = ms; }
+    // Returns how long the conversion takes, or -1 if there are no sensors at @pin
+    long startConversion(int pin, int resolution);
+    float temperature(int pin, const unsigned char address[8]) const;
+private:
+    struct Sensor {
+        int pin;
+        unsigned char address[8];
+        float current;
+        float converted;
+    };
+    int find(int pin, const unsigned char address[8]) const;
+
+    Sensor sensors[MAX_SENSORS];
+    int sensorCount;
+    long conversionMs;
+};
+#endif
+
+// Tracing
+#ifdef HOST_BUILD
+const int TRACE_RING_SIZE = 1024; // records
+#else
+const int TRACE_RING_SIZE = 8;
+#endif
+const unsigned char TRACE_MARKER = 0xA5;
+const int TRACE_DRAIN_BURST = 32; // bytes, half of the Arduino serial transmit buffer
+
+// One network event. On the wire, after TRACE_MARKER, as is (little-endian).
+// Node and connection -1 are sent as 0xFFFF. Time is the low 16 bits of TimerCurrentMs()
+struct TraceRecord {
+    uint8_t event; // TraceEvent
+    uint16_t connection;
+    uint16_t time;
+    uint16_t srcNode;
+    uint8_t srcPort;
+    uint16_t dstNode;
+    uint8_t dstPort;
+    Packet pkg;
+} __attribute__((packed));
+
+// Records network events into a ring in RAM, written out as binary by drain(), which
+// Network::runTick() calls when there are no queued messages. Recording never blocks or
+// formats anything: when the ring is full the record is dropped and counted, and a Dropped
+// record goes out once there is room. drain() writes only as many bytes as the serial port
+// has sent since the previous call at @baudrate, so the transmit buffer never fills up
+// and SerialWrite() does not block. Decoded by TraceDecoder in microflo.js
+class Tracer {
+public:
+    Tracer(IO *io, int serialDevice=0, long baudrate=9600);
+    void record(TraceEvent event, int connection, int srcNode, int srcPort,
+                int dstNode, int dstPort, const Packet &pkg);
+    void drain();
+    // Milliseconds until drain() can write the next record, -1 if there is none
+    long nextDrainMs() const;
+    unsigned long dropped() const { return droppedTotal; }
+
+private:
+    void push(const TraceRecord &r);
+    void pushDroppedReport(uint16_t time);
+    void lock();
+    void unlock();
+
+private:
+    IO *io;
+    int serialDevice;
+    long bytesPerSecond;
+    long lastDrainMs;
+    long budget; // thousandths of bytes which can be written without blocking
+    TraceRecord ring[TRACE_RING_SIZE];
+    unsigned int head;
+    unsigned int size;
+    unsigned int droppedSinceReport;
+    unsigned long droppedTotal;
+#ifdef HOST_BUILD
+    bool busy; // with a multi-threaded Executor, records come from the worker threads
+#endif
 };
 
 // Component
@@ -197,21 +738,69 @@ public:
 // IDEA: a decentral way of declaring component introspection data. JSON embedded in comment?
 class Component {
     friend class Network;
-    friend class Debugger;
+    friend class WorkStealingExecutor;
+#ifdef MICROFLO_STATIC_GRAPH
+    friend void microfloStaticSetup(Network *network);
+    friend bool microfloStaticSend(int nodeId, int port, const Packet &pkg);
+#endif
 public:
+    Component();
+    virtual ~Component() {}
+    // Components are constructed in a fixed arena, see components.cpp.
+    // Returns NULL if @id is invalid or the arena is full
     static Component *create(ComponentId id);
-    virtual void process(Packet in, int port) = 0;
+    static void destroy(Component *c);
+    virtual void process(const Packet &in, int port) = 0;
+    // Whether @port handles MsgBuffer in process(). For other ports the Network expands
+    // buffers to a bracketed stream of bytes. Generated from "buffers" in components.json
+    virtual bool acceptsBuffers(int port) const;
 protected:
-    void send(Packet out, int port=0);
+    void send(const Packet &out, int port=0);
+    // Like send(), but safe to call from interrupt handlers and other threads.
+    // The packet enters the connection on the next Network::runTick()
+    void post(const Packet &out, int port=0);
+
+    // Send @length bytes as a single MsgBuffer. Falls back to a bracketed stream
+    // when the data does not fit in a block or the pool is exhausted
+    void sendBuffer(const unsigned char *data, int length, int port=0);
+    void sendText(const char *str, int port=0);
+    // Contents of a MsgBuffer received in process(), or allocated with allocateBuffer()
+    unsigned char *bufferData(const Packet &buffer);
+    // For filling a buffer in place. The caller must releaseBuffer() after sending it
+    Packet allocateBuffer(int length, bool text=false);
+    void releaseBuffer(const Packet &buffer);
+
+    // Receive MsgTick on every Network::runTick(). Components which do not subscribe
+    // (the default, unless "ticks" is set in components.json) never get ticks
+    void subscribeTicks(bool enable=true);
+    // Receive a single MsgTick once TimerCurrentMs() has reached @deadline.
+    // Replaces any existing subscription, lets the Network sleep until then
+    void scheduleTick(unsigned long deadline);
+
+    // Receive Packet(@timer) on TIMER_PORT in @ms, and then every @ms if @periodic.
+    // @timer is any number >= 0 chosen by the component. Starting a running timer
+    // starts it over. Returns false if the Network has no free timers
+    bool startTimer(int timer, unsigned long ms, bool periodic=false);
+    void stopTimer(int timer);
+
+    // IOCompletionFunction for asynchronous IO, with the component as @user. The outcome
+    // arrives on a later tick as a MsgBoolean on IO_COMPLETION_PORT
+    static void ioCompletion(void *user, bool ok);
+
     IO *io;
 private:
-    void connect(int outPort, Component *target, int targetPort);
     void setNetwork(Network *net, int n, IO *io);
+    void sendBracketed(const unsigned char *data, int length, bool text, int port);
+    // The bracketed stream adapter, for ports which do not accept buffers
+    void expandBuffer(const Packet &buffer, int port);
 private:
-    Connection connections[MAX_PORTS]; // one per output port
+    unsigned char blockedOutputs; // number of OverflowBlock connections which are full
     Network *network;
     int nodeId; // identifier in the network
     int componentId; // what type of component this is
+    bool ticksRequested; // subscription requested before being added to a network
+    bool created; // by create(), so owned by the Network
+    unsigned char priority; // Priority
 };
 
 
@@ -221,25 +810,119 @@ private:
 #include <stddef.h>
 
 #define GRAPH_MAGIC 'u','C','/','F','l','o', '0', '1'
+#define GRAPH_MAGIC_V2 'u','C','/','F','l','o', '0', '2'
 const size_t GRAPH_MAGIC_SIZE = 8;
-const size_t GRAPH_CMD_SIZE = 1 + 7; // cmd + payload
-
+const size_t GRAPH_CMD_SIZE = 1 + 7; // cmd + payload, in v1
+
+// Version 1 streams have fixed-size commands of GRAPH_CMD_SIZE bytes, with one byte ids.
+// Version 2 commands are the opcode followed by its fields only. Ids, ports and capacities
+// are unsigned LEB128 varints, so host graphs may have more than 255 nodes.
+// SendPacket has the packet type byte, then a payload depending on the type:
+// a zigzag varint for MsgInteger, IEEE 754 little-endian for MsgFloat, one byte for MsgByte,
+// MsgAscii and MsgBoolean, and for MsgBuffer a varint (length << 1 | text) and the data.
+// End carries the CRC-16/CCITT-FALSE (little-endian) of the stream after the magic,
+// up to and including its opcode. On mismatch the network is reset.
+// After End, another stream of either version may follow. See commandformat.json
 class GraphStreamer {
 public:
     GraphStreamer();
     void setNetwork(Network *net) { network = net; }
     void parseByte(char b);
+    // Same as parseByte() on each byte, but v1 commands are executed in place
+    void parse(const unsigned char *data, size_t length);
+    // False after a malformed command, a CRC mismatch or running out of memory,
+    // the rest of the stream is ignored
+    bool isValid() const { return state != Invalid; }
+    // Checks a whole stream without loading it: the commands, and the CRC in format v2.
+    // Loading it may still fail if the network runs out of memory
+    static bool check(const unsigned char *data, size_t length);
 private:
     enum State {
         Invalid = -1,
         ParseHeader,
-        ParseCmd
+        ParseCmd,
+        ParseCmdV2
     };
 
-    Network *network;
+    void executeCommand(const unsigned char *cmd);
+    void parseByteV2(unsigned char b);
+    bool nextPartV2();
+    void executeCommandV2();
+    void sendPacket(int target, int targetPort, const Packet &pkg);
+
+    Network *network; // NULL when only checking the stream
     int currentByte;
     unsigned char buffer[GRAPH_CMD_SIZE];
     enum State state;
+
+    // v2 command being parsed. Varint fields go to @fields, single bytes to @buffer
+    unsigned char opcode;
+    unsigned char part; // 0 while waiting for the opcode, see nextPartV2()
+    unsigned char varintsLeft;
+    unsigned long bytesLeft;
+    unsigned char fieldCount;
+    unsigned long fields[5];
+    unsigned long varint;
+    unsigned char shift;
+    Packet payload; // MsgBuffer being filled, or MsgBracketStart if streamed as bytes
+    uint16_t crc;
+};
+
+// Live graph upload
+#ifdef HOST_BUILD
+const unsigned long UPLOAD_BUFFER_SIZE = 65536;
+#else
+#ifndef MICROFLO_UPLOAD_BUFFER_SIZE
+#define MICROFLO_UPLOAD_BUFFER_SIZE 256 // enough for MAX_NODES and MAX_CONNECTIONS in format v2
+#endif
+const unsigned long UPLOAD_BUFFER_SIZE = MICROFLO_UPLOAD_BUFFER_SIZE;
+#endif
+const unsigned char UPLOAD_MARKER = 0x7E;
+const int UPLOAD_FRAME_PAYLOAD = 32; // maximum
+const int UPLOAD_WINDOW = 2; // Data frames the host may send before waiting for an Ack
+const long UPLOAD_FRAME_TIMEOUT_MS = 100; // a partial frame is dropped after this long without a byte
+
+// Receives a new graph over serial while the current one keeps running.
+// Frames are the marker, kind (UploadFrame), sequence number, payload length, payload, and
+// the CRC-16/CCITT-FALSE (LE) of kind up to the end of the payload. Frames from the host are:
+// Begin (with the stream length), Data frames in sequence, then Commit. The device answers
+// with cumulative Acks, or a Nak with an UploadError and the sequence number it expects,
+// from which the host resends (go-back-N). The Ack of Begin carries the window,
+// the maximum payload and the buffer size (4 bytes LE) of the device.
+// The command stream is staged in RAM and loaded on Commit, from poll(), so the old graph
+// runs until then and the new one starts on the next tick. A stream which is malformed or
+// fails its CRC is answered with Nak InvalidGraph, and the old graph keeps running.
+// If the new graph fails to load anyway, out of memory, the network is left empty.
+// A stream which does not begin with Reset, like a DumpProfile query, runs against the
+// current graph, without sending it Setup again.
+// The serial device is shared with the graph, which should then not use SerialIn on it
+class GraphUploader {
+public:
+    GraphUploader(Network *net, IO *io, int serialDevice=0);
+    // Handle the bytes received on the serial device. Call between Network::runTick()
+    void poll();
+
+private:
+    void receiveByte(unsigned char b);
+    void handleFrame(UploadFrame kind, unsigned char seq, const unsigned char *payload, int length);
+    void commit(unsigned char seq);
+    void reply(UploadFrame kind, unsigned char seq, const unsigned char *payload, int length);
+    void nak(UploadError error);
+
+private:
+    Network *network;
+    IO *io;
+    int serialDevice;
+    unsigned char frame[4 + UPLOAD_FRAME_PAYLOAD + 2];
+    int frameLength;
+    long lastByteMs;
+    bool receiving;
+    unsigned char expectedSeq;
+    int lastCommitSeq; // -1 if none, for repeating the reply if the host resends Commit
+    UploadError lastCommitError;
+    unsigned long streamLength;
+    unsigned long staged;
+    unsigned char staging[UPLOAD_BUFFER_SIZE];
 };
 
 #endif // MICROFLO_H
@@ -0,0 +1,424 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+#include "microflo.h"
+
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+// Deterministic simulation of the device IO, with a virtual clock.
+// Instead of ticking in real time, run() lets the Network sleep when idle
+// (see Network::setSleepWhenIdle), and WaitForEvent() jumps the clock straight
+// to the next due event, so hours of device time take seconds.
+// Events are the tick deadlines requested by components, and stimuli scheduled
+// by the test: input pin levels, ADC values, serial input, interrupts, or a
+// callback, for instance a model of the physical system being controlled.
+// A tick which does not sleep costs @tickMicros of virtual time, so graphs with
+// components ticked on every runTick() (like SerialIn) are simulated much slower.
+// Single-threaded, interrupt handlers are called between ticks. Host only
+class SimulatorIO : public IO {
+public:
+    static const int MAX_PINS = 64;
+    static const int MAX_SERIAL = 4; // device -1 is the default, same as 0
+    static const int SERIAL_TX_BUFFER = 64; // bytes, like the transmit ring of an Arduino
+    static const int MAX_INTERRUPTS = 8;
+
+    typedef void (*StimulusFunction)(SimulatorIO *io, void *user);
+
+    // Called on every DigitalWrite, PwmWrite and SerialWrite, for tracing
+    enum Output {
+        OutputDigital,
+        OutputPwm,
+        OutputSerial
+    };
+    typedef void (*OutputFunction)(void *user, unsigned long timeMs, Output kind, int pin, long value);
+
+    SimulatorIO(long tickMicros=100)
+        : now(0)
+        , horizon(0)
+        , bounded(false)
+        , tickCost(tickMicros)
+        , eventPending(false)
+        , waited(false)
+        , eventSequence(0)
+        , outputFunc(0)
+        , outputUser(0)
+    {
+        memset(pins, 0, sizeof(pins));
+        for (int i=0; i<MAX_PINS; i++) {
+            pins[i].interrupt = -1;
+        }
+        memset(interrupts, 0, sizeof(interrupts));
+        memset(serialByteMicros, 0, sizeof(serialByteMicros));
+        memset(serialSentAt, 0, sizeof(serialSentAt));
+        // Arduino Uno
+        setInterruptForPin(2, 0);
+        setInterruptForPin(3, 1);
+    }
+
+    // Run @network for @durationMs of virtual time, applying stimuli as they become due
+    void run(Network *network, unsigned long durationMs) {
+        horizon = now + durationMs*1000ULL;
+        bounded = true;
+        network->setSleepWhenIdle(true);
+        while (now < horizon) {
+            step(network);
+        }
+    }
+    // Run @ticks calls of Network::runTick(). When idle with nothing scheduled,
+    // the clock stands still instead of jumping to the end
+    void runTicks(Network *network, long ticks) {
+        bounded = false;
+        network->setSleepWhenIdle(true);
+        for (long i=0; i<ticks; i++) {
+            step(network);
+        }
+    }
+    unsigned long long currentMicros() const { return now; }
+
+    // Stimuli, applied once the virtual clock reaches @timeMs
+    void scheduleDigitalInput(unsigned long timeMs, int pin, bool level) {
+        Event e(Event::DigitalInput, pin, level);
+        schedule(timeMs, e);
+    }
+    void scheduleAnalogInput(unsigned long timeMs, int pin, long value) {
+        Event e(Event::AnalogInput, pin, value);
+        schedule(timeMs, e);
+    }
+    void scheduleSerialInput(unsigned long timeMs, int device, const unsigned char *data, int length) {
+        Event e(Event::SerialInput, device, 0);
+        e.data.assign(data, data+length);
+        schedule(timeMs, e);
+    }
+    void scheduleInterrupt(unsigned long timeMs, int interrupt) {
+        Event e(Event::Interrupt, interrupt, 0);
+        schedule(timeMs, e);
+    }
+    // @func may schedule itself again, for periodic models
+    void scheduleCall(unsigned long timeMs, StimulusFunction func, void *user) {
+        Event e(Event::Call, 0, 0);
+        e.func = func;
+        e.user = user;
+        schedule(timeMs, e);
+    }
+
+    // Immediate stimuli. A changed input level fires the interrupt attached to the pin
+    void setDigitalInput(int pin, bool level) {
+        if (!validPin(pin)) {
+            return;
+        }
+        const bool before = DigitalRead(pin);
+        pins[pin].driven = true;
+        pins[pin].level = level;
+        const int interrupt = pins[pin].interrupt;
+        if (interrupt >= 0 && interruptTriggered(interrupts[interrupt].mode, before, level)) {
+            injectInterrupt(interrupt);
+        }
+    }
+    void setAnalogInput(int pin, long value) {
+        if (validPin(pin)) {
+            pins[pin].analog = value;
+        }
+    }
+    void injectSerialInput(int device, const unsigned char *data, int length) {
+        std::vector<unsigned char> &in = serialInput[serialIndex(device)];
+        in.insert(in.end(), data, data+length);
+    }
+    void injectInterrupt(int interrupt) {
+        if (interrupt >= 0 && interrupt < MAX_INTERRUPTS && interrupts[interrupt].func) {
+            interrupts[interrupt].func(interrupts[interrupt].user);
+        }
+    }
+    void setInterruptForPin(int pin, int interrupt) {
+        if (validPin(pin)) {
+            pins[pin].interrupt = interrupt;
+        }
+    }
+
+    // Observing outputs
+    bool digitalOutput(int pin) const { return validPin(pin) ? pins[pin].output : false; }
+    long pwmOutput(int pin) const { return validPin(pin) ? pins[pin].pwm : 0; }
+    bool isOutput(int pin) const { return validPin(pin) ? pins[pin].mode == OutputPin : false; }
+    const std::vector<unsigned char> &serialOutput(int device) const { return serialOut[serialIndex(device)]; }
+    void setOutputCallback(OutputFunction func, void *user) {
+        outputFunc = func;
+        outputUser = user;
+    }
+
+    // Implements IO
+    // Bulk writes go through a transmit buffer of SERIAL_TX_BUFFER bytes, which empties
+    // at the baudrate in virtual time. Single bytes are always taken, as if waiting for room
+    virtual void SerialBegin(int serialDevice, int baudrate) {
+        serialByteMicros[serialIndex(serialDevice)] = (baudrate > 0) ? 10000000L/baudrate : 0;
+    }
+    virtual long SerialDataAvailable(int serialDevice) {
+        return serialInput[serialIndex(serialDevice)].size();
+    }
+    virtual unsigned char SerialRead(int serialDevice) {
+        std::vector<unsigned char> &in = serialInput[serialIndex(serialDevice)];
+        if (in.empty()) {
+            return '\0';
+        }
+        const unsigned char b = in.front();
+        in.erase(in.begin());
+        return b;
+    }
+    virtual void SerialWrite(int serialDevice, unsigned char b) {
+        serialOut[serialIndex(serialDevice)].push_back(b);
+        notifyOutput(OutputSerial, serialDevice, b);
+        transmit(serialIndex(serialDevice), 1);
+    }
+    virtual long SerialRead(int serialDevice, unsigned char *buffer, long length) {
+        std::vector<unsigned char> &in = serialInput[serialIndex(serialDevice)];
+        const long n = ((long)in.size() < length) ? (long)in.size() : length;
+        if (n > 0) {
+            std::copy(in.begin(), in.begin()+n, buffer);
+            in.erase(in.begin(), in.begin()+n);
+        }
+        return n;
+    }
+    virtual long SerialWrite(int serialDevice, const unsigned char *buffer, long length) {
+        const int device = serialIndex(serialDevice);
+        long n = length;
+        if (serialByteMicros[device] > 0) {
+            const long room = SERIAL_TX_BUFFER - serialTxQueued(device);
+            n = (room < length) ? room : length;
+        }
+        for (long i=0; i<n; i++) {
+            serialOut[device].push_back(buffer[i]);
+            notifyOutput(OutputSerial, serialDevice, buffer[i]);
+        }
+        transmit(device, n);
+        return n;
+    }
+
+    virtual void PinSetMode(int pin, PinMode mode) {
+        if (validPin(pin)) {
+            pins[pin].mode = mode;
+        }
+    }
+    virtual void PinEnablePullup(int pin, bool enable) {
+        if (validPin(pin)) {
+            pins[pin].pullup = enable;
+        }
+    }
+
+    virtual void DigitalWrite(int pin, bool val) {
+        if (validPin(pin)) {
+            pins[pin].output = val;
+        }
+        notifyOutput(OutputDigital, pin, val);
+    }
+    virtual bool DigitalRead(int pin) {
+        if (!validPin(pin)) {
+            return false;
+        }
+        const PinState &p = pins[pin];
+        if (p.mode == OutputPin) {
+            return p.output;
+        }
+        return p.driven ? p.level : p.pullup;
+    }
+
+    virtual long AnalogRead(int pin) {
+        return validPin(pin) ? pins[pin].analog : 0;
+    }
+    virtual void PwmWrite(int pin, long dutyPercent) {
+        if (validPin(pin)) {
+            pins[pin].pwm = dutyPercent;
+        }
+        notifyOutput(OutputPwm, pin, dutyPercent);
+    }
+
+    virtual long TimerCurrentMs() {
+        return now/1000;
+    }
+    // Stands still within a tick, so process() takes no time in the simulation
+    virtual unsigned long TimerCurrentMicros() {
+        return now;
+    }
+
+    // Jumps to the next event, but not past @timeoutMs or the end of run()
+    virtual void WaitForEvent(long timeoutMs) {
+        waited = true;
+        if (eventPending) {
+            eventPending = false;
+            return;
+        }
+        unsigned long long target = horizon;
+        bool found = bounded;
+        if (timeoutMs >= 0 && (!found || now + timeoutMs*1000ULL < target)) {
+            target = now + timeoutMs*1000ULL;
+            found = true;
+        }
+        if (!events.empty() && (!found || events.begin()->first.first < target)) {
+            target = events.begin()->first.first;
+            found = true;
+        }
+        if (found && target > now) {
+            now = target;
+        }
+        runDueEvents();
+    }
+    virtual void NotifyEvent() {
+        eventPending = true;
+    }
+
+    virtual void AttachExternalInterrupt(int interrupt, IO::Interrupt::Mode mode,
+                                         IOInterruptFunction func, void *user) {
+        if (interrupt < 0 || interrupt >= MAX_INTERRUPTS) {
+            return;
+        }
+        interrupts[interrupt].mode = mode;
+        interrupts[interrupt].func = func;
+        interrupts[interrupt].user = user;
+    }
+    virtual void DetachExternalInterrupt(int interrupt) {
+        if (interrupt < 0 || interrupt >= MAX_INTERRUPTS) {
+            return;
+        }
+        interrupts[interrupt].func = 0;
+        interrupts[interrupt].user = 0;
+    }
+
+    virtual long PollCompletions() {
+        return completions.poll(TimerCurrentMs());
+    }
+    virtual void CancelCompletions(void *user) {
+        completions.cancel(user);
+    }
+    virtual void OneWireStartConversion(int pin, int resolution, IOCompletionFunction done, void *user) {
+        if (!completions.join(pin, done, user)) {
+            const long duration = oneWire.startConversion(pin, resolution);
+            completions.add(pin, TimerCurrentMs(), duration, duration >= 0, done, user);
+        }
+    }
+    virtual float OneWireTemperature(int pin, const unsigned char address[8]) {
+        return oneWire.temperature(pin, address);
+    }
+
+    // The sensors on the OneWire buses, and their conversion time in virtual time
+    OneWireMock oneWire;
+
+private:
+    struct PinState {
+        PinMode mode;
+        bool pullup;
+        bool driven; // externally, by a stimulus
+        bool level;
+        bool output;
+        long analog;
+        long pwm;
+        int interrupt;
+    };
+
+    struct InterruptState {
+        IO::Interrupt::Mode mode;
+        IOInterruptFunction func;
+        void *user;
+    };
+
+    struct Event {
+        enum Kind {
+            DigitalInput,
+            AnalogInput,
+            SerialInput,
+            Interrupt,
+            Call
+        };
+        Event(Kind k, int t, long v) : kind(k), target(t), value(v), func(0), user(0) {}
+        Kind kind;
+        int target; // pin, device or interrupt
+        long value;
+        std::vector<unsigned char> data;
+        StimulusFunction func;
+        void *user;
+    };
+    // By due time, then in the order scheduled
+    typedef std::pair<unsigned long long, unsigned long> EventKey;
+
+    void step(Network *network) {
+        waited = false;
+        runDueEvents();
+        network->runTick();
+        if (!waited) {
+            now += tickCost;
+        }
+    }
+
+    void schedule(unsigned long timeMs, const Event &e) {
+        events.insert(std::make_pair(EventKey(timeMs*1000ULL, eventSequence++), e));
+    }
+
+    void runDueEvents() {
+        while (!events.empty() && events.begin()->first.first <= now) {
+            const Event e = events.begin()->second;
+            events.erase(events.begin());
+            switch (e.kind) {
+            case Event::DigitalInput: setDigitalInput(e.target, e.value); break;
+            case Event::AnalogInput: setAnalogInput(e.target, e.value); break;
+            case Event::SerialInput: injectSerialInput(e.target, &e.data[0], e.data.size()); break;
+            case Event::Interrupt: injectInterrupt(e.target); break;
+            case Event::Call: e.func(this, e.user); break;
+            }
+        }
+    }
+
+    static bool interruptTriggered(IO::Interrupt::Mode mode, bool before, bool after) {
+        switch (mode) {
+        case IO::Interrupt::OnLow: return !after;
+        case IO::Interrupt::OnHigh: return after;
+        case IO::Interrupt::OnChange: return before != after;
+        case IO::Interrupt::OnRisingEdge: return !before && after;
+        case IO::Interrupt::OnFallingEdge: return before && !after;
+        }
+        return false;
+    }
+
+    void notifyOutput(Output kind, int pin, long value) {
+        if (outputFunc) {
+            outputFunc(outputUser, now/1000, kind, pin, value);
+        }
+    }
+
+    // Bytes written but not sent yet
+    long serialTxQueued(int device) const {
+        const long byteMicros = serialByteMicros[device];
+        if (byteMicros == 0 || serialSentAt[device] <= now) {
+            return 0;
+        }
+        return (serialSentAt[device] - now + byteMicros-1) / byteMicros;
+    }
+    void transmit(int device, long bytes) {
+        if (serialSentAt[device] < now) {
+            serialSentAt[device] = now;
+        }
+        serialSentAt[device] += bytes*serialByteMicros[device];
+    }
+
+    static bool validPin(int pin) { return pin >= 0 && pin < MAX_PINS; }
+    static int serialIndex(int device) { return (device > 0 && device < MAX_SERIAL) ? device : 0; }
+
+private:
+    unsigned long long now; // microseconds
+    unsigned long long horizon; // end of run()
+    bool bounded; // by horizon
+    long tickCost;
+    bool eventPending;
+    bool waited;
+    std::map<EventKey, Event> events;
+    unsigned long eventSequence;
+    PinState pins[MAX_PINS];
+    InterruptState interrupts[MAX_INTERRUPTS];
+    std::vector<unsigned char> serialInput[MAX_SERIAL];
+    std::vector<unsigned char> serialOut[MAX_SERIAL];
+    long serialByteMicros[MAX_SERIAL]; // 0 for no limit, until SerialBegin()
+    unsigned long long serialSentAt[MAX_SERIAL]; // when the last byte written is sent
+    OutputFunction outputFunc;
+    void *outputUser;
+    IOCompletions completions;
+};
@@ -20,4 +20,50 @@ describe('Commandstream generation', function(){
           assert.equal(out.toString("hex"), expect.toString("hex"));
     })
   })
+  describe('from a simple input FBP, in format v2', function(){
+      var input = "in(SerialIn) OUT -> IN f(Forward) OUT -> IN out(SerialOut)\n'-2' -> IN f\n'hi' -> IN f";
+      var expect = Buffer([117,67,47,70,108,111,48,50,
+                           10,11,8,11,3,11,9,
+                           12,0,1,0,0,0,0,12,1,2,0,0,0,0,
+                           13,1,0,7,3,13,1,0,11,5,104,105,
+                           14,49,119]);
+      it('parsing should give known valid output', function(){
+          var out = microflo.cmdStreamFromGraph(microflo.componentLib, fbp.parse(input), {version: 2});
+          assert.equal(out.toString("hex"), expect.toString("hex"));
+    })
+  })
+  describe('with conflating ports, in format v2', function(){
+      var input = "a(AnalogRead) OUT -> IN m(MapLinear) OUT -> DUTYCYCLE p(PwmWrite)";
+      var expect = Buffer([117,67,47,70,108,111,48,50,
+                           10,11,2,11,17,11,1,
+                           12,0,1,0,0,1,4,12,1,2,0,0,1,4,
+                           14,252,28]);
+      it('should connect them with a queue of one, which conflates', function(){
+          var out = microflo.cmdStreamFromGraph(microflo.componentLib, fbp.parse(input), {version: 2});
+          assert.equal(out.toString("hex"), expect.toString("hex"));
+      })
+  })
+  describe('with node and edge priorities, in format v2', function(){
+      var graph = {
+          processes: { a: { component: "Forward", metadata: { priority: "high" } }, b: { component: "Forward" } },
+          connections: [ { src: { process: "a", port: "out" }, tgt: { process: "b", port: "in" },
+                           metadata: { priority: "low" } } ]
+      };
+      var expect = Buffer([117,67,47,70,108,111,48,50,
+                           10,11,3,11,3,
+                           16,0,1,
+                           12,0,1,0,0,0,0,
+                           17,0,1,0,0,3,
+                           14,227,51]);
+      it('should set them after creating and connecting', function(){
+          var out = microflo.cmdStreamFromGraph(microflo.componentLib, graph, {version: 2});
+          assert.equal(out.toString("hex"), expect.toString("hex"));
+      })
+      it('should reject unknown priorities', function(){
+          graph.processes.a.metadata.priority = "urgent";
+          assert.throws(function() {
+              microflo.cmdStreamFromGraph(microflo.componentLib, graph, {version: 2});
+          });
+      })
+  })
 })
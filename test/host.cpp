@@ -0,0 +1,840 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+// Tests of the runtime on host, without node or the addon, for what the addon does not expose:
+// buffer packets, asynchronous IO, bulk serial and the components using them, the executor,
+// graph loading and upload, and the trace stream, on SimulatorIO in virtual time.
+// Also built with MICROFLO_PROFILE as check-host-profile, which adds the profiling tests.
+// Usage: check-host. Exits with failure if a check fails
+
+#define MICROFLO_NO_MAIN
+#include "microflo.hpp"
+#include "simulator.hpp"
+#include "executor.hpp"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+static const char *currentTest = "";
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+#define CHECK_EQUAL(expected, actual) checkEqual((long)(expected), (long)(actual), #actual, __LINE__)
+
+static void check(bool ok, const char *what, int line) {
+    if (!ok) {
+        printf("FAIL %s: %s (line %d)\n", currentTest, what, line);
+        failures++;
+    }
+}
+
+static void checkEqual(long expected, long actual, const char *what, int line) {
+    if (expected != actual) {
+        printf("FAIL %s: %s is %ld, expected %ld (line %d)\n", currentTest, what, actual, expected, line);
+        failures++;
+    }
+}
+
+static void run(const char *name, void (*test)()) {
+    const int before = failures;
+    currentTest = name;
+    test();
+    if (failures == before) {
+        printf("ok   %s\n", name);
+    }
+}
+
+static std::string serialOutput(const SimulatorIO &io, int device) {
+    const std::vector<unsigned char> &out = io.serialOutput(device);
+    return std::string(out.begin(), out.end());
+}
+
+static int add(Network &net, ComponentId id) {
+    return net.addNode(Component::create(id));
+}
+
+// Sends "hello" as text when getting a packet on port 0. On port 1 it takes all free
+// buffers from the pool, and on port 2 gives them back
+class TextSource : public Component {
+public:
+    TextSource() : held(0) {}
+    virtual void process(const Packet &in, int port) {
+        if (port == 0 && in.isData()) {
+            sendText("hello");
+        } else if (port == 1) {
+            for (Packet b = allocateBuffer(1); b.isBuffer(); b = allocateBuffer(1)) {
+                holding[held++] = b;
+            }
+        } else if (port == 2) {
+            while (held > 0) {
+                releaseBuffer(holding[--held]);
+            }
+        }
+    }
+    Packet holding[MAX_BUFFERS];
+    int held;
+};
+
+// Keeps what arrives on its inputs, and when. Buffers are kept as their contents
+class Recorder : public Component {
+public:
+    virtual bool acceptsBuffers(int port) const { return true; }
+    virtual void process(const Packet &in, int port) {
+        if (port >= 0 && in.isData()) {
+            packets.push_back(in);
+            times.push_back(io->TimerCurrentMs());
+            if (in.isBuffer()) {
+                const unsigned char *data = bufferData(in);
+                buffers.push_back(std::string(data, data+in.bufferLength()));
+            }
+        }
+    }
+    std::vector<Packet> packets;
+    std::vector<long> times;
+    std::vector<std::string> buffers;
+};
+
+// Sends a buffer of the number of bytes it gets, counting up from 'a'
+class ByteSource : public Component {
+public:
+    ByteSource() : next(0) {}
+    virtual void process(const Packet &in, int port) {
+        if (in.isInteger()) {
+            unsigned char data[BUFFER_SIZE];
+            const int length = in.asInteger();
+            for (int i=0; i<length; i++) {
+                data[i] = 'a' + (next++ % 26);
+            }
+            sendBuffer(data, length);
+        }
+    }
+    long next;
+};
+
+// Sends the numbers up to the one it gets, in one process() call
+class Counter : public Component {
+public:
+    virtual void process(const Packet &in, int port) {
+        if (in.isInteger()) {
+            for (long i=0; i<in.asInteger(); i++) {
+                send(Packet(i), 0);
+            }
+        }
+    }
+};
+
+// Buffers
+static void testBufferPool() {
+    BufferPool pool;
+    CHECK_EQUAL(MAX_BUFFERS, pool.available());
+    CHECK(!pool.allocate(BUFFER_SIZE+1).isBuffer());
+
+    Packet all[MAX_BUFFERS];
+    for (int i=0; i<MAX_BUFFERS; i++) {
+        all[i] = pool.allocate(BUFFER_SIZE, i % 2);
+        CHECK(all[i].isBuffer());
+    }
+    CHECK_EQUAL(0, pool.available());
+    CHECK(!pool.allocate(1).isBuffer());
+    CHECK(all[1].isText() && !all[0].isText());
+
+    // A retained block is only free after the last release
+    pool.retain(all[0]);
+    pool.release(all[0]);
+    CHECK_EQUAL(0, pool.available());
+    pool.release(all[0]);
+    CHECK_EQUAL(1, pool.available());
+    CHECK(pool.allocate(3).isBuffer());
+
+    pool.reset();
+    CHECK_EQUAL(MAX_BUFFERS, pool.available());
+}
+
+static void testTextThroughDelimitToSerialOut() {
+    SimulatorIO io;
+    TextSource source;
+    Network net(&io);
+    const int src = net.addNode(&source);
+    const int forward = add(net, IdForward);
+    const int delimit = add(net, IdDelimit);
+    const int out = add(net, IdSerialOut);
+    net.connect(src, 0, forward, 0);
+    net.connect(forward, 0, delimit, 0);
+    net.connect(delimit, 0, out, SerialOutPorts::InPorts::in);
+    net.runSetup();
+
+    net.sendMessage(src, 0, Packet(1L));
+    net.sendMessage(src, 0, Packet(2L));
+    io.runTicks(&net, 10);
+    CHECK(serialOutput(io, 0) == "hello\rhello\r");
+    CHECK_EQUAL(MAX_BUFFERS, net.buffersAvailable());
+}
+
+static void testBufferFanOut() {
+    SimulatorIO io;
+    TextSource source;
+    Network net(&io);
+    const int src = net.addNode(&source);
+    const int forward = add(net, IdForward);
+    const int out1 = add(net, IdSerialOut);
+    const int out2 = add(net, IdSerialOut);
+    net.connect(src, 0, forward, 0);
+    net.connect(forward, 0, out1, SerialOutPorts::InPorts::in);
+    net.connect(forward, 0, out2, SerialOutPorts::InPorts::in);
+    net.runSetup();
+    net.sendMessage(out1, SerialOutPorts::InPorts::device, Packet(1L));
+    net.sendMessage(out2, SerialOutPorts::InPorts::device, Packet(2L));
+
+    // One block, referenced from both queues until delivered
+    net.sendMessage(src, 0, Packet(1L));
+    net.runTick();
+    CHECK_EQUAL(MAX_BUFFERS-1, net.buffersAvailable());
+    io.runTicks(&net, 10);
+    CHECK(serialOutput(io, 1) == "hello");
+    CHECK(serialOutput(io, 2) == "hello");
+    CHECK_EQUAL(MAX_BUFFERS, net.buffersAvailable());
+}
+
+static void testBracketedWhenPoolExhausted() {
+    SimulatorIO io;
+    TextSource source;
+    Network net(&io);
+    const int src = net.addNode(&source);
+    const int delimit = add(net, IdDelimit);
+    const int out = add(net, IdSerialOut);
+    // Room for the whole stream, as it is sent from one process() call
+    net.connect(src, 0, delimit, 0, 8);
+    net.connect(delimit, 0, out, SerialOutPorts::InPorts::in);
+    net.runSetup();
+
+    net.sendMessage(src, 1, Packet(1L));
+    net.sendMessage(src, 0, Packet(1L));
+    io.runTicks(&net, 20);
+    CHECK_EQUAL(MAX_BUFFERS, source.held);
+    CHECK(serialOutput(io, 0) == "hello\r");
+
+    net.sendMessage(src, 2, Packet(1L));
+    io.runTicks(&net, 2);
+    CHECK_EQUAL(MAX_BUFFERS, net.buffersAvailable());
+}
+
+// Asynchronous IO
+static void setAddress(Network &net, int node, const unsigned char address[8]) {
+    net.sendMessage(node, ReadDallasTemperaturePorts::InPorts::address, Packet(MsgBracketStart));
+    for (int i=0; i<8; i++) {
+        net.sendMessage(node, ReadDallasTemperaturePorts::InPorts::address, Packet(address[i]));
+    }
+    net.sendMessage(node, ReadDallasTemperaturePorts::InPorts::address, Packet(MsgBracketEnd));
+}
+
+static void testTemperatureAfterConversion() {
+    const int pin = 9;
+    const unsigned char address1[8] = { 0x28, 0x01, 0, 0, 0, 0, 0, 0x11 };
+    const unsigned char address2[8] = { 0x28, 0x02, 0, 0, 0, 0, 0, 0x22 };
+    SimulatorIO io;
+    Recorder out1;
+    Recorder out2;
+    Network net(&io);
+    io.oneWire.setConversionMs(100);
+    io.oneWire.setTemperature(pin, address1, 4.5);
+    io.oneWire.setTemperature(pin, address2, 21.0);
+
+    const int sensor1 = add(net, IdReadDallasTemperature);
+    const int sensor2 = add(net, IdReadDallasTemperature);
+    net.connect(sensor1, 0, net.addNode(&out1), 0);
+    net.connect(sensor2, 0, net.addNode(&out2), 0);
+    net.runSetup();
+    net.sendMessage(sensor1, ReadDallasTemperaturePorts::InPorts::pin, Packet((long)pin));
+    net.sendMessage(sensor2, ReadDallasTemperaturePorts::InPorts::pin, Packet((long)pin));
+    setAddress(net, sensor1, address1);
+    setAddress(net, sensor2, address2);
+    io.runTicks(&net, 5);
+
+    const unsigned long start = io.TimerCurrentMs();
+    net.sendMessage(sensor1, ReadDallasTemperaturePorts::InPorts::trigger, Packet(true));
+    io.run(&net, 40);
+    // The second node joins the conversion on the bus, which has latched the old value
+    io.oneWire.setTemperature(pin, address2, 22.0);
+    net.sendMessage(sensor2, ReadDallasTemperaturePorts::InPorts::trigger, Packet(true));
+    io.run(&net, 55);
+    CHECK_EQUAL(0, out1.packets.size());
+    CHECK_EQUAL(0, out2.packets.size());
+
+    io.run(&net, 10);
+    CHECK_EQUAL(1, out1.packets.size());
+    CHECK_EQUAL(1, out2.packets.size());
+    if (out1.packets.size() == 1 && out2.packets.size() == 1) {
+        CHECK(out1.packets[0].isFloat() && out1.packets[0].asFloat() == 4.5f);
+        CHECK(out2.packets[0].isFloat() && out2.packets[0].asFloat() == 21.0f);
+        CHECK(out1.times[0] - start >= 100);
+        CHECK_EQUAL(out1.times[0], out2.times[0]);
+    }
+
+    // A new trigger starts a new conversion
+    net.sendMessage(sensor2, ReadDallasTemperaturePorts::InPorts::trigger, Packet(true));
+    io.run(&net, 150);
+    CHECK_EQUAL(1, out1.packets.size());
+    CHECK_EQUAL(2, out2.packets.size());
+    if (out2.packets.size() == 2) {
+        CHECK(out2.packets[1].asFloat() == 22.0f);
+    }
+}
+
+// Serial
+static void testBulkSerial() {
+    SimulatorIO io;
+    Network net(&io);
+    unsigned char data[100];
+    for (int i=0; i<100; i++) {
+        data[i] = i;
+    }
+    // Not limited until the baudrate is set
+    CHECK_EQUAL(100, io.SerialWrite(1, data, 100));
+
+    io.SerialBegin(1, 9600);
+    CHECK_EQUAL(SimulatorIO::SERIAL_TX_BUFFER, io.SerialWrite(1, data, 100));
+    CHECK_EQUAL(0, io.SerialWrite(1, data, 100));
+    io.run(&net, 10); // for 9 bytes at 9600 baud
+    CHECK_EQUAL(9, io.SerialWrite(1, data, 100));
+    CHECK_EQUAL(100+SimulatorIO::SERIAL_TX_BUFFER+9, io.serialOutput(1).size());
+
+    unsigned char received[8];
+    io.injectSerialInput(1, data, 10);
+    CHECK_EQUAL(8, io.SerialRead(1, received, sizeof(received)));
+    CHECK(received[7] == 7);
+    CHECK_EQUAL(2, io.SerialDataAvailable(1));
+    CHECK_EQUAL(2, io.SerialRead(1, received, sizeof(received)));
+    CHECK(received[1] == 9);
+    CHECK_EQUAL(0, io.SerialRead(1, received, sizeof(received)));
+}
+
+static void testSerialInSendsOneBuffer() {
+    SimulatorIO io;
+    Recorder out;
+    Network net(&io);
+    const int in = add(net, IdSerialIn);
+    net.connect(in, 0, net.addNode(&out), 0);
+    net.runSetup();
+    net.sendMessage(in, SerialInPorts::InPorts::device, Packet(2L));
+    net.sendMessage(in, SerialInPorts::InPorts::baudrate, Packet(115200L));
+    io.runTicks(&net, 2);
+
+    const char text[] = "hello, world";
+    io.injectSerialInput(1, (const unsigned char *)text, 5); // not the device used
+    io.injectSerialInput(2, (const unsigned char *)text, sizeof(text)-1);
+    io.runTicks(&net, 3);
+    CHECK_EQUAL(1, out.buffers.size());
+    if (out.buffers.size() == 1) {
+        CHECK(out.buffers[0] == text);
+        CHECK(out.packets[0].isText());
+    }
+    CHECK_EQUAL(5, io.SerialDataAvailable(1));
+    CHECK_EQUAL(MAX_BUFFERS, net.buffersAvailable());
+}
+
+static void testSerialOutBackpressure() {
+    SimulatorIO io;
+    ByteSource source;
+    Recorder ready;
+    Recorder dropped;
+    Network net(&io);
+    const int src = net.addNode(&source);
+    const int out = add(net, IdSerialOut);
+    net.connect(src, 0, out, SerialOutPorts::InPorts::in);
+    net.connect(out, SerialOutPorts::OutPorts::ready, net.addNode(&ready), 0);
+    net.connect(out, SerialOutPorts::OutPorts::dropped, net.addNode(&dropped), 0);
+    net.runSetup();
+    net.sendMessage(out, SerialOutPorts::InPorts::device, Packet(3L));
+    net.sendMessage(out, SerialOutPorts::InPorts::baudrate, Packet(9600L));
+    io.runTicks(&net, 2);
+
+    // 64 bytes go to the transmit buffer, 512 are kept, and the rest is dropped
+    const long chunk = 250;
+    const long kept = SimulatorIO::SERIAL_TX_BUFFER + SERIAL_OUT_PENDING;
+    const unsigned long start = io.TimerCurrentMs();
+    for (int i=0; i<3; i++) {
+        net.sendMessage(src, 0, Packet(chunk));
+    }
+    io.runTicks(&net, 5);
+    CHECK_EQUAL(1, ready.packets.size());
+    if (ready.packets.size() >= 1) {
+        CHECK(ready.packets[0].isBool() && !ready.packets[0].asBool());
+    }
+    CHECK_EQUAL(1, dropped.packets.size());
+    if (dropped.packets.size() >= 1) {
+        CHECK_EQUAL(3*chunk - kept, dropped.packets.back().asInteger());
+    }
+
+    // Written at the baudrate, about 1 ms per byte
+    io.run(&net, 2000);
+    CHECK_EQUAL(2, ready.packets.size());
+    if (ready.packets.size() == 2) {
+        CHECK(ready.packets[1].asBool());
+        CHECK(ready.times[1] - start >= SERIAL_OUT_PENDING);
+        CHECK(ready.times[1] - start <= kept*2);
+    }
+    const std::string written = serialOutput(io, 3);
+    CHECK_EQUAL(kept, written.size());
+    for (size_t i=0; i<written.size(); i++) {
+        if (written[i] != 'a' + (char)(i % 26)) {
+            CHECK(written[i] == 'a' + (char)(i % 26));
+            break;
+        }
+    }
+    CHECK(serialOutput(io, 0).empty());
+    CHECK_EQUAL(MAX_BUFFERS, net.buffersAvailable());
+
+    // Dropped bytes are counted in total
+    for (int i=0; i<3; i++) {
+        net.sendMessage(src, 0, Packet(chunk));
+    }
+    io.runTicks(&net, 5);
+    CHECK_EQUAL(2, dropped.packets.size());
+    if (dropped.packets.size() == 2) {
+        CHECK_EQUAL(2*(3*chunk - kept), dropped.packets.back().asInteger());
+    }
+}
+
+// Executor
+
+static void testExecutorOverflowPolicies() {
+    SimulatorIO io;
+    WorkStealingExecutor executor(2);
+    Network net(&io, &executor);
+    Counter counter;
+    Recorder latest;
+    Recorder newest;
+    const int src = net.addNode(&counter);
+    const int conflated = net.addNode(&latest);
+    const int dropOldest = net.addNode(&newest);
+    net.connect(src, 0, conflated, 0, 0, OverflowConflate);
+    net.connect(src, 0, dropOldest, 0, 3, OverflowDropOldest);
+
+    // The workers start after the ingress queue is handled, so all 5 are queued first
+    net.sendMessage(src, 0, Packet(5L));
+    net.runTick();
+    CHECK_EQUAL(1, latest.packets.size());
+    if (latest.packets.size() == 1) {
+        CHECK_EQUAL(4, latest.packets[0].asInteger());
+    }
+    CHECK_EQUAL(3, newest.packets.size());
+    if (newest.packets.size() == 3) {
+        CHECK_EQUAL(2, newest.packets[0].asInteger());
+        CHECK_EQUAL(4, newest.packets[2].asInteger());
+    }
+    CHECK_EQUAL(0, net.connectionAt(0).dropped);
+    CHECK_EQUAL(2, net.connectionAt(1).dropped);
+}
+
+// Scheduling
+
+static void testIngressChargedToTick() {
+    SimulatorIO io;
+    Network net(&io);
+    Recorder recorder;
+    const int forward = add(net, IdForward);
+    const int sink = net.addNode(&recorder);
+    net.connect(forward, 0, sink, 0);
+
+    // What Forward sends for an external message is delivered in the same tick
+    net.sendMessage(forward, 0, Packet(1L));
+    net.runTick();
+    CHECK_EQUAL(1, recorder.packets.size());
+
+    // External messages use up the packet budget of the tick, the rest are left queued
+    net.setRunToCompletion(2);
+    for (long i=0; i<3; i++) {
+        net.sendMessage(forward, 0, Packet(i));
+    }
+    net.runTick();
+    CHECK_EQUAL(1, recorder.packets.size());
+    net.runTick();
+    CHECK_EQUAL(2, recorder.packets.size());
+    io.runTicks(&net, 2);
+    CHECK_EQUAL(4, recorder.packets.size());
+}
+
+// Graph loading
+
+static void testGraphWithManyIIPs() {
+    SimulatorIO io;
+    Network net(&io);
+    GraphStreamer streamer;
+    streamer.setNetwork(&net);
+    const int count = 2*MAX_EXTERNAL_MESSAGES;
+    std::vector<unsigned char> stream;
+    const unsigned char magic[GRAPH_MAGIC_SIZE] = { GRAPH_MAGIC };
+    stream.insert(stream.end(), magic, magic+GRAPH_MAGIC_SIZE);
+    const unsigned char reset[GRAPH_CMD_SIZE] = { GraphCmdReset };
+    stream.insert(stream.end(), reset, reset+GRAPH_CMD_SIZE);
+    const unsigned char create[GRAPH_CMD_SIZE] = { GraphCmdCreateComponent, IdForward };
+    stream.insert(stream.end(), create, create+GRAPH_CMD_SIZE);
+    for (int i=0; i<count; i++) {
+        const unsigned char send[GRAPH_CMD_SIZE] = { GraphCmdSendPacket, 0, 0, MsgInteger, (unsigned char)i };
+        stream.insert(stream.end(), send, send+GRAPH_CMD_SIZE);
+    }
+    streamer.parse(&stream[0], stream.size());
+    CHECK(streamer.isValid());
+    CHECK_EQUAL(0, net.externalMessagesDropped());
+
+    // The default queue blocks Forward along the way, the rest follow in later ticks
+    Recorder recorder;
+    const int sink = net.addNode(&recorder);
+    net.connect(0, 0, sink, 0);
+    io.runTicks(&net, count);
+    CHECK_EQUAL(count, recorder.packets.size());
+    for (int i=0; i<(int)recorder.packets.size(); i++) {
+        CHECK_EQUAL(i, recorder.packets[i].asInteger());
+    }
+}
+
+static void testConnectChecksNodeIds() {
+    SimulatorIO io;
+    Network net(&io);
+    for (int i=0; i<MAX_NODES; i++) {
+        add(net, IdForward);
+    }
+    net.connect(0, 0, MAX_NODES, 0);
+    net.connect(MAX_NODES, 0, 0, 0);
+    net.connect(-1, 0, 0, 0);
+    CHECK_EQUAL(0, net.connectionCount());
+    net.connect(0, 0, MAX_NODES-1, 0);
+    CHECK_EQUAL(1, net.connectionCount());
+}
+
+// Upload
+
+static uint16_t crc16(const unsigned char *data, size_t length) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i=0; i<length; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit=0; bit<8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+// Format v2 stream of @nodes Forward nodes in a chain. With @corrupt, the CRC does not match
+static std::vector<unsigned char> forwardChainStream(int nodes, bool corrupt) {
+    const unsigned char magic[GRAPH_MAGIC_SIZE] = { GRAPH_MAGIC_V2 };
+    std::vector<unsigned char> stream(magic, magic+GRAPH_MAGIC_SIZE);
+    std::vector<unsigned char> commands;
+    commands.push_back(GraphCmdReset);
+    for (int i=0; i<nodes; i++) {
+        commands.push_back(GraphCmdCreateComponent);
+        commands.push_back(IdForward);
+    }
+    for (int i=0; i<nodes-1; i++) {
+        const unsigned char connect[] = { GraphCmdConnectNodes, (unsigned char)i, (unsigned char)(i+1), 0, 0, 0, 0 };
+        commands.insert(commands.end(), connect, connect+sizeof(connect));
+    }
+    commands.push_back(GraphCmdEnd);
+    const uint16_t crc = crc16(&commands[0], commands.size()) ^ (corrupt ? 1 : 0);
+    commands.push_back(crc & 0xFF);
+    commands.push_back(crc >> 8);
+    stream.insert(stream.end(), commands.begin(), commands.end());
+    return stream;
+}
+
+static std::vector<unsigned char> uploadFrame(UploadFrame kind, unsigned char seq,
+                                              const unsigned char *payload, int length) {
+    std::vector<unsigned char> frame;
+    frame.push_back(UPLOAD_MARKER);
+    frame.push_back(kind);
+    frame.push_back(seq);
+    frame.push_back(length);
+    frame.insert(frame.end(), payload, payload+length);
+    const uint16_t crc = crc16(&frame[1], frame.size()-1);
+    frame.push_back(crc & 0xFF);
+    frame.push_back(crc >> 8);
+    return frame;
+}
+
+// Plays the host side of an upload over serial device 0, one frame per poll()
+class UploadHost {
+public:
+    UploadHost(SimulatorIO &io, GraphUploader &uploader) : io(io), uploader(uploader), read(0) {}
+
+    // Sends a frame and returns the kind of the reply. The error of a Nak goes to @error
+    UploadFrame send(UploadFrame kind, unsigned char seq, const unsigned char *payload=0, int length=0) {
+        std::vector<unsigned char> frame = uploadFrame(kind, seq, payload, length);
+        return sendRaw(frame);
+    }
+    UploadFrame sendRaw(const std::vector<unsigned char> &frame) {
+        io.injectSerialInput(0, &frame[0], frame.size());
+        uploader.poll();
+        const std::vector<unsigned char> &out = io.serialOutput(0);
+        if (out.size() < read+6) {
+            return (UploadFrame)0;
+        }
+        const UploadFrame kind = (UploadFrame)out[read+1];
+        seq = out[read+2];
+        error = (kind == UploadFrameNak) ? (UploadError)out[read+4] : UploadErrorNone;
+        read += 4 + out[read+3] + 2;
+        return kind;
+    }
+
+    // Data frames of @stream follow with sequence number 1
+    UploadFrame begin(const std::vector<unsigned char> &stream) {
+        const unsigned long length = stream.size();
+        const unsigned char total[] = { (unsigned char)length, (unsigned char)(length >> 8),
+                                        (unsigned char)(length >> 16), (unsigned char)(length >> 24) };
+        return send(UploadFrameBegin, 0, total, sizeof(total));
+    }
+
+    SimulatorIO &io;
+    GraphUploader &uploader;
+    size_t read;
+    unsigned char seq; // of the last reply
+    UploadError error;
+};
+
+static void testUploadReplacesGraph() {
+    SimulatorIO io;
+    Network net(&io);
+    GraphUploader uploader(&net, &io);
+    UploadHost host(io, uploader);
+    const std::vector<unsigned char> stream = forwardChainStream(3, false);
+
+    CHECK_EQUAL(UploadFrameAck, host.begin(stream));
+    unsigned char seq = 1;
+    for (size_t offset=0; offset<stream.size(); offset+=UPLOAD_FRAME_PAYLOAD) {
+        const int left = stream.size() - offset;
+        const int length = (left < UPLOAD_FRAME_PAYLOAD) ? left : UPLOAD_FRAME_PAYLOAD;
+        CHECK_EQUAL(UploadFrameAck, host.send(UploadFrameData, seq++, &stream[offset], length));
+    }
+    CHECK_EQUAL(UploadFrameAck, host.send(UploadFrameCommit, seq));
+    CHECK_EQUAL(3, net.nodeCount());
+    CHECK_EQUAL(2, net.connectionCount());
+}
+
+static void testUploadResendsAfterNak() {
+    SimulatorIO io;
+    Network net(&io);
+    GraphUploader uploader(&net, &io);
+    UploadHost host(io, uploader);
+    const std::vector<unsigned char> stream = forwardChainStream(8, false);
+    CHECK(stream.size() > 2*UPLOAD_FRAME_PAYLOAD && stream.size() <= 3*UPLOAD_FRAME_PAYLOAD);
+    const unsigned char *first = &stream[0];
+    const unsigned char *second = &stream[UPLOAD_FRAME_PAYLOAD];
+    const unsigned char *rest = &stream[2*UPLOAD_FRAME_PAYLOAD];
+    const int restLength = stream.size() - 2*UPLOAD_FRAME_PAYLOAD;
+    host.begin(stream);
+
+    // Corrupted on the way
+    std::vector<unsigned char> frame = uploadFrame(UploadFrameData, 1, first, UPLOAD_FRAME_PAYLOAD);
+    frame[10] ^= 0xFF;
+    CHECK_EQUAL(UploadFrameNak, host.sendRaw(frame));
+    CHECK_EQUAL(UploadErrorChecksum, host.error);
+    CHECK_EQUAL(1, host.seq);
+
+    // Lost, the one after it is refused and both are resent
+    CHECK_EQUAL(UploadFrameAck, host.send(UploadFrameData, 1, first, UPLOAD_FRAME_PAYLOAD));
+    CHECK_EQUAL(UploadFrameNak, host.send(UploadFrameData, 3, rest, restLength));
+    CHECK_EQUAL(UploadErrorSequence, host.error);
+    CHECK_EQUAL(2, host.seq);
+    CHECK_EQUAL(UploadFrameAck, host.send(UploadFrameData, 2, second, UPLOAD_FRAME_PAYLOAD));
+    CHECK_EQUAL(UploadFrameAck, host.send(UploadFrameData, 3, rest, restLength));
+
+    // A resent Commit, after the Ack was lost, gets the same answer
+    CHECK_EQUAL(UploadFrameAck, host.send(UploadFrameCommit, 4));
+    CHECK_EQUAL(UploadFrameAck, host.send(UploadFrameCommit, 4));
+    CHECK_EQUAL(8, net.nodeCount());
+}
+
+static void testCorruptUploadKeepsGraph() {
+    SimulatorIO io;
+    Network net(&io);
+    GraphUploader uploader(&net, &io);
+    UploadHost host(io, uploader);
+    net.addNode(Component::create(IdForward));
+    net.addNode(Component::create(IdForward));
+    net.connect(0, 0, 1, 0);
+
+    const std::vector<unsigned char> corrupt = forwardChainStream(3, true);
+    host.begin(corrupt);
+    CHECK_EQUAL(UploadFrameAck, host.send(UploadFrameData, 1, &corrupt[0], corrupt.size()));
+    CHECK_EQUAL(UploadFrameNak, host.send(UploadFrameCommit, 2));
+    CHECK_EQUAL(UploadErrorInvalidGraph, host.error);
+
+    // Cut short before End, valid up to there
+    const std::vector<unsigned char> stream = forwardChainStream(3, false);
+    const std::vector<unsigned char> truncated(stream.begin(), stream.end()-3);
+    host.begin(truncated);
+    CHECK_EQUAL(UploadFrameAck, host.send(UploadFrameData, 1, &truncated[0], truncated.size()));
+    CHECK_EQUAL(UploadFrameNak, host.send(UploadFrameCommit, 2));
+    CHECK_EQUAL(UploadErrorInvalidGraph, host.error);
+
+    CHECK_EQUAL(2, net.nodeCount());
+    CHECK_EQUAL(1, net.connectionCount());
+}
+
+// Trace
+
+// A trace record as decoded from the wire, by the offsets of TraceDecoder in microflo.js
+struct WireTraceRecord {
+    int event;
+    int connection;
+    int time;
+    int srcNode;
+    int srcPort;
+    int dstNode;
+    int dstPort;
+    int type;
+    long data;
+};
+
+static std::vector<WireTraceRecord> decodeTrace(const std::vector<unsigned char> &bytes) {
+    const size_t size = 17; // traceRecordSize in commandformat.json
+    std::vector<WireTraceRecord> records;
+    for (size_t i=0; i+size<=bytes.size(); i+=size) {
+        const unsigned char *b = &bytes[i];
+        CHECK(b[0] == TRACE_MARKER);
+        WireTraceRecord r;
+        r.event = b[1];
+        r.connection = b[2] | (b[3] << 8);
+        r.time = b[4] | (b[5] << 8);
+        r.srcNode = b[6] | (b[7] << 8);
+        r.srcPort = b[8];
+        r.dstNode = b[9] | (b[10] << 8);
+        r.dstPort = b[11];
+        r.data = (long)(int32_t)(b[12] | (b[13] << 8) | (b[14] << 16) | ((uint32_t)b[15] << 24));
+        r.type = b[16];
+        records.push_back(r);
+    }
+    CHECK_EQUAL(0, bytes.size() % size);
+    return records;
+}
+
+static void testTraceOfForward() {
+    SimulatorIO io;
+    Network net(&io);
+    Tracer tracer(&io, 1, 9600);
+    io.SerialBegin(1, 9600);
+    net.setTracer(&tracer);
+    const int forward = add(net, IdForward);
+    Recorder recorder;
+    const int sink = net.addNode(&recorder);
+    net.connect(forward, 0, sink, 0);
+    net.runSetup();
+    io.run(&net, 10);
+    net.sendMessage(forward, 0, Packet(42L));
+    // At 960 bytes per second, and never more than TRACE_DRAIN_BURST at once
+    io.run(&net, 1000);
+    CHECK_EQUAL(1, recorder.packets.size());
+
+    const std::vector<WireTraceRecord> records = decodeTrace(io.serialOutput(1));
+    const int none = 0xFFFF;
+    const int expected[][7] = {
+        // event, connection, source node and port, target node and port, integer value
+        { TraceEventAddNode, none, forward, 0xFF, none, 0xFF, IdForward },
+        { TraceEventAddNode, none, sink, 0xFF, none, 0xFF, -1 }, // not made by the factory
+        { TraceEventConnect, 0, forward, 0, sink, 0, -1 },
+        { TraceEventSend, none, none, 0xFF, forward, 0, 42 },
+        { TraceEventDeliver, none, none, 0xFF, forward, 0, 42 },
+        { TraceEventSend, 0, forward, 0, sink, 0, 42 },
+        { TraceEventDeliver, 0, forward, 0, sink, 0, 42 },
+    };
+    const int count = sizeof(expected)/sizeof(expected[0]);
+    CHECK_EQUAL(count, records.size());
+    for (int i=0; i<count && i<(int)records.size(); i++) {
+        const WireTraceRecord &r = records[i];
+        CHECK_EQUAL(expected[i][0], r.event);
+        CHECK_EQUAL(expected[i][1], r.connection);
+        CHECK_EQUAL(expected[i][2], r.srcNode);
+        CHECK_EQUAL(expected[i][3], r.srcPort);
+        CHECK_EQUAL(expected[i][4], r.dstNode);
+        CHECK_EQUAL(expected[i][5], r.dstPort);
+        if (expected[i][6] >= 0) {
+            CHECK_EQUAL(MsgInteger, r.type);
+            CHECK_EQUAL(expected[i][6], r.data);
+        }
+    }
+    CHECK(records.size() == count && records[3].time >= 10);
+    CHECK_EQUAL(0, tracer.dropped());
+}
+
+#ifdef MICROFLO_PROFILE
+// Profile
+
+static unsigned long readLE(const unsigned char *b, int bytes) {
+    unsigned long value = 0;
+    for (int i=0; i<bytes; i++) {
+        value |= (unsigned long)b[i] << (8*i);
+    }
+    return value;
+}
+
+static void testProfileSnapshot() {
+    SimulatorIO io;
+    Network net(&io);
+    const int forward = add(net, IdForward);
+    Recorder recorder;
+    const int sink = net.addNode(&recorder);
+    net.connect(forward, 0, sink, 0, 2, OverflowDropNewest);
+    net.runSetup();
+    for (long i=0; i<5; i++) {
+        net.sendMessage(forward, 0, Packet(i));
+    }
+    io.runTicks(&net, 5);
+    CHECK_EQUAL(2, recorder.packets.size());
+
+    net.writeProfile(1);
+    // As decoded by ProfileDecoder in microflo.js, see profileSnapshot in commandformat.json
+    const std::vector<unsigned char> &out = io.serialOutput(1);
+    const size_t nodeRecord = 20;
+    const size_t connectionRecord = 8;
+    CHECK_EQUAL(1 + 4 + 2*nodeRecord + connectionRecord + 2, out.size());
+    if (out.size() != 1 + 4 + 2*nodeRecord + connectionRecord + 2) {
+        return;
+    }
+    const unsigned char *b = &out[0];
+    CHECK(b[0] == PROFILE_MARKER);
+    CHECK_EQUAL(2, readLE(b+1, 2));
+    CHECK_EQUAL(1, readLE(b+3, 2));
+    const size_t crcOffset = out.size()-2;
+    CHECK_EQUAL(crc16(b+1, crcOffset-1), readLE(b+crcOffset, 2));
+
+    const unsigned char *node = b+5;
+    CHECK_EQUAL(5, readLE(node, 4)); // calls
+    CHECK(readLE(node+8, 4) <= readLE(node+4, 4)); // longest call, total
+    CHECK_EQUAL(5, readLE(node+12, 4)); // received
+    CHECK_EQUAL(5, readLE(node+16, 4)); // sent
+    node += nodeRecord;
+    CHECK_EQUAL(2, readLE(node, 4));
+    CHECK_EQUAL(2, readLE(node+12, 4));
+    CHECK_EQUAL(0, readLE(node+16, 4));
+
+    const unsigned char *connection = node + nodeRecord;
+    CHECK_EQUAL(2, readLE(connection, 2)); // capacity
+    CHECK_EQUAL(2, readLE(connection+2, 2)); // high-water mark
+    CHECK_EQUAL(3, readLE(connection+4, 4)); // dropped
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    run("BufferPool allocates, retains and releases blocks", testBufferPool);
+    run("text through Forward and Delimit to SerialOut releases its buffer", testTextThroughDelimitToSerialOut);
+    run("a buffer sent to two inputs is released after both deliveries", testBufferFanOut);
+    run("text is sent as a bracketed stream when the pool is exhausted", testBracketedWhenPoolExhausted);
+    run("ReadDallasTemperature sends after the conversion, shared by the bus", testTemperatureAfterConversion);
+    run("bulk serial reads and writes on SimulatorIO take what fits", testBulkSerial);
+    run("SerialIn sends the input of a tick as one text buffer", testSerialInSendsOneBuffer);
+    run("SerialOut keeps what does not fit, signals ready and counts dropped bytes", testSerialOutBackpressure);
+    run("the executor conflates and drops the oldest like the network", testExecutorOverflowPolicies);
+    run("external messages are delivered and charged within the tick", testIngressChargedToTick);
+    run("a graph may have more IIPs than fit the external queue", testGraphWithManyIIPs);
+    run("connecting by id ignores ids past the last node", testConnectChecksNodeIds);
+    run("an upload replaces the graph on Commit", testUploadReplacesGraph);
+    run("an upload resends from the frame after a Nak", testUploadResendsAfterNak);
+    run("a corrupt or truncated upload keeps the old graph running", testCorruptUploadKeepsGraph);
+    run("the trace stream has a record per graph change, send and delivery", testTraceOfForward);
+#ifdef MICROFLO_PROFILE
+    run("the profile snapshot has the counters of each node and connection", testProfileSnapshot);
+#endif
+    return failures ? 1 : 0;
+}
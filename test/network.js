@@ -7,6 +7,36 @@ var microflo = require("../microflo");
 var addon = require("../build/Release/MicroFlo.node");
 var assert = require("assert")
 
+var componentLib = new microflo.ComponentLibrary(require("../microflo/components.json"));
+var policies = require("../microflo/commandformat.json").overflowPolicies;
+
+var addForward = function(net) {
+    return net.addNode(componentLib.getComponent("Forward").id);
+}
+
+// Component keeping the values it gets in .actual, connected from output 0 of @node.
+// @capacity and @policy are those of the connection, the node id is in .node
+var sinkFor = function(net, node, capacity, policy) {
+    var sink = new addon.Component();
+    sink.actual = [];
+    sink.on("process", function(packet, port) {
+        if (port >= 0) {
+            sink.actual.push(packet.value);
+        }
+    });
+    sink.node = net.addNode(sink);
+    net.connect(node, 0, sink.node, 0, capacity || 0, policy || policies.Default.id);
+    return sink;
+}
+
+// Graph of two Forward nodes, 0 -> 1, as a v2 command stream
+var forwardPairStream = function() {
+    return microflo.cmdStreamFromGraph(componentLib, {
+        processes: { a: { component: "Forward" }, b: { component: "Forward" } },
+        connections: [ { src: { process: "a", port: "out" }, tgt: { process: "b", port: "in" } } ]
+    }, {version: 2});
+}
+
 describe('Network', function(){
   describe('sending packets into graph of Forward components', function(){
     it('should give the same packets out on other side', function(){
@@ -25,7 +55,6 @@ describe('Network', function(){
 
         // Host runtime impl.
         var net = new addon.Network();
-        var componentLib = new microflo.ComponentLibrary(require("../microflo/components.json"));
         var nodes = 7;
         var messages = [];
         for (var i=0; i<10; i++) {
@@ -54,6 +83,268 @@ describe('Network', function(){
         assert.deepEqual(compare.actual, compare.expected);
     })
   })
+  describe('a burst into a connection with a queue of two', function(){
+    var burst = function(policy) {
+        var net = new addon.Network();
+        var forward = addForward(net);
+        var sink = sinkFor(net, forward, 2, policy);
+        // All reach Forward in the same tick, before the queue is delivered
+        for (var i=0; i<5; i++) {
+            net.sendMessage(forward, 0, i);
+        }
+        net.runSetup();
+        for (i=0; i<10; i++) {
+            net.runTick();
+        }
+        sink.stats = net.queueStats().connections[0];
+        return sink;
+    }
+    it('should hold back the sender while full, with overflow=block', function(){
+        var sink = burst(policies.Block.id);
+        assert.deepEqual(sink.actual, [0, 1, 2, 3, 4]);
+        assert.equal(sink.stats.capacity, 2);
+        assert.equal(sink.stats.dropped, 0);
+    })
+    it('should keep the first packets and count the rest, with overflow=drop-newest', function(){
+        var sink = burst(policies.DropNewest.id);
+        assert.deepEqual(sink.actual, [0, 1]);
+        assert.equal(sink.stats.dropped, 3);
+    })
+    it('should keep the last packets and count the rest, with overflow=drop-oldest', function(){
+        var sink = burst(policies.DropOldest.id);
+        assert.deepEqual(sink.actual, [3, 4]);
+        assert.equal(sink.stats.dropped, 3);
+    })
+  })
+  describe('several values into a conflating connection in one tick', function(){
+    it('should only deliver the newest, from a queue of one', function(){
+        var net = new addon.Network();
+        var forward = addForward(net);
+        var sink = sinkFor(net, forward, 0, policies.Conflate.id);
+        [3, 1, 4].forEach(function(value) {
+            net.sendMessage(forward, 0, value);
+        });
+        net.runSetup();
+        net.runTicks(5);
+        assert.deepEqual(sink.actual, [4]);
+        var stats = net.queueStats().connections[0];
+        assert.equal(stats.capacity, 1);
+        assert.equal(stats.policy, policies.Conflate.id);
+        assert.equal(stats.dropped, 0);
+    })
+  })
+  describe('connecting one output port to several inputs', function(){
+    it('should give every packet to each of them', function(){
+        var net = new addon.Network();
+        var forward = addForward(net);
+        var sinks = [];
+        for (var i=0; i<3; i++) {
+            sinks.push(sinkFor(net, forward));
+        }
+
+        var messages = [3, 1, 4];
+        for (i=0; i<messages.length; i++) {
+            net.sendMessage(forward, 0, messages[i]);
+        }
+        net.runSetup();
+        for (i=0; i<5; i++) {
+            net.runTick();
+        }
+        sinks.forEach(function(sink) {
+            assert.deepEqual(sink.actual, messages);
+        });
+    })
+  })
+  describe('bulk sending into a Forward chain, with a batching receiver', function(){
+    it('should give all packets in order, in one call per tick', function(){
+        var net = new addon.Network();
+        assert.ok(net.loadGraph(forwardPairStream()));
+
+        var actual = [];
+        var calls = 0;
+        var sink = new addon.Component();
+        sink.on("batch", function(ints, floats, count) {
+            calls++;
+            for (var i=0; i<count; i++) {
+                actual.push(ints[3*i+2]);
+            }
+        });
+        net.connect(1, 0, net.addNode(sink), 0, 255);
+        net.runSetup();
+
+        var total = 1000;
+        var messages = new Int32Array(3*total);
+        for (var i=0; i<total; i++) {
+            messages.set([0, 0, i], 3*i);
+        }
+        var sent = 0;
+        var ticks = 0;
+        while (sent < total) {
+            sent += net.sendMessages(messages.subarray(3*sent));
+            net.runTicks(1);
+            ticks++;
+        }
+        for (i=0; i<100 && actual.length < total; i++) {
+            net.runTicks(1);
+            ticks++;
+        }
+        assert.equal(actual.length, total);
+        for (i=0; i<total; i++) {
+            assert.equal(actual[i], i);
+        }
+        assert.ok(calls <= ticks);
+    })
+  })
+  describe('resetting and loading a graph again, several times', function(){
+    it('should start from an empty network each time', function(){
+        var net = new addon.Network();
+        var stream = forwardPairStream();
+        for (var i=0; i<10; i++) {
+            net.reset();
+            assert.ok(net.loadGraph(stream));
+            var sink = sinkFor(net, 1);
+            // Node ids are given in order, so this is the number of nodes loaded
+            assert.equal(sink.node, 2);
+            net.runSetup();
+            net.sendMessage(0, 0, i);
+            net.runTicks(5);
+            assert.deepEqual(sink.actual, [i]);
+        }
+    })
+  })
+  describe('running to completion', function(){
+    it('should pass a packet through a chain of nodes in one tick', function(){
+        var chain = function(budget) {
+            var net = new addon.Network();
+            var first = addForward(net);
+            var last = first;
+            for (var i=0; i<6; i++) {
+                var next = addForward(net);
+                net.connect(last, 0, next, 0);
+                last = next;
+            }
+            var sink = sinkFor(net, last);
+            net.setRunToCompletion(budget);
+            net.runSetup();
+            net.sendMessage(first, 0, 42);
+            net.runTick();
+            return sink.actual;
+        }
+        assert.deepEqual(chain(0), []);
+        assert.deepEqual(chain(100), [42]);
+    })
+    it('should stop a cycle at the budget, and go on with it in the next tick', function(){
+        var net = new addon.Network();
+        var a = addForward(net);
+        var b = addForward(net);
+        net.connect(a, 0, b, 0);
+        net.connect(b, 0, a, 0);
+        var sink = sinkFor(net, a);
+        var budget = 10;
+        net.setRunToCompletion(budget);
+        net.runSetup();
+        net.sendMessage(a, 0, 7);
+        net.runTick();
+        var first = sink.actual.length;
+        assert.ok(first > 1);
+        assert.ok(first <= budget);
+        net.runTick();
+        assert.ok(sink.actual.length > first);
+        assert.ok(sink.actual.length <= first + budget);
+        sink.actual.forEach(function(value) {
+            assert.equal(value, 7);
+        });
+    })
+  })
+  describe('running ticks with a time budget', function(){
+    it('should stop after the node which overran, and resume with the next one', function(){
+        var net = new addon.Network();
+        var ticked = [];
+        var slow = [];
+        for (var i=0; i<2; i++) {
+            var node = new addon.Component();
+            node.on("process", function(packet, port) {
+                if (packet.type == require("../microflo/commandformat.json").packetTypes.Tick.id) {
+                    ticked.push(this.id);
+                    var start = Date.now();
+                    while (Date.now() - start < 5) {
+                        ; // longer than the budget
+                    }
+                }
+            }.bind({ id: i }));
+            slow.push(net.addNode(node));
+        }
+        net.runSetup();
+        for (i=0; i<4; i++) {
+            net.runTick(1000);
+        }
+        assert.deepEqual(ticked, [0, 1, 0, 1]);
+        assert.equal(net.nodeOverruns(slow[0]), 2);
+        assert.equal(net.nodeOverruns(slow[1]), 2);
+    })
+  })
+  describe('a Timer with an interval', function(){
+    it('should send once per interval from its timer, and stop when disabled', function(){
+        var net = new addon.Network();
+        var timer = net.addNode(componentLib.getComponent("Timer").id);
+        var fired = [];
+        var sink = new addon.Component();
+        sink.on("process", function(packet, port) {
+            if (port >= 0) {
+                fired.push(Date.now());
+            }
+        });
+        net.connect(timer, 0, net.addNode(sink), 0);
+        net.runSetup();
+        net.sendMessage(timer, componentLib.inputPort("Timer", "interval").id, 10);
+        net.sendMessage(timer, componentLib.inputPort("Timer", "enable").id, 1);
+
+        var start = Date.now();
+        while (fired.length < 3 && Date.now() - start < 1000) {
+            net.runTick();
+        }
+        assert.equal(fired.length, 3);
+        assert.ok(fired[2] - start >= 30);
+
+        net.sendMessage(timer, componentLib.inputPort("Timer", "enable").id, 0);
+        net.runTick();
+        start = Date.now();
+        while (Date.now() - start < 30) {
+            net.runTick();
+        }
+        assert.equal(fired.length, 3);
+    })
+  })
+  describe('running on its own thread', function(){
+    it('should deliver packets to JavaScript asynchronously, and only advance as told with virtual time', function(done){
+        var net = new addon.Network();
+        var forward = addForward(net);
+        var actual = [];
+        var sink = new addon.Component();
+        sink.on("batch", function(ints, floats, count) {
+            for (var i=0; i<count; i++) {
+                actual.push(ints[3*i+2]);
+            }
+            if (actual.length == 3) {
+                net.stop();
+                assert.deepEqual(actual, [3, 1, 4]);
+                done();
+            }
+        });
+        net.connect(forward, 0, net.addNode(sink), 0);
+        net.runSetup();
+
+        net.start({virtualTime: true});
+        assert.throws(function() { net.runTick(); });
+        assert.throws(function() { net.queueStats(); });
+        assert.throws(function() { net.nodeOverruns(forward); });
+        net.sendMessages(new Int32Array([forward, 0, 3, forward, 0, 1, forward, 0, 4]));
+        setTimeout(function() {
+            assert.equal(actual.length, 0);
+            net.advance(2);
+        }, 20);
+    })
+  })
 })
 
 /*
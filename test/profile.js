@@ -0,0 +1,79 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+var microflo = require("../microflo");
+var assert = require("assert");
+
+var format = require("../microflo/commandformat.json");
+
+// Same CRC as the command stream, over everything after the marker
+var crc16 = function(buf) {
+    var crc = 0xFFFF;
+    for (var i = 0; i < buf.length; i++) {
+        crc ^= buf[i] << 8;
+        for (var j = 0; j < 8; j++) {
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) & 0xFFFF : (crc << 1) & 0xFFFF;
+        }
+    }
+    return crc;
+}
+
+// As written by Network::writeProfile(), see profileSnapshot in commandformat.json
+var profileSnapshot = function(nodes, connections) {
+    var s = format.profileSnapshot;
+    var body = new Buffer(4 + nodes.length*s.nodeRecordSize + connections.length*s.connectionRecordSize);
+    body.writeUInt16LE(nodes.length, 0);
+    body.writeUInt16LE(connections.length, 2);
+    var offset = 4;
+    nodes.forEach(function(n) {
+        for (var i=0; i<n.length; i++) {
+            body.writeUInt32LE(n[i], offset+4*i);
+        }
+        offset += s.nodeRecordSize;
+    });
+    connections.forEach(function(c) {
+        body.writeUInt16LE(c[0], offset);
+        body.writeUInt16LE(c[1], offset+2);
+        body.writeUInt32LE(c[2], offset+4);
+        offset += s.connectionRecordSize;
+    });
+    var crc = crc16(body);
+    return Buffer.concat([new Buffer([format.profileMarker]), body, new Buffer([crc & 0xFF, crc >> 8])]);
+}
+
+describe('Profile decoding', function(){
+  var graph = {
+      processes: { a: { component: "Forward" }, b: { component: "Forward" } },
+      connections: [ { src: { process: "a", port: "out" }, tgt: { process: "b", port: "in" } } ]
+  };
+  microflo.cmdStreamFromGraph(microflo.componentLib, graph);
+
+  describe('a snapshot', function(){
+      it('should have counters per node and per connection', function(){
+          var snapshots = [];
+          var decoder = new microflo.ProfileDecoder(graph, function(s) { snapshots.push(s); });
+          decoder.push(profileSnapshot([[10, 5000, 900, 7, 3], [3, 40, 20, 3, 0]], [[4, 3, 2]]));
+          assert.equal(snapshots.length, 1);
+          assert.deepEqual(snapshots[0].nodes[0],
+                           { node: "a", calls: 10, totalMicros: 5000, maxMicros: 900, received: 7, sent: 3 });
+          assert.equal(snapshots[0].nodes[1].node, "b");
+          assert.deepEqual(snapshots[0].connections, [ { capacity: 4, highWater: 3, dropped: 2 } ]);
+      })
+  })
+  describe('a snapshot after a stray marker byte, split across reads', function(){
+      it('should be decoded once complete', function(){
+          var snapshots = [];
+          var decoder = new microflo.ProfileDecoder(graph, function(s) { snapshots.push(s); });
+          // The stray marker announces 0xA6A6 nodes, far more than the snapshot has
+          var data = Buffer.concat([new Buffer([0x00, format.profileMarker]),
+                                    profileSnapshot([[1, 2, 3, 4, 5], [6, 7, 8, 9, 10]], [])]);
+          for (var i=0; i<data.length; i+=5) {
+              decoder.push(data.slice(i, i+5));
+          }
+          assert.equal(snapshots.length, 1);
+          assert.equal(snapshots[0].nodes[1].sent, 10);
+      })
+  })
+})
@@ -0,0 +1,71 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+var microflo = require("../microflo");
+var assert = require("assert");
+
+var format = require("../microflo/commandformat.json");
+
+// As written by Tracer::drain(), see TraceRecord in microflo/microflo.h
+var traceRecord = function(event, connection, time, srcNode, srcPort, dstNode, dstPort, type, data) {
+    var b = new Buffer(format.traceRecordSize);
+    b[0] = format.traceMarker;
+    b[1] = event;
+    b.writeUInt16LE(connection & 0xFFFF, 2);
+    b.writeUInt16LE(time, 4);
+    b.writeUInt16LE(srcNode & 0xFFFF, 6);
+    b[8] = srcPort & 0xFF;
+    b.writeUInt16LE(dstNode & 0xFFFF, 9);
+    b[11] = dstPort & 0xFF;
+    b.writeInt32LE(data, 12);
+    b[16] = type;
+    return b;
+}
+
+describe('Trace decoding', function(){
+  var graph = {
+      processes: { a: { component: "Forward" }, b: { component: "Forward" } },
+      connections: [ { src: { process: "a", port: "out" }, tgt: { process: "b", port: "in" } } ]
+  };
+  microflo.cmdStreamFromGraph(microflo.componentLib, graph);
+  var events = format.traceEvents;
+  var types = format.packetTypes;
+
+  describe('a send record', function(){
+      it('should have node and port names, and the packet value', function(){
+          var records = [];
+          var decoder = new microflo.TraceDecoder(microflo.componentLib, graph, function(r) { records.push(r); });
+          decoder.push(traceRecord(events.Send.id, 0, 1234, 0, 0, 1, 0, types.Integer.id, -42));
+          assert.equal(records.length, 1);
+          var r = records[0];
+          assert.equal(r.event, "Send");
+          assert.equal(r.time, 1234);
+          assert.equal(r.connection, 0);
+          assert.deepEqual(r.src, { node: "a", port: "out" });
+          assert.deepEqual(r.tgt, { node: "b", port: "in" });
+          assert.deepEqual(r.packet, { type: "Integer", value: -42 });
+          assert.equal(microflo.formatTraceRecord(r), "1234 SEND a out -> Integer:-42 -> b in #0");
+      })
+  })
+  describe('a stream starting mid-record and split across reads', function(){
+      it('should resynchronize on the marker', function(){
+          var records = [];
+          var decoder = new microflo.TraceDecoder(microflo.componentLib, graph, function(r) { records.push(r); });
+          var data = Buffer.concat([
+              traceRecord(events.Deliver.id, -1, 1, -1, -1, 0, 0, types.Boolean.id, 1).slice(5),
+              traceRecord(events.Dropped.id, -1, 2, -1, -1, -1, -1, types.Integer.id, 7),
+              traceRecord(events.Deliver.id, 0, 3, 0, 0, 1, 0, types.Boolean.id, 1)
+          ]);
+          for (var i=0; i<data.length; i+=5) {
+              decoder.push(data.slice(i, i+5));
+          }
+          assert.equal(records.length, 2);
+          assert.equal(records[0].event, "Dropped");
+          assert.equal(records[0].count, 7);
+          assert.equal(records[1].event, "Deliver");
+          assert.equal(records[1].packet.value, true);
+      })
+  })
+})
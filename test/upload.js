@@ -0,0 +1,76 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+var microflo = require("../microflo");
+var assert = require("assert");
+var events = require("events");
+
+var frames = require("../microflo/commandformat.json").uploadFrames;
+
+// Acknowledges frames in order like GraphUploader, with a window of 2 and 4 bytes per frame.
+// The reply to the frame with sequence number @loseReplyTo is lost, once
+var FakeDevice = function(loseReplyTo) {
+    var device = new events.EventEmitter();
+    var expected = 0;
+    device.received = new Buffer(0);
+    device.committed = false;
+    device.write = function(frame) {
+        var kind = frame[1];
+        var seq = frame[2];
+        var payload = frame.slice(4, 4 + frame[3]);
+        var reply = undefined;
+        if (kind == frames.Begin.id) {
+            expected = 1;
+            reply = microflo.uploadFrame(frames.Ack.id, 0, new Buffer([2, 4, 0, 1, 0, 0]));
+        } else if (seq != expected) {
+            reply = microflo.uploadFrame(frames.Ack.id, expected - 1);
+        } else {
+            if (kind == frames.Data.id) {
+                device.received = Buffer.concat([device.received, payload]);
+            } else if (kind == frames.Commit.id) {
+                device.committed = true;
+            }
+            reply = microflo.uploadFrame(frames.Ack.id, expected++);
+        }
+        if (seq === loseReplyTo && kind != frames.Begin.id) {
+            loseReplyTo = undefined;
+            return;
+        }
+        setImmediate(function() { device.emit("data", reply); });
+    };
+    return device;
+}
+
+describe('Live upload', function(){
+  describe('a frame', function(){
+      it('should have marker, kind, sequence number, length, payload and CRC', function(){
+          var frame = microflo.uploadFrame(frames.Begin.id, 0, new Buffer([5,0,0,0]));
+          assert.equal(frame.toString("hex"), Buffer([126,1,0,4,5,0,0,0,236,124]).toString("hex"));
+      })
+  })
+  describe('a command stream', function(){
+      var stream = new Buffer([1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18]);
+      it('should arrive complete and be committed', function(done){
+          var device = FakeDevice();
+          microflo.uploadGraph(device, stream, function(err, stats) {
+              assert.ifError(err);
+              assert.equal(device.received.toString("hex"), stream.toString("hex"));
+              assert.ok(device.committed);
+              assert.equal(stats.resent, 0);
+              done();
+          });
+      })
+      it('should be resent from the last acknowledged frame on a lost reply', function(done){
+          var device = FakeDevice(6); // Commit
+          microflo.uploadGraph(device, stream, function(err, stats) {
+              assert.ifError(err);
+              assert.equal(device.received.toString("hex"), stream.toString("hex"));
+              assert.ok(device.committed);
+              assert.ok(stats.resent > 0);
+              done();
+          }, {timeout: 20});
+      })
+  })
+})
@@ -0,0 +1,365 @@
+/* MicroFlo - Flow-Based Programming for microcontrollers
+ * Copyright (c) 2013 Jon Nordby <jononor@gmail.com>
+ * MicroFlo may be freely distributed under the MIT license
+ */
+
+// microflo-run: runs .fbcs command streams (from 'microflo.js generate', v1 or v2) on the host,
+// without node. Each graph is loaded through GraphStreamer and run on SimulatorIO,
+// once per stimulus script, for a virtual duration or a number of ticks.
+// Runs are forked, several at a time, so a crashing graph only fails its own run.
+//
+// Usage: microflo-run [options] GRAPH.fbcs...
+//   -s, --stimuli FILE   stimulus script, may be repeated. Default is no stimuli
+//   -d, --duration MS    virtual time to run each graph for (default 10000)
+//   -t, --ticks N        run N ticks instead of a duration
+//   -j, --jobs N         runs in parallel (default: number of processors)
+//   -o, --output DIR     write the output trace of each run to DIR/GRAPH.SCRIPT.trace
+//   -p, --packets        include packet deliveries in the trace
+//   -c, --complete N     run-to-completion, delivering up to N packets per tick
+//
+// Stimulus scripts have one event per line, '#' starts a comment:
+//   TIME digital PIN 0|1
+//   TIME analog PIN VALUE
+//   TIME serial DEVICE TEXT      (rest of the line, without newline)
+//   TIME interrupt NUMBER
+//   TIME packet NODE PORT VALUE  (integer, true or false, sent to an input port)
+// Traces use the same form for outputs (digital, pwm, serial with one byte value),
+// and 'TIME deliver CONNECTION TYPE VALUE' for packets (connection -1 is an IIP or stimulus).
+// One summary line per run is written to stdout.
+
+#define MICROFLO_NO_MAIN
+#include "microflo.hpp"
+#include "simulator.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <vector>
+
+struct MappedFile {
+    std::string path;
+    const unsigned char *data;
+    size_t size;
+};
+
+static bool mapFile(const char *path, MappedFile &file) {
+    file.path = path;
+    file.data = 0;
+    file.size = 0;
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    file.size = st.st_size;
+    if (file.size > 0) {
+        void *data = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        file.data = (const unsigned char *)data;
+    }
+    close(fd);
+    return true;
+}
+
+static std::string baseName(const std::string &path) {
+    const size_t slash = path.rfind('/');
+    std::string name = (slash == std::string::npos) ? path : path.substr(slash+1);
+    const size_t dot = name.rfind('.');
+    return (dot == std::string::npos || dot == 0) ? name : name.substr(0, dot);
+}
+
+// Per run state. Each run is a separate process, so notifications can use globals
+static FILE *trace = 0;
+static SimulatorIO *simulator = 0;
+
+static void traceOutput(void *user, unsigned long timeMs, SimulatorIO::Output kind, int pin, long value) {
+    static const char *names[] = { "digital", "pwm", "serial" };
+    fprintf(trace, "%lu %s %d %ld\n", timeMs, names[kind], pin, value);
+}
+
+// Buffers are traced with their length as value
+static void traceDelivery(int connection, Message m) {
+    const long value = m.pkg.isBuffer() ? m.pkg.bufferLength() : m.pkg.asInteger();
+    fprintf(trace, "%lu deliver %d %d %ld\n", (unsigned long)simulator->TimerCurrentMs(),
+            connection, m.pkg.type(), value);
+}
+
+struct PacketStimulus {
+    Network *network;
+    int node;
+    int port;
+    Packet pkg;
+
+    static void send(SimulatorIO *io, void *user) {
+        PacketStimulus *s = static_cast<PacketStimulus *>(user);
+        s->network->sendMessage(s->node, s->port, s->pkg);
+    }
+};
+
+// Returns the line number of the first error, or 0
+static int loadStimuli(const MappedFile &script, SimulatorIO &io, Network &net,
+                       std::vector<PacketStimulus *> &packets) {
+    const std::string text((const char *)script.data, script.size);
+    size_t start = 0;
+    for (int lineNo=1; start < text.size(); lineNo++) {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string line = text.substr(start, end-start);
+        start = end+1;
+        const size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+
+        unsigned long time;
+        char kind[16];
+        int target;
+        int consumed = 0;
+        if (sscanf(line.c_str(), " %lu %15s %d %n", &time, kind, &target, &consumed) < 3) {
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            return lineNo;
+        }
+        const char *rest = line.c_str() + consumed;
+        long value = 0;
+        if (strcmp(kind, "digital") == 0 && sscanf(rest, "%ld", &value) == 1) {
+            io.scheduleDigitalInput(time, target, value != 0);
+        } else if (strcmp(kind, "analog") == 0 && sscanf(rest, "%ld", &value) == 1) {
+            io.scheduleAnalogInput(time, target, value);
+        } else if (strcmp(kind, "serial") == 0) {
+            io.scheduleSerialInput(time, target, (const unsigned char *)rest, strlen(rest));
+        } else if (strcmp(kind, "interrupt") == 0) {
+            io.scheduleInterrupt(time, target);
+        } else if (strcmp(kind, "packet") == 0) {
+            int port;
+            char data[16];
+            if (sscanf(rest, "%d %15s", &port, data) != 2) {
+                return lineNo;
+            }
+            PacketStimulus *s = new PacketStimulus;
+            s->network = &net;
+            s->node = target;
+            s->port = port;
+            if (strcmp(data, "true") == 0 || strcmp(data, "false") == 0) {
+                s->pkg = Packet(strcmp(data, "true") == 0);
+            } else {
+                s->pkg = Packet(atol(data));
+            }
+            packets.push_back(s);
+            io.scheduleCall(time, &PacketStimulus::send, s);
+        } else {
+            return lineNo;
+        }
+    }
+    return 0;
+}
+
+struct Options {
+    long durationMs;
+    long ticks;
+    int jobs;
+    const char *outputDir;
+    bool packets;
+    long tickBudget;
+};
+
+// In the child process. Exit status 0 is success, 2 an invalid graph, 3 an invalid script
+static int runOne(const MappedFile &graph, const MappedFile *script, const Options &options) {
+    const std::string name = baseName(graph.path) + (script ? "." + baseName(script->path) : "");
+    SimulatorIO io;
+    Network *net = new Network(&io);
+    simulator = &io;
+    net->setRunToCompletion(options.tickBudget);
+
+    if (options.outputDir) {
+        const std::string path = std::string(options.outputDir) + "/" + name + ".trace";
+        trace = fopen(path.c_str(), "w");
+        if (!trace) {
+            fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+            return 1;
+        }
+        io.setOutputCallback(traceOutput, 0);
+        if (options.packets) {
+            net->setNotifications(0, traceDelivery, 0, 0);
+        }
+    }
+
+    GraphStreamer parser;
+    parser.setNetwork(net);
+    parser.parse(graph.data, graph.size);
+    if (!parser.isValid() || graph.size < GRAPH_MAGIC_SIZE) {
+        printf("%s: invalid graph\n", name.c_str());
+        return 2;
+    }
+
+    std::vector<PacketStimulus *> packets;
+    if (script) {
+        const int errorLine = loadStimuli(*script, io, *net, packets);
+        if (errorLine) {
+            printf("%s: invalid stimulus at %s:%d\n", name.c_str(), script->path.c_str(), errorLine);
+            return 3;
+        }
+    }
+
+    net->runSetup();
+    if (options.ticks > 0) {
+        io.runTicks(net, options.ticks);
+    } else {
+        io.run(net, options.durationMs);
+    }
+
+    unsigned int dropped = net->externalMessagesDropped();
+    for (int i=0; i<net->connectionCount(); i++) {
+        dropped += net->connectionAt(i).dropped;
+    }
+    printf("%s: ok, %llu ms, %zu bytes serial output, %u dropped\n", name.c_str(),
+           io.currentMicros()/1000, io.serialOutput(0).size(), dropped);
+    if (trace) {
+        fclose(trace);
+    }
+    return 0;
+}
+
+struct Run {
+    const MappedFile *graph;
+    const MappedFile *script;
+};
+
+static std::string describe(const Run &run) {
+    return baseName(run.graph->path) + (run.script ? "." + baseName(run.script->path) : "");
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-s stimuli]... [-d ms | -t ticks] [-j jobs] [-o dir] [-p] [-c budget] graph.fbcs...\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    options.durationMs = 10000;
+    options.ticks = 0;
+    options.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    options.outputDir = 0;
+    options.packets = false;
+    options.tickBudget = 0;
+    std::vector<const char *> scriptPaths;
+
+    static const struct option longOptions[] = {
+        { "stimuli", required_argument, 0, 's' },
+        { "duration", required_argument, 0, 'd' },
+        { "ticks", required_argument, 0, 't' },
+        { "jobs", required_argument, 0, 'j' },
+        { "output", required_argument, 0, 'o' },
+        { "packets", no_argument, 0, 'p' },
+        { "complete", required_argument, 0, 'c' },
+        { 0, 0, 0, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:d:t:j:o:pc:", longOptions, 0)) != -1) {
+        switch (opt) {
+        case 's': scriptPaths.push_back(optarg); break;
+        case 'd': options.durationMs = atol(optarg); break;
+        case 't': options.ticks = atol(optarg); break;
+        case 'j': options.jobs = atoi(optarg); break;
+        case 'o': options.outputDir = optarg; break;
+        case 'p': options.packets = true; break;
+        case 'c': options.tickBudget = atol(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (options.jobs < 1) {
+        options.jobs = 1;
+    }
+
+    // Mapped once, shared by all the children
+    std::vector<MappedFile> graphs(argc-optind);
+    std::vector<MappedFile> scripts(scriptPaths.size());
+    for (int i=optind; i<argc; i++) {
+        if (!mapFile(argv[i], graphs[i-optind])) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            return 1;
+        }
+    }
+    for (size_t i=0; i<scriptPaths.size(); i++) {
+        if (!mapFile(scriptPaths[i], scripts[i])) {
+            fprintf(stderr, "%s: %s\n", scriptPaths[i], strerror(errno));
+            return 1;
+        }
+    }
+
+    std::vector<Run> runs;
+    for (size_t g=0; g<graphs.size(); g++) {
+        if (scripts.empty()) {
+            Run r = { &graphs[g], 0 };
+            runs.push_back(r);
+        }
+        for (size_t s=0; s<scripts.size(); s++) {
+            Run r = { &graphs[g], &scripts[s] };
+            runs.push_back(r);
+        }
+    }
+
+    // Fork pool, at most @jobs children at a time
+    std::vector<pid_t> pids(runs.size(), 0);
+    size_t next = 0;
+    int running = 0;
+    int failed = 0;
+    fflush(stdout);
+    while (next < runs.size() || running > 0) {
+        if (next < runs.size() && running < options.jobs) {
+            const pid_t pid = fork();
+            if (pid == 0) {
+                const int status = runOne(*runs[next].graph, runs[next].script, options);
+                fflush(stdout);
+                _exit(status);
+            } else if (pid < 0) {
+                perror("fork");
+                return 1;
+            }
+            pids[next++] = pid;
+            running++;
+            continue;
+        }
+
+        int status;
+        const pid_t pid = wait(&status);
+        if (pid < 0) {
+            break;
+        }
+        running--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            continue;
+        }
+        failed++;
+        for (size_t i=0; i<runs.size(); i++) {
+            if (pids[i] == pid && WIFSIGNALED(status)) {
+                printf("%s: crashed, %s\n", describe(runs[i]).c_str(), strsignal(WTERMSIG(status)));
+                fflush(stdout);
+            }
+        }
+    }
+    return failed ? 2 : 0;
+}